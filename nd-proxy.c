@@ -36,13 +36,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <syslog.h>
-#include <glib.h>
-#include <glib-unix.h>
+#include <signal.h>
+#include <errno.h>
 
 #include <netinet/in.h>
 #include <netinet/ip6.h>
@@ -54,7 +55,7 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
 
 #include <linux/filter.h>
 
@@ -73,6 +74,10 @@
 	fprintf(stderr, fmt, ## args); \
 }
 
+/* Packets read with one recvmmsg call, and the size of each buffer */
+#define BATCH_SIZE  32
+#define BUFFER_SIZE 4096
+
 /* Proxy interface */
 typedef struct _iface_t {
 	char *name;
@@ -80,12 +85,23 @@ typedef struct _iface_t {
 	int ifindex;
 	uint8_t hwaddr[ETH_ALEN];
 	int fd;
-	guint src;
 } iface_t;
 
 /* Globals */
 static bool debug = false;
-static GList *ifaces = NULL;
+static volatile sig_atomic_t running = true;
+static iface_t *ifaces = NULL;
+static int n_ifaces = 0;
+
+/* Receive buffers, and the copies sent to each of the other interfaces */
+static uint8_t (*rx_bufs)[BUFFER_SIZE];
+static struct sockaddr_ll rx_addrs[BATCH_SIZE];
+static struct iovec rx_iovs[BATCH_SIZE];
+static struct mmsghdr rx_msgs[BATCH_SIZE];
+static uint8_t (*tx_bufs)[BUFFER_SIZE];
+static struct sockaddr_ll *tx_addrs;
+static struct iovec *tx_iovs;
+static struct mmsghdr *tx_msgs;
 
 /* Find the specified option in the ICMPv6 message */
 static struct nd_opt_hdr *
@@ -115,36 +131,38 @@ find_option(struct icmp6_hdr *icmp6_hdr, int len, uint8_t type)
 		return NULL;
 	}
 
-	/* Find the option */
+	/* Find the option. The length of an option is in units of 8 bytes,
+	 * and includes its header. */
 	nd_opt = (struct nd_opt_hdr *)((uint8_t *)icmp6_hdr + icmp_hlen);
 	len -= icmp_hlen;
-	while (len > 0) {
+	while (len >= (int)sizeof(struct nd_opt_hdr)) {
 		int opt_len = nd_opt->nd_opt_len * 8;
+		if (opt_len == 0 || opt_len > len)
+			return NULL;
 		if (nd_opt->nd_opt_type == type)
-			return nd_opt;
-		nd_opt = (struct nd_opt_hdr *)((uint8_t *)nd_opt +
-					sizeof(struct nd_opt_hdr) + opt_len);
-		len -= (sizeof(struct nd_opt_hdr) + opt_len);
+			return opt_len >= (int)sizeof(struct nd_opt_hdr) + ETH_ALEN ? nd_opt : NULL;
+		nd_opt = (struct nd_opt_hdr *)((uint8_t *)nd_opt + opt_len);
+		len -= opt_len;
 	}
 	return NULL;
 }
 
-/* Update the SLLA option in the packet (and checksum) */
+/* Update the SLLA or TLLA option in the packet (and checksum) */
 static void
-update_slla_option(struct icmp6_hdr *icmp6_hdr, int len, uint8_t *mac)
+update_lla_option(struct icmp6_hdr *icmp6_hdr, int len, uint8_t type, uint8_t *mac)
 {
 	struct nd_opt_hdr *nd_opt;
 
-	/* Find the "source link-layer address" option */
-	nd_opt = find_option(icmp6_hdr, len, ND_OPT_SOURCE_LINKADDR);
+	/* Find the "source/target link-layer address" option */
+	nd_opt = find_option(icmp6_hdr, len, type);
 
-	/* Update the slla if we found it */
+	/* Update the lla if we found it */
 	if (nd_opt) {
 		/* Option data is the mac address - it is always 16-bit aligned */
-		uint8_t *slla = (uint8_t *)nd_opt + sizeof(struct nd_opt_hdr);
+		uint8_t *lla = (uint8_t *)nd_opt + sizeof(struct nd_opt_hdr);
 
 		/* Update ICMPv6 header checksum based on the old and new mac adddress */
-		uint16_t *omac = (uint16_t *)slla;
+		uint16_t *omac = (uint16_t *)lla;
 		uint16_t *nmac = (uint16_t *)mac;
 		int i;
 		for (i = 0; i < ETH_ALEN / 2; i++) {
@@ -159,128 +177,208 @@ update_slla_option(struct icmp6_hdr *icmp6_hdr, int len, uint8_t *mac)
 		}
 
 		/* Copy the outgoing interface's hw addr into the
-		 * "source link-layer address" option in the pkt. */
-		memcpy(slla, mac, ETH_ALEN);
+		 * link-layer address option in the pkt. */
+		memcpy(lla, mac, ETH_ALEN);
 	}
 }
 
-/* Proxying of both RS and RA */
-static void
-proxy_rsra(iface_t *iface, uint8_t *msg, int len)
+static const char *type_to_string(uint8_t type)
 {
-	struct ether_header *eth_hdr;
-	struct ip6_hdr *ip6;
-	struct icmp6_hdr *icmp6_hdr;
-	struct sockaddr_ll socket_address;
+	switch (type) {
+	case ND_ROUTER_SOLICIT:
+		return "ND_ROUTER_SOLICIT";
+	case ND_ROUTER_ADVERT:
+		return "ND_ROUTER_ADVERT";
+	case ND_NEIGHBOR_SOLICIT:
+		return "ND_NEIGHBOR_SOLICIT";
+	case ND_NEIGHBOR_ADVERT:
+		return "ND_NEIGHBOR_ADVERT";
+	case ND_REDIRECT:
+		return "ND_REDIRECT";
+	default:
+		return "unknown";
+	}
+}
 
-	/* Parse the packet */
-	eth_hdr = (struct ether_header *)msg;
-	ip6 = (struct ip6_hdr *)(msg + sizeof(struct ether_header));
-	icmp6_hdr = (struct icmp6_hdr *)(msg + sizeof(struct ether_header) +
+/* Check that an ND packet can be proxied */
+static bool
+valid_nd(iface_t *iface, uint8_t *msg, int len)
+{
+	struct ether_header *eth_hdr = (struct ether_header *)msg;
+	struct ip6_hdr *ip6 = (struct ip6_hdr *)(msg + sizeof(struct ether_header));
+	struct icmp6_hdr *icmp6_hdr = (struct icmp6_hdr *)(msg + sizeof(struct ether_header) +
 				sizeof(struct ip6_hdr));
 
-	DEBUG("Tx(%s): %s\n", iface->name,
-			icmp6_hdr->icmp6_type == ND_ROUTER_SOLICIT ?
-					"ND_ROUTER_SOLICIT" : "ND_ROUTER_ADVERT");
-
 	/* Avoid proxying spoofed packets */
 	if (IN6_IS_ADDR_MULTICAST(&ip6->ip6_src)) {
-		DEBUG("Tx(%s): Ignoring RS/RA from spoofed address\n", iface->name);
-		return;
+		DEBUG("Rx(%s): Ignoring ND from spoofed address\n", iface->name);
+		return false;
+	}
+
+	/* ND packets must not have been forwarded by a router */
+	if (ip6->ip6_hlim != 255) {
+		DEBUG("Rx(%s): Ignoring ND with hop limit %d\n", iface->name, ip6->ip6_hlim);
+		return false;
 	}
 
 	/* RS should be sent to "All Routers Address" FF02::2 */
 	/* RA should be sent to "All Nodes Address" FF02::1 */
 	/* Can only proxy to multicast L2 destinations 33:33:.. */
-	if (!IN6_IS_ADDR_MULTICAST(&ip6->ip6_dst) ||
-		(eth_hdr->ether_dhost[0] != 0x33 && eth_hdr->ether_dhost[1] != 0x33)) {
-		DEBUG("Tx(%s): Ignoring RS/RA to non-multicast address\n", iface->name);
-		return;
+	if ((icmp6_hdr->icmp6_type == ND_ROUTER_SOLICIT ||
+		 icmp6_hdr->icmp6_type == ND_ROUTER_ADVERT) &&
+		(!IN6_IS_ADDR_MULTICAST(&ip6->ip6_dst) ||
+		(eth_hdr->ether_dhost[0] != 0x33 || eth_hdr->ether_dhost[1] != 0x33))) {
+		DEBUG("Rx(%s): Ignoring RS/RA to non-multicast address\n", iface->name);
+		return false;
 	}
 
+	return true;
+}
+
+/* Queue a copy of an ND packet for sending out of the specified interface */
+static void
+proxy_nd(iface_t *iface, uint8_t *msg, int len, int *n_tx)
+{
+	int slot = *n_tx;
+	uint8_t *copy = tx_bufs[slot];
+	struct ether_header *eth_hdr;
+	struct icmp6_hdr *icmp6_hdr;
+	struct sockaddr_ll *socket_address = &tx_addrs[slot];
+	uint8_t lla_type;
+
+	/* Each interface gets its own copy to rewrite */
+	memcpy(copy, msg, len);
+	eth_hdr = (struct ether_header *)copy;
+	icmp6_hdr = (struct icmp6_hdr *)(copy + sizeof(struct ether_header) +
+				sizeof(struct ip6_hdr));
+
+	DEBUG("Tx(%s): %s\n", iface->name, type_to_string(icmp6_hdr->icmp6_type));
+
+	/* Solicitations carry the link-layer address of the sender, while
+	 * adverts and redirects carry that of the target */
+	if (icmp6_hdr->icmp6_type == ND_NEIGHBOR_ADVERT ||
+		icmp6_hdr->icmp6_type == ND_REDIRECT)
+		lla_type = ND_OPT_TARGET_LINKADDR;
+	else
+		lla_type = ND_OPT_SOURCE_LINKADDR;
+
 	/* Copy the outgoing interface's hw addr into the
-	 * "source link-layer address" option in the pkt */
-	update_slla_option(icmp6_hdr, len - ((uint8_t *)icmp6_hdr - msg), iface->hwaddr);
+	 * link-layer address option in the pkt */
+	update_lla_option(icmp6_hdr, len - ((uint8_t *)icmp6_hdr - copy), lla_type, iface->hwaddr);
 
 	/* Copy the outgoing interface's hw addr into the
 	 * MAC source address in the pkt. */
 	memcpy((uint8_t *)(eth_hdr->ether_shost), iface->hwaddr, ETH_ALEN);
 
-	/* Send the packet */
-	socket_address.sll_ifindex = iface->ifindex;
-	socket_address.sll_halen = ETH_ALEN;
-	memcpy((uint8_t *)socket_address.sll_addr, iface->hwaddr, ETH_ALEN);
-	if (sendto (iface->fd, msg, len, 0, (struct sockaddr *)&socket_address,
-			sizeof(struct sockaddr_ll)) < 0) {
-		ERROR("Tx(%s): Failed to send packet\n", iface->name);
-		return;
-	}
+	/* A unicast packet was sent to us; without state we don't know the
+	 * destination's hw addr on the other side, so broadcast it there
+	 * and let the IPv6 destination pick it up */
+	if (!(eth_hdr->ether_dhost[0] & 0x01))
+		memset(eth_hdr->ether_dhost, 0xff, ETH_ALEN);
+
+	/* Queue the packet */
+	memset(socket_address, 0, sizeof(struct sockaddr_ll));
+	socket_address->sll_family = AF_PACKET;
+	socket_address->sll_protocol = htons(ETH_P_IPV6);
+	socket_address->sll_ifindex = iface->ifindex;
+	socket_address->sll_halen = ETH_ALEN;
+	memcpy((uint8_t *)socket_address->sll_addr, iface->hwaddr, ETH_ALEN);
+	tx_iovs[slot].iov_base = copy;
+	tx_iovs[slot].iov_len = len;
+	(*n_tx)++;
 }
 
-static gboolean
-handle_fd(gint fd, GIOCondition condition, gpointer data)
+/* Send the queued packets. A packet socket can send out of any
+ * interface, so the socket the batch was received on is used. */
+static void
+flush_tx(iface_t *iface, int n_tx)
 {
-	iface_t *iface = (iface_t *)data;
-	struct msghdr mhdr;
-	struct iovec iov;
-	struct sockaddr_ll t_saddr;
-	uint8_t msg[4096];
-	int size = 4096;
-	int len;
-
-	/* Receive a packet */
-	iov.iov_len = size;
-	iov.iov_base = (caddr_t)msg;
-	memset(&mhdr, 0, sizeof(mhdr));
-	mhdr.msg_name = (caddr_t)&t_saddr;
-	mhdr.msg_namelen = sizeof(struct sockaddr);
-	mhdr.msg_iov = &iov;
-	mhdr.msg_iovlen = 1;
-	if ((len = recvmsg(fd, &mhdr, 0)) < 0) {
-		DEBUG("Rx(%s):Interface has gone away\n", iface->name);
-		return true;
+	int sent = 0;
+
+	while (sent < n_tx) {
+		int ret = sendmmsg(iface->fd, tx_msgs + sent, n_tx - sent, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR("Tx(%d): Failed to send packet\n",
+				tx_addrs[sent].sll_ifindex);
+			sent++;
+			continue;
+		}
+		sent += ret;
 	}
+}
 
-	/* Check we have at least the icmp header */
-	if ((size_t) len < (ETH_HLEN + sizeof(struct ip6_hdr) + sizeof(struct icmp6_hdr))) {
-		ERROR("Rx(%s): Ignoring short packet (%d bytes)\n", iface->name, len);
-		return true;
-	}
+static void
+handle_fd(iface_t *iface)
+{
+	int count, i;
 
-	struct icmp6_hdr *icmp6_hdr = (struct icmp6_hdr *)(msg + ETH_HLEN + sizeof(struct ip6_hdr));
-	uint8_t icmp6_type = icmp6_hdr->icmp6_type;
-	switch (icmp6_type) {
-	case ND_ROUTER_SOLICIT:
-		DEBUG("Rx(%s): ND_ROUTER_SOLICIT\n", iface->name);
-		if (iface->flags & PROXY_RS) {
-			GList *iter;
-			for (iter = ifaces; iter; iter = g_list_next(iter)) {
-				iface_t *oiface = (iface_t *)iter->data;
-				if (oiface != iface)
-					proxy_rsra(oiface, msg, len);
-			}
+	/* Drain the socket, a batch at a time */
+	do {
+		int n_tx = 0;
+
+		for (i = 0; i < BATCH_SIZE; i++) {
+			rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+			rx_msgs[i].msg_len = 0;
 		}
-		break;
-	case ND_ROUTER_ADVERT:
-		DEBUG("Rx(%s): ND_ROUTER_ADVERT\n", iface->name);
-		if (iface->flags & PROXY_RA) {
-			GList *iter;
-			for (iter = ifaces; iter; iter = g_list_next(iter)) {
-				iface_t *oiface = (iface_t *)iter->data;
-				if (oiface != iface)
-					proxy_rsra(oiface, msg, len);
+		if ((count = recvmmsg(iface->fd, rx_msgs, BATCH_SIZE, MSG_DONTWAIT, NULL)) < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				DEBUG("Rx(%s):Interface has gone away\n", iface->name);
+			return;
+		}
+
+		for (i = 0; i < count; i++) {
+			uint8_t *msg = rx_bufs[i];
+			int len = rx_msgs[i].msg_len;
+
+			/* Check we have at least the icmp header */
+			if ((size_t) len < (ETH_HLEN + sizeof(struct ip6_hdr) + sizeof(struct icmp6_hdr))) {
+				ERROR("Rx(%s): Ignoring short packet (%d bytes)\n", iface->name, len);
+				continue;
+			}
+
+			struct icmp6_hdr *icmp6_hdr = (struct icmp6_hdr *)(msg + ETH_HLEN + sizeof(struct ip6_hdr));
+			uint8_t icmp6_type = icmp6_hdr->icmp6_type;
+			uint32_t flag;
+			int j;
+
+			switch (icmp6_type) {
+			case ND_ROUTER_SOLICIT:
+				flag = PROXY_RS;
+				break;
+			case ND_ROUTER_ADVERT:
+				flag = PROXY_RA;
+				break;
+			case ND_NEIGHBOR_SOLICIT:
+				flag = PROXY_NS;
+				break;
+			case ND_NEIGHBOR_ADVERT:
+				flag = PROXY_NA;
+				break;
+			case ND_REDIRECT:
+				flag = PROXY_RD;
+				break;
+			default:
+				DEBUG("Rx(%s): ignoring ICMPv6 packets of type %d\n", iface->name, icmp6_type);
+				continue;
+			}
+
+			DEBUG("Rx(%s): %s\n", iface->name, type_to_string(icmp6_type));
+
+			if (!(iface->flags & flag) || !valid_nd(iface, msg, len))
+				continue;
+
+			for (j = 0; j < n_ifaces; j++) {
+				if (&ifaces[j] != iface)
+					proxy_nd(&ifaces[j], msg, len, &n_tx);
 			}
 		}
-		break;
-	case ND_NEIGHBOR_SOLICIT:
-	case ND_NEIGHBOR_ADVERT:
-	case ND_REDIRECT:
-	default:
-		DEBUG("Rx(%s): ignoring ICMPv6 packets of type %d\n", iface->name, icmp6_type);
-		break;
-	}
 
-	return true;
+		/* One system call for all the copies of the batch */
+		if (n_tx)
+			flush_tx(iface, n_tx);
+	} while (count == BATCH_SIZE);
 }
 
 static char *flags_to_string(uint32_t flags)
@@ -307,38 +405,71 @@ static char *flags_to_string(uint32_t flags)
 	return sbuffer;
 }
 
-static struct sock_filter bpf_filter[] = {
+/* Build a filter that only accepts the ND packets that are proxied
+ * from the interface, so the kernel drops the rest */
+static int build_filter(uint32_t flags, struct sock_filter *filter)
+{
+	static const struct {
+		uint32_t flag;
+		uint8_t type;
+	} types[] = {
+		{ PROXY_RS, ND_ROUTER_SOLICIT },
+		{ PROXY_RA, ND_ROUTER_ADVERT },
+		{ PROXY_NS, ND_NEIGHBOR_SOLICIT },
+		{ PROXY_NA, ND_NEIGHBOR_ADVERT },
+		{ PROXY_RD, ND_REDIRECT },
+	};
+	uint8_t wanted[5];
+	int n = 0, len = 0, i, drop, keep;
+
+	for (i = 0; i < 5; i++) {
+		if (flags & types[i].flag)
+			wanted[n++] = types[i].type;
+	}
+	drop = 7 + n;
+	keep = 8 + n;
+
+	/* Load the packet type. */
+	filter[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		(u_int32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE));
+	/* Bail if it's a packet sent by this host, including our own
+	 * copies, which are sent through the socket of another interface. */
+	filter[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		PACKET_OUTGOING, (uint8_t)(drop - 2), 0);
 	/* Load the ether_type. */
-	BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
-		 offsetof(struct ether_header, ether_type)),
+	filter[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+		offsetof(struct ether_header, ether_type));
 	/* Bail if it's* not* ETHERTYPE_IPV6. */
-	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 0, 9),
+	filter[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		ETHERTYPE_IPV6, 0, (uint8_t)(drop - 4));
 	/* Load the next header type. */
-	BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
-		 sizeof(struct ether_header) + offsetof(struct ip6_hdr,
-							ip6_nxt)),
+	filter[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+		sizeof(struct ether_header) + offsetof(struct ip6_hdr, ip6_nxt));
 	/* Bail if it's* not* IPPROTO_ICMPV6. */
-	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 7),
+	filter[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		IPPROTO_ICMPV6, 0, (uint8_t)(drop - 6));
 	/* Load the ICMPv6 type. */
-	BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
-		 sizeof(struct ether_header) + sizeof(struct ip6_hdr) +
-		 offsetof(struct icmp6_hdr, icmp6_type)),
-	/* Bail if it's* not* ND */
-	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_ROUTER_SOLICIT, 4, 0),
-	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_ROUTER_ADVERT, 3, 0),
-	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_SOLICIT, 2, 0),
-	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_ADVERT, 1, 0),
-	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_REDIRECT, 0, 1),
-	/* Keep packet. */
-	BPF_STMT(BPF_RET | BPF_K, (u_int32_t)-1),
+	filter[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+		sizeof(struct ether_header) + sizeof(struct ip6_hdr) +
+		offsetof(struct icmp6_hdr, icmp6_type));
+	/* Keep the ND types proxied from this interface */
+	for (i = 0; i < n; i++) {
+		filter[len] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+			wanted[i], (uint8_t)(keep - (len + 1)), 0);
+		len++;
+	}
 	/* Drop packet. */
-	BPF_STMT(BPF_RET | BPF_K, 0)
-};
+	filter[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	/* Keep packet. */
+	filter[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (u_int32_t)-1);
+	return len;
+}
 
-static void iface_open(gpointer data, gpointer user)
+static void iface_open(iface_t *iface, int epfd)
 {
-	iface_t *iface = (iface_t *)data;
 	struct sockaddr_ll lladdr;
+	struct epoll_event ev;
+	struct sock_filter bpf_filter[16];
 	struct sock_fprog fprog;
 	struct ifreq ifr;
 	int on = 1;
@@ -377,8 +508,8 @@ static void iface_open(gpointer data, gpointer user)
 		exit(-1);
 	}
 
-	/* Setup a filter to only receive ND packets */
-	fprog.len = sizeof(bpf_filter) / sizeof(bpf_filter[0]);
+	/* Setup a filter to only receive the ND packets we proxy */
+	fprog.len = build_filter(iface->flags, bpf_filter);
 	fprog.filter = bpf_filter;
 	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
 		close(fd);
@@ -412,20 +543,23 @@ static void iface_open(gpointer data, gpointer user)
 
 	/* Watch for packets */
 	iface->fd = fd;
-	iface->src = g_unix_fd_add(fd, G_IO_IN, handle_fd, iface);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = iface;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		ERROR("Open(%s): Failed to watch interface\n", iface->name);
+		exit(-1);
+	}
 }
 
-static void iface_close(gpointer data)
+static void iface_close(iface_t *iface)
 {
-	iface_t *iface = (iface_t *)data;
 	DEBUG("Close(%s)\n", iface->name);
-	g_source_remove(iface->src);
 	close(iface->fd);
 	free(iface->name);
-	free(iface);
 }
 
-static iface_t *parse_interface(char *desc)
+static bool parse_interface(char *desc, iface_t *iface)
 {
 	char *name = NULL;
 	uint32_t flags = PROXY_RS | PROXY_RA;
@@ -446,26 +580,55 @@ static iface_t *parse_interface(char *desc)
 			else if (strcmp("RD", token) == 0)
 				flags |= PROXY_RD;
 			else
-				return NULL;
+				return false;
 			token = strtok(NULL, ",");
 		}
 		name = strndup(desc, pflags - desc);
 	} else {
 		name = strdup(desc);
 	}
-	iface_t *iface = (iface_t *)g_malloc0(sizeof(iface_t));
+	memset(iface, 0, sizeof(iface_t));
 	iface->name = name;
 	iface->flags = flags;
 	iface->fd = -1;
-	iface->src = 0;
-	return iface;
+	return true;
 }
 
-static gboolean termination_handler(gpointer arg1)
+static void termination_handler(int sig)
 {
-	GMainLoop *loop = (GMainLoop *) arg1;
-	g_main_loop_quit(loop);
-	return false;
+	running = false;
+}
+
+/* Allocate the batch buffers, once the number of interfaces is known */
+static void setup_buffers(void)
+{
+	int n_tx = BATCH_SIZE * (n_ifaces - 1);
+	int i;
+
+	rx_bufs = (uint8_t (*)[BUFFER_SIZE])calloc(BATCH_SIZE, BUFFER_SIZE);
+	tx_bufs = (uint8_t (*)[BUFFER_SIZE])calloc(n_tx, BUFFER_SIZE);
+	tx_addrs = (struct sockaddr_ll *)calloc(n_tx, sizeof(struct sockaddr_ll));
+	tx_iovs = (struct iovec *)calloc(n_tx, sizeof(struct iovec));
+	tx_msgs = (struct mmsghdr *)calloc(n_tx, sizeof(struct mmsghdr));
+	if (!rx_bufs || !tx_bufs || !tx_addrs || !tx_iovs || !tx_msgs) {
+		ERROR("ERROR: Out of memory\n");
+		exit(-1);
+	}
+
+	for (i = 0; i < BATCH_SIZE; i++) {
+		rx_iovs[i].iov_base = rx_bufs[i];
+		rx_iovs[i].iov_len = BUFFER_SIZE;
+		rx_msgs[i].msg_hdr.msg_name = &rx_addrs[i];
+		rx_msgs[i].msg_hdr.msg_iov = &rx_iovs[i];
+		rx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (i = 0; i < n_tx; i++) {
+		tx_msgs[i].msg_hdr.msg_name = &tx_addrs[i];
+		tx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+		tx_msgs[i].msg_hdr.msg_iov = &tx_iovs[i];
+		tx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 }
 
 void help(char *app_name)
@@ -482,7 +645,9 @@ int main(int argc, char *argv[])
 {
 	int i = 0;
 	bool background = false;
-	GMainLoop *loop = NULL;
+	struct epoll_event events[16];
+	struct sigaction sa;
+	int epfd;
 
 	/* Parse options */
 	while ((i = getopt(argc, argv, "hdbi:")) != -1) {
@@ -496,13 +661,13 @@ int main(int argc, char *argv[])
 			break;
 		case 'i':
 			{
-				iface_t *iface = parse_interface(optarg);
-				if (!iface) {
+				ifaces = (iface_t *)realloc(ifaces, (n_ifaces + 1) * sizeof(iface_t));
+				if (!ifaces || !parse_interface(optarg, &ifaces[n_ifaces])) {
 					help(argv[0]);
 					ERROR("ERROR: Invalid interface specification (%s)\n", optarg);
 					return 0;
 				}
-				ifaces = g_list_prepend(ifaces, iface);
+				n_ifaces++;
 				break;
 			}
 		case '?':
@@ -514,7 +679,7 @@ int main(int argc, char *argv[])
 	}
 
 	/* Check required */
-	if (g_list_length(ifaces) < 2) {
+	if (n_ifaces < 2) {
 		help(argv[0]);
 		ERROR("ERROR: Require at least 2 interfaces.\n");
 		return 0;
@@ -526,25 +691,39 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	/* Main loop instance */
-	loop = g_main_loop_new(NULL, true);
-
-	/* Handle SIGTERM/SIGINT/SIGPIPE gracefully */
-	g_unix_signal_add(SIGINT, termination_handler, loop);
-	g_unix_signal_add(SIGTERM, termination_handler, loop);
+	/* Handle SIGTERM/SIGINT gracefully */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = termination_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
 	/* Startup */
-	g_list_foreach(ifaces, iface_open, NULL);
+	if ((epfd = epoll_create1(0)) < 0) {
+		ERROR("ERROR: Unable to create epoll instance\n");
+		return -1;
+	}
+	setup_buffers();
+	for (i = 0; i < n_ifaces; i++)
+		iface_open(&ifaces[i], epfd);
 
 	/* Loop while not terminated */
-	g_main_loop_run(loop);
+	while (running) {
+		int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR("ERROR: Failed to wait for packets\n");
+			break;
+		}
+		for (i = 0; i < n; i++)
+			handle_fd((iface_t *)events[i].data.ptr);
+	}
 
 	/* Shutdown */
-	g_list_free_full(ifaces, iface_close);
-
-	/* Free the glib main loop */
-	if (loop)
-		g_main_loop_unref(loop);
+	for (i = 0; i < n_ifaces; i++)
+		iface_close(&ifaces[i]);
+	free(ifaces);
+	close(epfd);
 
 	return 0;
 }
@@ -30,6 +30,7 @@
 #include "ndppd.h"
 #include "address.h"
 #include "route.h"
+#include "netns.h"
 
 NDPPD_NS_BEGIN
 
@@ -368,45 +369,180 @@ void address::load(const std::string& path)
 
     logger::debug() << "reading IP addresses";
 
-    try {
-        std::ifstream ifs;
-        ifs.exceptions(std::ifstream::badbit | std::ifstream::failbit);
-        ifs.open(path.c_str(), std::ios::in);
-        ifs.exceptions(std::ifstream::badbit);
+    // Each namespace has addresses of its own, under the same path.
+    for (std::vector<std::string>::const_iterator n_it = netns::all().begin();
+            n_it != netns::all().end(); n_it++) {
+        netns::scope ns(*n_it);
+
+        if (!ns)
+            continue;
+
+        try {
+            std::ifstream ifs;
+            ifs.exceptions(std::ifstream::badbit | std::ifstream::failbit);
+            ifs.open(path.c_str(), std::ios::in);
+            ifs.exceptions(std::ifstream::badbit);
+
+            while (!ifs.eof()) {
+                char buf[1024];
+                ifs.getline(buf, sizeof(buf));
+
+                if (ifs.gcount() < 53) {
+                    if (ifs.gcount() > 0)
+                        logger::debug() << "skipping entry (size=" << ifs.gcount() << ")";
+                    continue;
+                }
+
+                address addr;
+
+                if (route::hexdec(buf, (unsigned char* )&addr.addr(), 16) != 16) {
+                    logger::warning() << "failed to load address (" << buf << ")";
+                    continue;
+                }
+                
+                addr.prefix(128);
+                
+                std::string iface = route::token(buf + 45);
+
+                address::add(addr, netns::qualify(iface));
+                
+                logger::debug() << "found local addr=" << addr << ", iface=" << iface;
+            }
+        } catch (std::ifstream::failure e) {
+            logger::warning() << "Failed to parse IPv6 address data from '" << path << "'";
+            logger::error() << e.what();
+        }
+    }
 
-        while (!ifs.eof()) {
-            char buf[1024];
-            ifs.getline(buf, sizeof(buf));
+    // Frames that ndppd builds itself, for the transmit rings or for
+    // adverts to a known link-layer address, are sent from the link-local
+    // address of the interface.
+    std::map<std::string, address> lladdrs;
 
-            if (ifs.gcount() < 53) {
-                if (ifs.gcount() > 0)
-                    logger::debug() << "skipping entry (size=" << ifs.gcount() << ")";
-                continue;
-            }
+    for (std::list<ptr<route> >::iterator it = _addresses.begin(); it != _addresses.end(); it++) {
+        if (IN6_IS_ADDR_LINKLOCAL(&(*it)->addr().const_addr()) && !lladdrs.count((*it)->ifname()))
+            lladdrs[(*it)->ifname()] = (*it)->addr();
+    }
 
-            address addr;
+    for (std::map<std::string, weak_ptr<iface> >::iterator it = iface::_map.begin();
+            it != iface::_map.end(); it++) {
+        if (!it->second)
+            continue;
 
-            if (route::hexdec(buf, (unsigned char* )&addr.addr(), 16) != 16) {
-                logger::warning() << "failed to load address (" << buf << ")";
-                continue;
-            }
-            
-            addr.prefix(128);
-            
-            std::string iface = route::token(buf + 45);
-
-            address::add(addr, iface);
-            
-            logger::debug() << "found local addr=" << addr << ", iface=" << iface;
-        }
-    } catch (std::ifstream::failure e) {
-        logger::warning() << "Failed to parse IPv6 address data from '" << path << "'";
-        logger::error() << e.what();
+        std::map<std::string, address>::iterator l_it = lladdrs.find(it->first);
+        it->second->link_local((l_it != lladdrs.end()) ? l_it->second : address());
     }
     
     logger::debug() << "completed IP addresses load";
 }
 
+address_set::address_set() :
+    _size(0)
+{
+}
+
+uint32_t address_set::hash(const struct in6_addr& addr)
+{
+    // The low bits vary the most, but mix in the prefix as well.
+    uint32_t h = addr.s6_addr32[3] ^ (addr.s6_addr32[2] * 0x9e3779b1);
+    h ^= (addr.s6_addr32[0] ^ addr.s6_addr32[1]) * 0x85ebca6b;
+    return h ^ (h >> 16);
+}
+
+const struct in6_addr& address_set::operator[](int i) const
+{
+    return (i < INLINE_SIZE) ? _inline[i] : _spill[i - INLINE_SIZE];
+}
+
+int address_set::find(const struct in6_addr& addr) const
+{
+    if (_slots.empty()) {
+        for (int i = 0; i < _size; i++) {
+            if (!memcmp(&_inline[i], &addr, sizeof(struct in6_addr)))
+                return i;
+        }
+
+        return -1;
+    }
+
+    size_t mask = _slots.size() - 1;
+
+    for (size_t n = hash(addr) & mask; _slots[n]; n = (n + 1) & mask) {
+        if (!memcmp(&(*this)[_slots[n] - 1], &addr, sizeof(struct in6_addr)))
+            return _slots[n] - 1;
+    }
+
+    return -1;
+}
+
+void address_set::rehash(size_t count)
+{
+    _slots.assign(count, 0);
+
+    size_t mask = count - 1;
+
+    for (int i = 0; i < _size; i++) {
+        size_t n = hash((*this)[i]) & mask;
+
+        while (_slots[n])
+            n = (n + 1) & mask;
+
+        _slots[n] = i + 1;
+    }
+}
+
+bool address_set::insert(const address& addr)
+{
+    const struct in6_addr& a = addr.const_addr();
+
+    if (find(a) >= 0)
+        return false;
+
+    if (_size < INLINE_SIZE) {
+        _inline[_size++] = a;
+        return true;
+    }
+
+    _spill.push_back(a);
+    _size++;
+
+    // Keep the load factor at or below 1/2.
+    if ((size_t)_size * 2 > _slots.size()) {
+        rehash(_slots.empty() ? INLINE_SIZE * 4 : _slots.size() * 2);
+    } else {
+        size_t mask = _slots.size() - 1, n = hash(a) & mask;
+
+        while (_slots[n])
+            n = (n + 1) & mask;
+
+        _slots[n] = _size;
+    }
+
+    return true;
+}
+
+bool address_set::contains(const address& addr) const
+{
+    return find(addr.const_addr()) >= 0;
+}
+
+int address_set::size() const
+{
+    return _size;
+}
+
+bool address_set::empty() const
+{
+    return _size == 0;
+}
+
+void address_set::clear()
+{
+    _spill.clear();
+    _slots.clear();
+    _size = 0;
+}
+
 void address::update(int elapsed_time)
 {
     if ((_c_ttl -= elapsed_time) <= 0) {
@@ -17,6 +17,8 @@
 
 #include <string>
 #include <list>
+#include <vector>
+#include <stdint.h>
 #include <netinet/ip6.h>
 
 #include "ndppd.h"
@@ -91,4 +93,46 @@ private:
     struct in6_addr _addr, _mask;
 };
 
+// A set of host addresses (masks are ignored) that keeps its entries in
+// insertion order. The first few entries are stored inline; once the set
+// grows beyond that, lookups go through an open-addressed hash table.
+class address_set {
+public:
+    address_set();
+
+    // Adds 'addr' to the set. Returns false if it was already present.
+    bool insert(const address& addr);
+
+    bool contains(const address& addr) const;
+
+    int size() const;
+
+    bool empty() const;
+
+    void clear();
+
+    // Returns the entry at index 'i', 0 <= i < size().
+    const struct in6_addr& operator[](int i) const;
+
+    static uint32_t hash(const struct in6_addr& addr);
+
+private:
+    enum { INLINE_SIZE = 4 };
+
+    struct in6_addr _inline[INLINE_SIZE];
+
+    // Entries beyond INLINE_SIZE.
+    std::vector<struct in6_addr> _spill;
+
+    // Hash table of entry indexes plus one; 0 marks an empty slot. Only
+    // used once the set has outgrown the inline storage.
+    std::vector<int> _slots;
+
+    int _size;
+
+    int find(const struct in6_addr& addr) const;
+
+    void rehash(size_t count);
+};
+
 NDPPD_NS_END
@@ -86,7 +86,8 @@ ptr<conf> conf::load(const std::string& path)
         ptr<conf> cf(new conf);
 
         if (cf->parse_block(&c_buf)) {
-            cf->dump(LOG_DEBUG);
+            if (logger::verbosity() >= LOG_DEBUG)
+                cf->dump(LOG_DEBUG);
             return cf;
         }
 
@@ -0,0 +1,287 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+
+#include "ndppd.h"
+#include "fib.h"
+#include "rtnl.h"
+
+NDPPD_NS_BEGIN
+
+std::vector<fib::group> fib::_groups;
+
+std::map<std::string, fib::table> fib::_tables;
+
+int fib::_prefix = 128;
+
+int fib::_density = 100;
+
+bool fib::addr_less::operator()(const struct in6_addr& a, const struct in6_addr& b) const
+{
+    // Network byte order, so this is also numerical order.
+    return memcmp(&a, &b, sizeof(struct in6_addr)) < 0;
+}
+
+bool fib::route_entry::operator<(const route_entry& re) const
+{
+    int n = memcmp(&dst, &re.dst, sizeof(struct in6_addr));
+
+    if (n)
+        return n < 0;
+
+    if (len != re.len)
+        return len < re.len;
+
+    return group < re.group;
+}
+
+int fib::group_id(const std::string& ns, int ifindex, const address& via, bool create)
+{
+    for (size_t i = 0; i < _groups.size(); i++) {
+        if (_groups[i].ifindex == ifindex && _groups[i].ns == ns &&
+            !memcmp(&_groups[i].via, &via.const_addr(), sizeof(struct in6_addr)))
+            return i;
+    }
+
+    if (!create)
+        return -1;
+
+    group g;
+    g.ns      = ns;
+    g.ifindex = ifindex;
+    g.via     = via.const_addr();
+
+    _groups.push_back(g);
+
+    return _groups.size() - 1;
+}
+
+struct in6_addr fib::block(const struct in6_addr& addr, int len)
+{
+    address a(addr, len);
+
+    struct in6_addr r;
+
+    for (int i = 0; i < 4; i++)
+        r.s6_addr32[i] = addr.s6_addr32[i] & a.mask().s6_addr32[i];
+
+    return r;
+}
+
+void fib::aggregate(int prefix, int density)
+{
+    // The size of a prefix has to fit in 64 bits.
+    _prefix  = std::min(128, std::max(96, prefix));
+    _density = std::min(100, std::max(1, density));
+}
+
+void fib::wire(const address& addr, const std::string& ns, int ifindex, const address& via)
+{
+    int g = group_id(ns, ifindex, via);
+
+    table& t = _tables[ns];
+
+    entry_map::iterator it = t.entries.find(addr.const_addr());
+
+    if (it == t.entries.end()) {
+        entry& e = t.entries[addr.const_addr()];
+        e.group = g;
+        e.refs[g] = 1;
+    } else if (it->second.group != g) {
+        logger::debug() << "fib::wire() " << addr << " moved";
+        it->second.group = g;
+        it->second.refs[g]++;
+    } else {
+        it->second.refs[g]++;
+        return;
+    }
+
+    t.dirty.insert(block(addr.const_addr(), _prefix));
+}
+
+void fib::unwire(const address& addr, const std::string& ns, int ifindex, const address& via)
+{
+    int g = group_id(ns, ifindex, via, false);
+
+    if (g < 0)
+        return;
+
+    table& t = _tables[ns];
+
+    entry_map::iterator it = t.entries.find(addr.const_addr());
+
+    if (it == t.entries.end())
+        return;
+
+    entry& e = it->second;
+
+    std::map<int, int>::iterator r_it = e.refs.find(g);
+
+    if (r_it == e.refs.end() || --r_it->second > 0)
+        return;
+
+    e.refs.erase(r_it);
+
+    if (e.refs.empty()) {
+        t.entries.erase(it);
+    } else if (e.group == g) {
+        logger::debug() << "fib::unwire() " << addr << " moved back";
+        e.group = e.refs.begin()->first;
+    } else {
+        return;
+    }
+
+    t.dirty.insert(block(addr.const_addr(), _prefix));
+}
+
+void fib::build(table& t, entry_map::iterator b, entry_map::iterator e,
+                const struct in6_addr& prefix, int len, std::set<route_entry>& routes)
+{
+    if (b == e)
+        return;
+
+    int g = b->second.group;
+    unsigned long long count = 0;
+    bool same = true;
+
+    for (entry_map::iterator it = b; it != e; it++, count++) {
+        if (it->second.group != g)
+            same = false;
+    }
+
+    route_entry re;
+
+    if (count == 1) {
+        re.dst   = b->first;
+        re.len   = 128;
+        re.group = g;
+        routes.insert(re);
+        return;
+    }
+
+    // Addresses that belong to different groups can't share a route.
+    if (same && (count * 100 >= (unsigned long long)_density << (128 - len))) {
+        re.dst   = prefix;
+        re.len   = len;
+        re.group = g;
+        routes.insert(re);
+        return;
+    }
+
+    // Split in two halves on the next bit.
+    struct in6_addr upper = prefix;
+    upper.s6_addr[len / 8] |= 0x80 >> (len % 8);
+
+    entry_map::iterator m = t.entries.lower_bound(upper);
+
+    build(t, b, m, prefix, len + 1, routes);
+    build(t, m, e, upper, len + 1, routes);
+}
+
+void fib::sync()
+{
+    for (std::map<std::string, table>::iterator t_it = _tables.begin(); t_it != _tables.end(); t_it++)
+        sync(t_it->first, t_it->second);
+}
+
+void fib::sync(const std::string& ns, table& t)
+{
+    for (std::set<struct in6_addr, addr_less>::iterator it = t.dirty.begin();
+            it != t.dirty.end(); it++) {
+        struct in6_addr last = *it;
+
+        for (int i = _prefix; i < 128; i++)
+            last.s6_addr[i / 8] |= 0x80 >> (i % 8);
+
+        std::set<route_entry> routes;
+
+        build(t, t.entries.lower_bound(*it), t.entries.upper_bound(last), *it, _prefix, routes);
+
+        std::set<route_entry>& installed = t.installed[*it];
+
+        std::vector<route_entry> diff;
+
+        std::set_difference(routes.begin(), routes.end(), installed.begin(), installed.end(),
+                            std::back_inserter(diff));
+
+        // New routes replace whatever was there for the same destination,
+        // so those must not be removed below.
+        std::set<route_entry> replaced;
+
+        for (std::vector<route_entry>::iterator r_it = diff.begin(); r_it != diff.end(); r_it++) {
+            const group& g = _groups[r_it->group];
+
+            rtnl::route(true, address(r_it->dst, r_it->len), ns, g.ifindex, address(g.via));
+
+            route_entry re = *r_it;
+            re.group = 0;
+            replaced.insert(re);
+        }
+
+        diff.clear();
+
+        std::set_difference(installed.begin(), installed.end(), routes.begin(), routes.end(),
+                            std::back_inserter(diff));
+
+        for (std::vector<route_entry>::iterator r_it = diff.begin(); r_it != diff.end(); r_it++) {
+            route_entry re = *r_it;
+            re.group = 0;
+
+            if (replaced.count(re))
+                continue;
+
+            const group& g = _groups[r_it->group];
+
+            rtnl::route(false, address(r_it->dst, r_it->len), ns, g.ifindex, address(g.via));
+        }
+
+        if (routes.empty())
+            t.installed.erase(*it);
+        else
+            installed.swap(routes);
+    }
+
+    t.dirty.clear();
+}
+
+void fib::dump_stats()
+{
+    int wired = 0, routes = 0, prefixes = 0;
+
+    for (std::map<std::string, table>::iterator t_it = _tables.begin(); t_it != _tables.end(); t_it++) {
+        const table& t = t_it->second;
+
+        wired += t.entries.size();
+
+        for (std::map<struct in6_addr, std::set<route_entry>, addr_less>::const_iterator it = t.installed.begin();
+                it != t.installed.end(); it++) {
+            routes += it->second.size();
+
+            for (std::set<route_entry>::const_iterator r_it = it->second.begin(); r_it != it->second.end(); r_it++) {
+                if (r_it->len < 128)
+                    prefixes++;
+            }
+        }
+    }
+
+    logger::notice()
+        << "fib: wired=" << wired << ", routes=" << routes
+        << " (prefixes=" << prefixes << ")";
+}
+
+NDPPD_NS_END
@@ -0,0 +1,115 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+
+#include <netinet/ip6.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Keeps track of the host routes installed by autowire. Hosts that share
+// an interface and gateway, and that are densely packed, are covered by a
+// single prefix route instead of one route each. Changes are collected
+// per block of addresses and programmed through rtnl by sync().
+class fib {
+public:
+    // Routes the host address 'addr' out of the specified interface of
+    // namespace 'ns', optionally via a gateway. Wiring an address that is
+    // already wired through another interface or gateway moves it.
+    static void wire(const address& addr, const std::string& ns, int ifindex, const address& via);
+
+    // Releases a reference taken by wire() with the same arguments. An
+    // address that is still wired elsewhere moves back there.
+    static void unwire(const address& addr, const std::string& ns, int ifindex, const address& via);
+
+    // Recomputes the routes of all blocks that have changed, and queues
+    // the difference with rtnl.
+    static void sync();
+
+    // Sets the shortest prefix that may be installed instead of host
+    // routes, and the percentage of its addresses that must be wired for
+    // that to happen. A prefix of 128 disables aggregation. Below 100%,
+    // the prefix also routes addresses that have never been wired.
+    static void aggregate(int prefix, int density);
+
+    static void dump_stats();
+
+private:
+    struct addr_less {
+        bool operator()(const struct in6_addr& a, const struct in6_addr& b) const;
+    };
+
+    struct group {
+        std::string ns;
+        int ifindex;
+        struct in6_addr via;
+    };
+
+    struct entry {
+        // Group that the address is routed through.
+        int group;
+
+        // References, by group.
+        std::map<int, int> refs;
+    };
+
+    struct route_entry {
+        struct in6_addr dst;
+        int len;
+        int group;
+
+        bool operator<(const route_entry& re) const;
+    };
+
+    typedef std::map<struct in6_addr, entry, addr_less> entry_map;
+
+    // The routing table of a namespace.
+    struct table {
+        entry_map entries;
+
+        // Blocks (addresses masked to _prefix) that need to be recomputed.
+        std::set<struct in6_addr, addr_less> dirty;
+
+        // Routes currently installed, per block.
+        std::map<struct in6_addr, std::set<route_entry>, addr_less> installed;
+    };
+
+    static std::vector<group> _groups;
+
+    // Tables, by namespace.
+    static std::map<std::string, table> _tables;
+
+    static int _prefix, _density;
+
+    // Returns the group of 'ifindex' and 'via', adding it if 'create'
+    // is set, or -1.
+    static int group_id(const std::string& ns, int ifindex, const address& via, bool create = true);
+
+    static struct in6_addr block(const struct in6_addr& addr, int len);
+
+    static void sync(const std::string& ns, table& t);
+
+    static void build(table& t, entry_map::iterator b, entry_map::iterator e,
+                      const struct in6_addr& prefix, int len, std::set<route_entry>& routes);
+};
+
+NDPPD_NS_END
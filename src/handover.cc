@@ -0,0 +1,605 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "ndppd.h"
+#include "handover.h"
+#include "fib.h"
+#include "rtnl.h"
+#include "netns.h"
+
+NDPPD_NS_BEGIN
+
+std::string handover::_path;
+
+int handover::_listen_fd = -1;
+
+int handover::_conn_fd = -1;
+
+bool handover::_handed_over = false;
+
+std::map<std::pair<std::string, int>, int> handover::_fds;
+
+std::map<std::string, handover::iface_state> handover::_states;
+
+std::vector<uint8_t> handover::_sessions;
+
+// Bumped whenever the records below change.
+static const uint32_t version = 1;
+
+enum {
+    MSG_IFACES = 1,
+    MSG_SHARED,
+    MSG_SESSIONS,
+    MSG_END,
+    MSG_READY
+};
+
+struct msg_hdr {
+    uint32_t version;
+    uint32_t type;
+    uint32_t count;
+};
+
+// Followed by the sockets flagged in 'fds', in the order IFD, PFD, TFD.
+struct iface_rec {
+    char name[IFNAMSIZ];
+    int32_t prev_allmulti, prev_promiscuous;
+    char prev_proxy_ndp[8], prev_proxy_delay[8];
+    uint32_t fds;
+};
+
+struct session_rec {
+    char proxy[IFNAMSIZ];
+    struct in6_addr taddr;
+    int32_t status, ttl, fails, touched;
+    int32_t wired_index;
+    struct in6_addr wired_via;
+    int32_t offloaded;
+};
+
+// Records per message. Keeps the number of descriptors per message well
+// below SCM_MAX_FD, and the size below the default socket buffer.
+static const int ifaces_per_msg   = 64;
+static const int sessions_per_msg = 512;
+
+static const size_t max_msg = sizeof(msg_hdr) + sessions_per_msg * sizeof(session_rec);
+
+static bool send_msg(int fd, uint32_t type, uint32_t count, const void* data, size_t len,
+                     const std::vector<int>& fds)
+{
+    msg_hdr hdr;
+    hdr.version = version;
+    hdr.type    = type;
+    hdr.count   = count;
+
+    struct iovec iov[2];
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len  = sizeof(hdr);
+    iov[1].iov_base = (void* )data;
+    iov[1].iov_len  = len;
+
+    struct msghdr mhdr;
+    memset(&mhdr, 0, sizeof(mhdr));
+    mhdr.msg_iov    = iov;
+    mhdr.msg_iovlen = 2;
+
+    std::vector<uint8_t> cbuf;
+
+    if (!fds.empty()) {
+        cbuf.resize(CMSG_SPACE(fds.size() * sizeof(int)), 0);
+
+        mhdr.msg_control    = &cbuf[0];
+        mhdr.msg_controllen = cbuf.size();
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mhdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(fds.size() * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fds[0], fds.size() * sizeof(int));
+    }
+
+    if (sendmsg(fd, &mhdr, MSG_NOSIGNAL) < 0) {
+        logger::error() << "handover: failed to send: " << logger::err();
+        return false;
+    }
+
+    return true;
+}
+
+void handover::path(const std::string& path)
+{
+    _path = path;
+}
+
+bool handover::handed_over()
+{
+    return _handed_over;
+}
+
+int handover::take_fd(const std::string& name, int kind)
+{
+    // Only the sockets of the initial network namespace are handed over.
+    if (!netns::current().empty())
+        return -1;
+
+    std::map<std::pair<std::string, int>, int>::iterator it =
+        _fds.find(std::make_pair(name, kind));
+
+    if (it == _fds.end())
+        return -1;
+
+    int fd = it->second;
+    _fds.erase(it);
+
+    logger::debug() << "handover::take_fd() name=" << name << ", kind=" << kind << ", fd=" << fd;
+
+    return fd;
+}
+
+void handover::take_state(iface& ifa)
+{
+    if (!ifa._netns.empty())
+        return;
+
+    std::map<std::string, iface_state>::iterator it = _states.find(ifa._name);
+
+    if (it == _states.end())
+        return;
+
+    ifa._prev_allmulti    = it->second.prev_allmulti;
+    ifa._prev_promiscuous = it->second.prev_promiscuous;
+    ifa._prev_proxy_ndp   = it->second.prev_proxy_ndp;
+    ifa._prev_proxy_delay = it->second.prev_proxy_delay;
+
+    _states.erase(it);
+}
+
+bool handover::receive()
+{
+    if (_path.empty())
+        return false;
+
+    int fd;
+
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+        logger::error() << "handover: unable to create socket: " << logger::err();
+        return false;
+    }
+
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, _path.c_str(), sizeof(sun.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr* )&sun, sizeof(sun)) < 0) {
+        // Nobody to take over from.
+        logger::debug() << "handover: no running instance at '" << _path << "'";
+        ::close(fd);
+        return false;
+    }
+
+    struct timeval tv;
+    tv.tv_sec  = 10;
+    tv.tv_usec = 0;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    std::vector<uint8_t> buf(max_msg);
+    std::vector<uint8_t> cbuf(CMSG_SPACE(ifaces_per_msg * 3 * sizeof(int)));
+
+    bool done = false;
+    int nifaces = 0;
+
+    while (!done) {
+        struct iovec iov;
+        iov.iov_base = &buf[0];
+        iov.iov_len  = buf.size();
+
+        struct msghdr mhdr;
+        memset(&mhdr, 0, sizeof(mhdr));
+        mhdr.msg_iov        = &iov;
+        mhdr.msg_iovlen     = 1;
+        mhdr.msg_control    = &cbuf[0];
+        mhdr.msg_controllen = cbuf.size();
+
+        ssize_t len = recvmsg(fd, &mhdr, MSG_CMSG_CLOEXEC);
+
+        if (len <= 0) {
+            logger::error() << "handover: failed to receive state: "
+                            << (len < 0 ? logger::err() : "connection closed");
+            break;
+        }
+
+        std::vector<int> fds;
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mhdr); cmsg; cmsg = CMSG_NXTHDR(&mhdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                fds.insert(fds.end(), (int* )CMSG_DATA(cmsg), (int* )CMSG_DATA(cmsg) + n);
+            }
+        }
+
+        msg_hdr* hdr = (msg_hdr* )&buf[0];
+
+        if ((size_t)len < sizeof(msg_hdr) || hdr->version != version ||
+            (mhdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            logger::error() << "handover: unexpected message from running instance";
+
+            for (size_t i = 0; i < fds.size(); i++)
+                ::close(fds[i]);
+            break;
+        }
+
+        uint8_t* data = &buf[sizeof(msg_hdr)];
+        size_t dlen = len - sizeof(msg_hdr);
+        size_t n = 0;
+
+        switch (hdr->type) {
+        case MSG_IFACES:
+            if (dlen < hdr->count * sizeof(iface_rec))
+                break;
+
+            for (uint32_t i = 0; i < hdr->count; i++) {
+                iface_rec* rec = (iface_rec* )data + i;
+                std::string name(rec->name, strnlen(rec->name, IFNAMSIZ));
+
+                for (int kind = IFD; kind <= TFD; kind <<= 1) {
+                    if ((rec->fds & kind) && n < fds.size())
+                        _fds[std::make_pair(name, kind)] = fds[n++];
+                }
+
+                iface_state& st = _states[name];
+                st.prev_allmulti    = rec->prev_allmulti;
+                st.prev_promiscuous = rec->prev_promiscuous;
+                st.prev_proxy_ndp   = std::string(rec->prev_proxy_ndp, strnlen(rec->prev_proxy_ndp, 8));
+                st.prev_proxy_delay = std::string(rec->prev_proxy_delay, strnlen(rec->prev_proxy_delay, 8));
+
+                nifaces++;
+            }
+            break;
+
+        case MSG_SHARED:
+            if (!fds.empty())
+                _fds[std::make_pair(std::string(), IFD)] = fds[n++];
+            break;
+
+        case MSG_SESSIONS:
+            _sessions.insert(_sessions.end(), data, data + std::min(dlen, hdr->count * sizeof(session_rec)));
+            break;
+
+        case MSG_END:
+            done = true;
+            break;
+        }
+
+        // Close whatever we didn't expect.
+        for (; n < fds.size(); n++)
+            ::close(fds[n]);
+    }
+
+    if (!done) {
+        for (std::map<std::pair<std::string, int>, int>::iterator it = _fds.begin();
+                it != _fds.end(); it++)
+            ::close(it->second);
+
+        _fds.clear();
+        _states.clear();
+        _sessions.clear();
+
+        ::close(fd);
+
+        logger::warning() << "handover: starting from scratch";
+        return false;
+    }
+
+    _conn_fd = fd;
+
+    logger::notice()
+        << "handover: taking over " << nifaces << " interface(s) and "
+        << (int)(_sessions.size() / sizeof(session_rec)) << " session(s)";
+
+    return true;
+}
+
+bool handover::complete()
+{
+    for (size_t i = 0; i + sizeof(session_rec) <= _sessions.size(); i += sizeof(session_rec)) {
+        session_rec* rec = (session_rec* )&_sessions[i];
+
+        ptr<proxy> pr = proxy::find(std::string(rec->proxy, strnlen(rec->proxy, IFNAMSIZ)));
+
+        if (!pr)
+            continue;
+
+        ptr<session> se = pr->find_or_create_session(address(rec->taddr));
+
+        if (!se)
+            continue;
+
+        se->status(rec->status);
+        se->hot().ttl    = rec->ttl;
+        se->hot().fails  = rec->fails;
+        se->flag(session::TOUCHED, rec->touched);
+
+        // The routes and neighbour entries are still in place, so this
+        // only brings fib and rtnl up to date.
+
+        if (rec->wired_index > 0) {
+            se->flag(session::WIRED, true);
+            se->_wired_index = rec->wired_index;
+            se->_wired_via   = address(rec->wired_via);
+
+            if (IN6_IS_ADDR_UNSPECIFIED(&rec->wired_via)) {
+                se->_wired_via.reset();
+            } else {
+                fib::wire(se->_wired_via, se->_netns, se->_wired_index, address());
+            }
+
+            fib::wire(se->_taddr, se->_netns, se->_wired_index, se->_wired_via);
+        }
+
+        if (rec->offloaded)
+            se->offload(true);
+    }
+
+    _sessions.clear();
+
+    // Sockets for interfaces that are no longer configured.
+    for (std::map<std::pair<std::string, int>, int>::iterator it = _fds.begin();
+            it != _fds.end(); it++)
+        ::close(it->second);
+
+    _fds.clear();
+    _states.clear();
+
+    if (_conn_fd >= 0) {
+        send_msg(_conn_fd, MSG_READY, 0, 0, 0, std::vector<int>());
+        ::close(_conn_fd);
+        _conn_fd = -1;
+    }
+
+    return listen();
+}
+
+bool handover::listen()
+{
+    if (_path.empty())
+        return true;
+
+    unlink(_path.c_str());
+
+    if ((_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        logger::error() << "handover: unable to create socket: " << logger::err();
+        return false;
+    }
+
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, _path.c_str(), sizeof(sun.sun_path) - 1);
+
+    // The sockets are handed to whoever connects, so only root may. The
+    // daemon runs with a umask of 0 once it has forked.
+    mode_t prev_umask = umask(077);
+
+    int rc = bind(_listen_fd, (struct sockaddr* )&sun, sizeof(sun));
+
+    umask(prev_umask);
+
+    if (rc < 0 || chmod(_path.c_str(), 0600) < 0 || ::listen(_listen_fd, 1) < 0) {
+        logger::error() << "handover: failed to listen on '" << _path << "': " << logger::err();
+        ::close(_listen_fd);
+        _listen_fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+bool handover::send_state(int fd)
+{
+    std::vector<iface_rec> recs;
+    std::vector<int> fds;
+
+    for (std::map<std::string, weak_ptr<iface> >::iterator it = iface::_map.begin();
+            it != iface::_map.end(); it++) {
+        if (!it->second || !it->second->_netns.empty())
+            continue;
+
+        ptr<iface> ifa = it->second;
+
+        iface_rec rec;
+        memset(&rec, 0, sizeof(rec));
+        strncpy(rec.name, ifa->_name.c_str(), IFNAMSIZ - 1);
+        strncpy(rec.prev_proxy_ndp, ifa->_prev_proxy_ndp.c_str(), 7);
+        strncpy(rec.prev_proxy_delay, ifa->_prev_proxy_delay.c_str(), 7);
+        rec.prev_allmulti    = ifa->_prev_allmulti;
+        rec.prev_promiscuous = ifa->_prev_promiscuous;
+
+        if (ifa->_ifd >= 0 && ifa->_ifd != iface::_shared_fd) {
+            rec.fds |= IFD;
+            fds.push_back(ifa->_ifd);
+        }
+
+        if (ifa->_pfd >= 0) {
+            rec.fds |= PFD;
+            fds.push_back(ifa->_pfd);
+        }
+
+        if (ifa->_tfd >= 0) {
+            rec.fds |= TFD;
+            fds.push_back(ifa->_tfd);
+        }
+
+        recs.push_back(rec);
+
+        if (recs.size() == ifaces_per_msg) {
+            if (!send_msg(fd, MSG_IFACES, recs.size(), &recs[0], recs.size() * sizeof(iface_rec), fds))
+                return false;
+
+            recs.clear();
+            fds.clear();
+        }
+    }
+
+    if (!recs.empty() &&
+        !send_msg(fd, MSG_IFACES, recs.size(), &recs[0], recs.size() * sizeof(iface_rec), fds))
+        return false;
+
+    if (iface::_shared_fd >= 0 &&
+        !send_msg(fd, MSG_SHARED, 1, 0, 0, std::vector<int>(1, iface::_shared_fd)))
+        return false;
+
+    std::vector<session_rec> srecs;
+    int nsessions = 0;
+
+    for (size_t i = 0; i < session::_records.size(); i++) {
+        ptr<session> se = session::_records[i].se->_ptr;
+        ptr<proxy> pr = se->_pr;
+
+        if (!pr || !pr->ifa()->netns_name().empty())
+            continue;
+
+        session_rec rec;
+        memset(&rec, 0, sizeof(rec));
+        strncpy(rec.proxy, pr->ifa()->name().c_str(), IFNAMSIZ - 1);
+        rec.taddr     = se->_taddr.const_addr();
+        rec.status    = se->hot().status;
+        rec.ttl       = se->hot().ttl;
+        rec.fails     = se->hot().fails;
+        rec.touched   = se->touched();
+        rec.offloaded = se->_offload_index > 0;
+
+        if (se->wired()) {
+            rec.wired_index = se->_wired_index;
+            rec.wired_via   = se->_wired_via.const_addr();
+        }
+
+        srecs.push_back(rec);
+        nsessions++;
+
+        if (srecs.size() == sessions_per_msg) {
+            if (!send_msg(fd, MSG_SESSIONS, srecs.size(), &srecs[0], srecs.size() * sizeof(session_rec), std::vector<int>()))
+                return false;
+
+            srecs.clear();
+        }
+    }
+
+    if (!srecs.empty() &&
+        !send_msg(fd, MSG_SESSIONS, srecs.size(), &srecs[0], srecs.size() * sizeof(session_rec), std::vector<int>()))
+        return false;
+
+    if (!send_msg(fd, MSG_END, 0, 0, 0, std::vector<int>()))
+        return false;
+
+    logger::notice() << "handover: sent state of " << (int)iface::_map.size()
+                     << " interface(s) and " << nsessions << " session(s)";
+
+    return true;
+}
+
+bool handover::poll()
+{
+    if (_conn_fd >= 0) {
+        msg_hdr hdr;
+
+        ssize_t len = recv(_conn_fd, &hdr, sizeof(hdr), MSG_DONTWAIT);
+
+        if (len < 0 && (errno == EAGAIN || errno == EINTR))
+            return false;
+
+        if (len == sizeof(hdr) && hdr.version == version && hdr.type == MSG_READY) {
+            logger::notice() << "handover: new instance has taken over";
+            ::close(_conn_fd);
+            _conn_fd = -1;
+            _handed_over = true;
+            return true;
+        }
+
+        logger::warning() << "handover: new instance went away, carrying on";
+        ::close(_conn_fd);
+        _conn_fd = -1;
+        return false;
+    }
+
+    if (_listen_fd < 0)
+        return false;
+
+    int fd;
+
+    if ((fd = accept4(_listen_fd, 0, 0, SOCK_CLOEXEC)) < 0)
+        return false;
+
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred.uid != 0) {
+        logger::warning() << "handover: refusing connection from a process not owned by root";
+        ::close(fd);
+        return false;
+    }
+
+    logger::notice() << "handover: new instance connected";
+
+    // The main loop is blocked while sending, so give up on a new
+    // instance that doesn't read.
+    struct timeval tv;
+    tv.tv_sec  = 1;
+    tv.tv_usec = 0;
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    // Keep serving until the new instance says it's ready.
+    if (!send_state(fd)) {
+        logger::warning() << "handover: failed to send state, carrying on";
+        ::close(fd);
+        return false;
+    }
+
+    _conn_fd = fd;
+
+    return false;
+}
+
+void handover::close()
+{
+    if (_conn_fd >= 0) {
+        ::close(_conn_fd);
+        _conn_fd = -1;
+    }
+
+    if (_listen_fd >= 0) {
+        ::close(_listen_fd);
+        _listen_fd = -1;
+
+        // The new instance is listening on the same path now.
+        if (!_handed_over)
+            unlink(_path.c_str());
+    }
+}
+
+NDPPD_NS_END
@@ -0,0 +1,99 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <stdint.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+class iface;
+
+// Hands the sockets and sessions of a running instance over to a newly
+// started one, so that ndppd can be upgraded without a gap in service.
+//
+// The running instance listens on a Unix socket. A new instance connects
+// to it before opening any interfaces, receives the open sockets through
+// SCM_RIGHTS together with the session table, and tells the old instance
+// to exit once it is ready to take over. The old instance then leaves
+// the interface flags, neighbour entries and routes as they are.
+class handover {
+public:
+    enum {
+        IFD = 1,
+        PFD = 2,
+        TFD = 4
+    };
+
+    static void path(const std::string& path);
+
+    // Takes over from a running instance, if there is one. Must be
+    // called before the interfaces are opened.
+    static bool receive();
+
+    // Restores the received sessions, lets the previous instance go, and
+    // starts listening for the next one. Called once configured.
+    static bool complete();
+
+    // Called from the main loop. Returns true once a new instance has
+    // taken over, and this one should exit.
+    static bool poll();
+
+    // Returns true if this instance has handed over to another one.
+    static bool handed_over();
+
+    // Called when opening interfaces. Returns an inherited socket of the
+    // specified kind, or -1.
+    static int take_fd(const std::string& name, int kind);
+
+    // Restores the flags that 'ifa' had before the previous instance
+    // changed them, so that they are reset properly on exit.
+    static void take_state(iface& ifa);
+
+    // Closes the sockets, and removes the socket file.
+    static void close();
+
+private:
+    struct iface_state {
+        int prev_allmulti, prev_promiscuous;
+        std::string prev_proxy_ndp, prev_proxy_delay;
+    };
+
+    static std::string _path;
+
+    static int _listen_fd, _conn_fd;
+
+    static bool _handed_over;
+
+    static std::map<std::pair<std::string, int>, int> _fds;
+
+    static std::map<std::string, iface_state> _states;
+
+    // Serialized sessions, restored by complete().
+    static std::vector<uint8_t> _sessions;
+
+    static bool listen();
+
+    // Returns false if the state couldn't be sent in full.
+    static bool send_state(int fd);
+};
+
+NDPPD_NS_END
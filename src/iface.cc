@@ -24,7 +24,7 @@
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
 #include <netinet/ether.h>
-#include <netpacket/packet.h>
+#include <linux/if_packet.h>
 
 #include <net/if.h>
 #include <sys/ioctl.h>
@@ -33,14 +33,24 @@
 #include <sys/poll.h>
 
 #include <linux/filter.h>
+#include <linux/if_vlan.h>
+#include <linux/sockios.h>
+#include <linux/sock_diag.h>
 
 #include <errno.h>
+#include <time.h>
 #include <string>
+#include <fstream>
 #include <vector>
 #include <map>
+#include <algorithm>
 
 #include "ndppd.h"
 #include "route.h"
+#include "handover.h"
+#include "rtnl.h"
+#include "rsra.h"
+#include "netns.h"
 
 NDPPD_NS_BEGIN
 
@@ -50,27 +60,81 @@ bool iface::_map_dirty = false;
 
 std::vector<struct pollfd> iface::_pollfds;
 
+std::vector<weak_ptr<iface> > iface::_pollifs;
+
+std::map<int, weak_ptr<iface> > iface::_index_map;
+
+bool iface::_shared_socket = false;
+
+int iface::_shared_fd = -1;
+
+uint64_t iface::_shared_drops = 0;
+
+uint32_t iface::_shared_ovfl = 0;
+
+int iface::_poll_wait = 0;
+
+int iface::_busy_poll = 0;
+
+// Looks up an interface index, preferring the link cache.
+// Returns the cached link, which is only there for the initial namespace.
+static const rtnl::link* find_link(const std::string& name)
+{
+    return netns::current().empty() ? rtnl::find_link(name) : NULL;
+}
+
+static unsigned int link_index(const std::string& name)
+{
+    const rtnl::link* ln = find_link(name);
+    return ln ? ln->index : if_nametoindex(name.c_str());
+}
+
 iface::iface() :
-    _ifd(-1), _pfd(-1), _name("")
+    _ifd(-1), _pfd(-1), _tfd(-1), _index(0), _vlan(-1), _prev_allmulti(-1),
+    _prev_promiscuous(-1), _name(""), _rcvbuf(0), _sndbuf(0),
+    _srtt(0), _rttvar(0), _probe_rate(0), _probe_tokens(0), _probe_stamp(0), _capture(0)
 {
+    memset(&_stats, 0, sizeof(_stats));
 }
 
 iface::~iface()
 {
     logger::debug() << "iface::~iface()";
 
-    if (_ifd >= 0)
+    // The interface is in use by the instance we've handed over to.
+    if (handover::handed_over()) {
+        _prev_allmulti = _prev_promiscuous = -1;
+        _prev_proxy_ndp.clear();
+        _prev_proxy_delay.clear();
+    }
+
+    if (_prev_allmulti >= 0) {
+        allmulti(_prev_allmulti);
+    }
+
+    if (_prev_promiscuous >= 0) {
+        promiscuous(_prev_promiscuous);
+    }
+
+    if (!_prev_proxy_ndp.empty()) {
+        write_sysctl("conf/" + _name + "/proxy_ndp", _prev_proxy_ndp);
+    }
+
+    if (!_prev_proxy_delay.empty()) {
+        write_sysctl("neigh/" + _name + "/proxy_delay", _prev_proxy_delay);
+    }
+
+    if ((_ifd >= 0) && (_ifd != _shared_fd))
         close(_ifd);
 
-    if (_pfd >= 0) {
-        if (_prev_allmulti >= 0) {
-            allmulti(_prev_allmulti);
-        }
-        if (_prev_promiscuous >= 0) {
-            promiscuous(_prev_promiscuous);
-        }
+    if (_pfd >= 0)
         close(_pfd);
-    }
+
+    if (_tfd >= 0)
+        close(_tfd);
+
+    if (_trunk)
+        _trunk->_vlans.erase(_vlan);
 
     _map_dirty = true;
     
@@ -78,17 +142,20 @@ iface::~iface()
     _parents.clear();
 }
 
-ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
+ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous, int capture)
 {
     int fd = 0;
 
-    std::map<std::string, weak_ptr<iface> >::iterator it = _map.find(name);
+    std::map<std::string, weak_ptr<iface> >::iterator it = _map.find(netns::qualify(name));
 
     ptr<iface> ifa;
 
     if (it != _map.end()) {
-        if (it->second->_pfd >= 0)
+        if (it->second->_pfd >= 0) {
+            if (!it->second->capture(capture))
+                return ptr<iface>();
             return it->second;
+        }
 
         ifa = it->second;
     } else {
@@ -99,9 +166,10 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
     if (!ifa)
         return ptr<iface>();
 
-    // Create a socket.
+    // Create a socket, unless we've inherited one.
 
-    if ((fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_IPV6))) < 0) {
+    if ((fd = handover::take_fd(name, handover::PFD)) < 0 &&
+        (fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_IPV6))) < 0) {
         logger::error() << "Unable to create socket";
         return ptr<iface>();
     }
@@ -114,7 +182,7 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
     lladdr.sll_family   = AF_PACKET;
     lladdr.sll_protocol = htons(ETH_P_IPV6);
 
-    if (!(lladdr.sll_ifindex = if_nametoindex(name.c_str()))) {
+    if (!(lladdr.sll_ifindex = link_index(name))) {
         close(fd);
         logger::error() << "Failed to bind to interface '" << name << "'";
         return ptr<iface>();
@@ -136,106 +204,341 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
         return ptr<iface>();
     }
 
-    // Set up filter.
+    setup_busy_poll(fd);
 
-    static struct sock_filter filter[] = {
-        // Load the ether_type.
-        BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
-            offsetof(struct ether_header, ether_type)),
-        // Bail if it's* not* ETHERTYPE_IPV6.
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 0, 5),
-        // Load the next header type.
-        BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
-            sizeof(struct ether_header) + offsetof(struct ip6_hdr, ip6_nxt)),
-        // Bail if it's* not* IPPROTO_ICMPV6.
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 3),
-        // Load the ICMPv6 type.
-        BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
-            sizeof(struct ether_header) + sizeof(ip6_hdr) + offsetof(struct icmp6_hdr, icmp6_type)),
-        // Bail if it's* not* ND_NEIGHBOR_SOLICIT.
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_SOLICIT, 0, 1),
-        // Keep packet.
-        BPF_STMT(BPF_RET | BPF_K, (u_int32_t)-1),
-        // Drop packet.
-        BPF_STMT(BPF_RET | BPF_K, 0)
-    };
+    // Set up an instance of 'iface'.
 
-    static struct sock_fprog fprog = {
-        8,
-        filter
-    };
+    ifa->_pfd = fd;
 
-    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
-        logger::error() << "Failed to set filter";
+    if (!ifa->capture(capture)) {
+        close(fd);
+        ifa->_pfd = -1;
         return ptr<iface>();
     }
 
-    // Set up an instance of 'iface'.
+    if (ifa->_rcvbuf || ifa->_sndbuf) {
+        int rcvbuf = ifa->_rcvbuf, sndbuf = ifa->_sndbuf;
+        ifa->_rcvbuf = ifa->_sndbuf = 0;
+        ifa->buffer_size(rcvbuf, sndbuf);
+    }
 
-    ifa->_pfd = fd;
+    // Eh. Allmulti. Keep the state from before open_trunk(), if it has
+    // been opened as a VLAN as well.
+    int prev = ifa->allmulti(1);
 
-    // Eh. Allmulti.
-    ifa->_prev_allmulti = ifa->allmulti(1);
+    if (ifa->_prev_allmulti < 0)
+        ifa->_prev_allmulti = prev;
     
     // Eh. Promiscuous
     if (promiscuous == true) {
-        ifa->_prev_promiscuous = ifa->promiscuous(1);
-    } else {
-        ifa->_prev_promiscuous = -1;
+        prev = ifa->promiscuous(1);
+
+        if (ifa->_prev_promiscuous < 0)
+            ifa->_prev_promiscuous = prev;
     }
 
+    handover::take_state(*ifa);
+
     _map_dirty = true;
 
     return ifa;
 }
 
-ptr<iface> iface::open_ifd(const std::string& name)
+static void bpf_stmt(std::vector<struct sock_filter>& filter, uint16_t code, uint32_t k)
 {
-    int fd;
+    struct sock_filter insn = BPF_STMT(code, k);
+    filter.push_back(insn);
+}
+
+static void bpf_jump(std::vector<struct sock_filter>& filter, uint16_t code, uint32_t k, int jt, int jf)
+{
+    struct sock_filter insn = BPF_JUMP(code, k, (uint8_t)jt, (uint8_t)jf);
+    filter.push_back(insn);
+}
 
-    std::map<std::string, weak_ptr<iface> >::iterator it = _map.find(name);
+bool iface::capture(int types)
+{
+    _capture |= types;
 
-    if ((it != _map.end()) && it->second->_ifd)
-        return it->second;
+    if (_pfd < 0)
+        return true;
 
-    // Create a socket.
+    // Build a filter that keeps incoming ICMPv6 messages of the types
+    // being captured, so that one socket serves all of them.
 
-    if ((fd = socket(PF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) < 0) {
-        logger::error() << "Unable to create socket";
-        return ptr<iface>();
+    static const int map[][2] = {
+        { CAPTURE_NS, ND_NEIGHBOR_SOLICIT },
+        { CAPTURE_RS, ND_ROUTER_SOLICIT },
+        { CAPTURE_RA, ND_ROUTER_ADVERT }
+    };
+
+    std::vector<int> icmp6_types;
+
+    for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+        if (_capture & map[i][0])
+            icmp6_types.push_back(map[i][1]);
     }
 
-    // Bind to the specified interface.
+    int n = icmp6_types.size(), drop = 7 + n, keep = 8 + n;
+
+    std::vector<struct sock_filter> filter;
+
+    // Bail if it's a packet we sent ourselves.
+    bpf_stmt(filter, BPF_LD | BPF_W | BPF_ABS,
+        (u_int32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE));
+    bpf_jump(filter, BPF_JMP | BPF_JEQ | BPF_K,
+        PACKET_OUTGOING, drop - 2, 0);
+    // Load the ether_type, and bail if it's* not* ETHERTYPE_IPV6.
+    bpf_stmt(filter, BPF_LD | BPF_H | BPF_ABS,
+        offsetof(struct ether_header, ether_type));
+    bpf_jump(filter, BPF_JMP | BPF_JEQ | BPF_K,
+        ETHERTYPE_IPV6, 0, drop - 4);
+    // Load the next header type, and bail if it's* not* IPPROTO_ICMPV6.
+    bpf_stmt(filter, BPF_LD | BPF_B | BPF_ABS,
+        sizeof(struct ether_header) + offsetof(struct ip6_hdr, ip6_nxt));
+    bpf_jump(filter, BPF_JMP | BPF_JEQ | BPF_K,
+        IPPROTO_ICMPV6, 0, drop - 6);
+    // Load the ICMPv6 type, and keep the packet if it's one we want.
+    bpf_stmt(filter, BPF_LD | BPF_B | BPF_ABS,
+        sizeof(struct ether_header) + sizeof(ip6_hdr) + offsetof(struct icmp6_hdr, icmp6_type));
+
+    for (int i = 0; i < n; i++) {
+        bpf_jump(filter, BPF_JMP | BPF_JEQ | BPF_K,
+            icmp6_types[i], keep - (8 + i), 0);
+    }
 
-    struct ifreq ifr;
+    // Drop packet.
+    bpf_stmt(filter, BPF_RET | BPF_K, 0);
+    // Keep packet.
+    bpf_stmt(filter, BPF_RET | BPF_K, (u_int32_t)-1);
 
-    memset(&ifr, 0, sizeof(ifr));
-    strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
-    ifr.ifr_name[IFNAMSIZ - 1] = '\0';
+    struct sock_fprog fprog;
+    fprog.len    = filter.size();
+    fprog.filter = &filter[0];
 
-    if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE,& ifr, sizeof(ifr)) < 0) {
-        close(fd);
-        logger::error() << "Failed to bind to interface '" << name << "'";
+    if (setsockopt(_pfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        logger::error() << "Failed to set filter on interface '" << _name << "'";
+        return false;
+    }
+
+    return true;
+}
+
+ssize_t iface::write_frame(int ifindex, const uint8_t* msg, size_t size)
+{
+    struct sockaddr_ll lladdr;
+
+    memset(&lladdr, 0, sizeof(struct sockaddr_ll));
+    lladdr.sll_family   = AF_PACKET;
+    lladdr.sll_protocol = htons(ETH_P_IPV6);
+    lladdr.sll_ifindex  = ifindex;
+    lladdr.sll_halen    = ETH_ALEN;
+    memcpy(lladdr.sll_addr, msg, ETH_ALEN);
+
+    ssize_t len;
+
+    if ((len = sendto(_pfd, msg, size, 0, (struct sockaddr* )&lladdr, sizeof(lladdr))) < 0) {
+        logger::error() << "iface::write_frame() failed! error=" << logger::err() << ", ifa=" << name();
+        _stats.tx_errors++;
+        return -1;
+    }
+
+    // Record the frame on the interface it went out of.
+    if (recorder::size()) {
+        for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin(); it != _map.end(); it++) {
+            if (it->second && (it->second->_index == ifindex) && (it->second->_netns == _netns)) {
+                it->second->_rec.frame(recorder::TX, msg, size);
+                break;
+            }
+        }
+    }
+
+    return len;
+}
+
+const struct ether_addr& iface::hwaddr() const
+{
+    return _hwaddr;
+}
+
+ptr<iface> iface::open_trunk(const std::string& name, bool promiscuous)
+{
+    ptr<iface> ifa = open_ifd(name);
+
+    if (!ifa)
+        return ptr<iface>();
+
+    if (ifa->_trunk)
+        return ifa;
+
+    // Find out which device and VLAN this interface belongs to.
+
+    struct vlan_ioctl_args args;
+
+    memset(&args, 0, sizeof(args));
+    args.cmd = GET_VLAN_REALDEV_NAME_CMD;
+    strncpy(args.device1, name.c_str(), sizeof(args.device1) - 1);
+
+    if (ioctl(ifa->_ifd, SIOCGIFVLAN, &args) < 0) {
+        logger::error() << "Interface '" << name << "' is not a VLAN interface";
         return ptr<iface>();
     }
 
-    // Detect the link-layer address.
+    std::string trunk_name(args.u.device2);
 
-    memset(&ifr, 0, sizeof(ifr));
-    strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
-    ifr.ifr_name[IFNAMSIZ - 1] = '\0';
+    memset(&args, 0, sizeof(args));
+    args.cmd = GET_VLAN_VID_CMD;
+    strncpy(args.device1, name.c_str(), sizeof(args.device1) - 1);
 
-    if (ioctl(fd, SIOCGIFHWADDR,& ifr) < 0) {
-        close(fd);
-        logger::error()
-            << "Failed to detect link-layer address for interface '"
-            << name << "'";
+    if (ioctl(ifa->_ifd, SIOCGIFVLAN, &args) < 0) {
+        logger::error() << "Failed to detect VLAN id of interface '" << name << "'";
         return ptr<iface>();
     }
 
-    logger::debug()
-        << "fd=" << fd << ", hwaddr="
-        << ether_ntoa((const struct ether_addr* )&ifr.ifr_hwaddr.sa_data);
+    int vlan = args.u.VID;
+
+    // Set up the trunk, which may or may not exist already.
+
+    ptr<iface> tr;
+
+    std::map<std::string, weak_ptr<iface> >::iterator it = _map.find(netns::qualify(trunk_name));
+
+    if (it != _map.end()) {
+        tr = it->second;
+    } else {
+        tr = new iface();
+        tr->_name  = trunk_name;
+        tr->_netns = netns::current();
+        tr->_ptr   = tr;
+        tr->_rec.name(netns::qualify(trunk_name));
+
+        _map[netns::qualify(trunk_name)] = tr;
+    }
+
+    if (tr->_tfd < 0) {
+        int fd;
+
+        if ((fd = handover::take_fd(trunk_name, handover::TFD)) < 0 &&
+            (fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+            logger::error() << "Unable to create socket";
+            return ptr<iface>();
+        }
+
+        struct sockaddr_ll lladdr;
+
+        memset(&lladdr, 0, sizeof(struct sockaddr_ll));
+        lladdr.sll_family   = AF_PACKET;
+        lladdr.sll_protocol = htons(ETH_P_ALL);
+
+        if (!(lladdr.sll_ifindex = link_index(trunk_name)) ||
+            (bind(fd, (struct sockaddr* )&lladdr, sizeof(struct sockaddr_ll)) < 0)) {
+            close(fd);
+            logger::error() << "Failed to bind to interface '" << trunk_name << "'";
+            return ptr<iface>();
+        }
+
+        int on = 1;
+
+        if (ioctl(fd, FIONBIO, (char* )&on) < 0) {
+            close(fd);
+            logger::error() << "Failed to switch to non-blocking on interface '" << trunk_name << "'";
+            return ptr<iface>();
+        }
+
+        // The VLAN tag has already been stripped by the time we see the
+        // frame, so we need the auxiliary data to get hold of it.
+
+        if (setsockopt(fd, SOL_PACKET, PACKET_AUXDATA, &on, sizeof(on)) < 0) {
+            close(fd);
+            logger::error() << "Failed to enable PACKET_AUXDATA on interface '" << trunk_name << "'";
+            return ptr<iface>();
+        }
+
+        setup_busy_poll(fd);
+
+        static struct sock_filter filter[] = {
+            // Bail if it's* not* an incoming frame.
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (u_int32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE)),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 8, 0),
+            // Bail if it's* not* tagged.
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (u_int32_t)(SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT)),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 6, 0),
+            // Load the ether_type.
+            BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+                offsetof(struct ether_header, ether_type)),
+            // Bail if it's* not* ETHERTYPE_IPV6.
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 0, 4),
+            // Load the next header type.
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+                sizeof(struct ether_header) + offsetof(struct ip6_hdr, ip6_nxt)),
+            // Bail if it's* not* IPPROTO_ICMPV6.
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 2),
+            // Load the ICMPv6 type.
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+                sizeof(struct ether_header) + sizeof(ip6_hdr) + offsetof(struct icmp6_hdr, icmp6_type)),
+            // Bail if it's* not* ND_NEIGHBOR_SOLICIT.
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_SOLICIT, 1, 0),
+            // Drop packet.
+            BPF_STMT(BPF_RET | BPF_K, 0),
+            // Keep packet.
+            BPF_STMT(BPF_RET | BPF_K, (u_int32_t)-1)
+        };
+
+        static struct sock_fprog fprog = {
+            sizeof(filter) / sizeof(filter[0]),
+            filter
+        };
+
+        if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+            close(fd);
+            logger::error() << "Failed to set filter";
+            return ptr<iface>();
+        }
+
+        tr->_tfd = fd;
+
+        logger::debug() << "iface::open_trunk() trunk=" << trunk_name << ", fd=" << fd;
+    }
+
+    tr->_vlans[vlan] = ifa;
+
+    ifa->_trunk = tr;
+    ifa->_vlan  = vlan;
+
+    // Setting ALLMULTI on the VLAN interface propagates to the trunk.
+    // Keep the state from before open_pfd(), if it has been opened as
+    // a plain interface as well.
+    int prev = ifa->allmulti(1);
+
+    if (ifa->_prev_allmulti < 0)
+        ifa->_prev_allmulti = prev;
+
+    if (promiscuous == true) {
+        prev = ifa->promiscuous(1);
+
+        if (ifa->_prev_promiscuous < 0)
+            ifa->_prev_promiscuous = prev;
+    }
+
+    handover::take_state(*ifa);
+
+    logger::debug() << "iface::open_trunk() if=" << name << ", trunk=" << trunk_name << ", vlan=" << vlan;
+
+    _map_dirty = true;
+
+    return ifa;
+}
+
+int iface::open_icmp6()
+{
+    int fd;
+
+    // Create a socket.
+
+    if ((fd = socket(PF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) < 0) {
+        logger::error() << "Unable to create socket";
+        return -1;
+    }
 
     // Set max hops.
 
@@ -244,15 +547,15 @@ ptr<iface> iface::open_ifd(const std::string& name)
     if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops,
                    sizeof(hops)) < 0) {
         close(fd);
-        logger::error() << "iface::open_ifd() failed IPV6_MULTICAST_HOPS";
-        return ptr<iface>();
+        logger::error() << "iface::open_icmp6() failed IPV6_MULTICAST_HOPS";
+        return -1;
     }
 
     if (setsockopt(fd, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &hops,
                    sizeof(hops)) < 0) {
         close(fd);
-        logger::error() << "iface::open_ifd() failed IPV6_UNICAST_HOPS";
-        return ptr<iface>();
+        logger::error() << "iface::open_icmp6() failed IPV6_UNICAST_HOPS";
+        return -1;
     }
 
     // Switch to non-blocking mode.
@@ -261,10 +564,22 @@ ptr<iface> iface::open_ifd(const std::string& name)
 
     if (ioctl(fd, FIONBIO, (char*)&on) < 0) {
         close(fd);
-        logger::error()
-            << "Failed to switch to non-blocking on interface '"
-            << name << "'";
-        return ptr<iface>();
+        logger::error() << "Failed to switch to non-blocking on ICMPv6 socket";
+        return -1;
+    }
+
+    setup_busy_poll(fd);
+
+    // Have the kernel tell us about the number of dropped packets.
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+        logger::warning() << "Failed to set SO_RXQ_OVFL: " << logger::err();
+    }
+
+    // And the hop limit, which must be 255 for NDP messages.
+
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &on, sizeof(on)) < 0) {
+        logger::warning() << "Failed to set IPV6_RECVHOPLIMIT: " << logger::err();
     }
 
     // Set up filter.
@@ -274,8 +589,108 @@ ptr<iface> iface::open_ifd(const std::string& name)
     ICMP6_FILTER_SETPASS(ND_NEIGHBOR_ADVERT, &filter);
 
     if (setsockopt(fd, IPPROTO_ICMPV6, ICMP6_FILTER,& filter, sizeof(filter)) < 0) {
+        close(fd);
         logger::error() << "Failed to set filter";
-        return ptr<iface>();
+        return -1;
+    }
+
+    return fd;
+}
+
+ptr<iface> iface::open_ifd(const std::string& name)
+{
+    int fd;
+
+    std::map<std::string, weak_ptr<iface> >::iterator it = _map.find(netns::qualify(name));
+
+    if ((it != _map.end()) && (it->second->_ifd >= 0))
+        return it->second;
+
+    struct ifreq ifr;
+
+    // The shared socket, and the interface indexes it goes by, are those
+    // of the initial namespace.
+    bool shared = _shared_socket && netns::current().empty();
+
+    if (shared) {
+        // All interfaces use the same socket; the ingress interface is
+        // learned through IPV6_PKTINFO, and selected the same way on send.
+
+        if (_shared_fd < 0) {
+            if ((fd = handover::take_fd("", handover::IFD)) < 0 &&
+                (fd = open_icmp6()) < 0) {
+                return ptr<iface>();
+            }
+
+            int on = 1;
+
+            if (setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on)) < 0) {
+                close(fd);
+                logger::error() << "iface::open_ifd() failed IPV6_RECVPKTINFO";
+                return ptr<iface>();
+            }
+
+            _shared_fd = fd;
+        }
+
+        fd = _shared_fd;
+    } else {
+        if ((fd = handover::take_fd(name, handover::IFD)) < 0 &&
+            (fd = open_icmp6()) < 0) {
+            return ptr<iface>();
+        }
+
+        // Bind to the specified interface.
+
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
+        ifr.ifr_name[IFNAMSIZ - 1] = '\0';
+
+        if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE,& ifr, sizeof(ifr)) < 0) {
+            close(fd);
+            logger::error() << "Failed to bind to interface '" << name << "'";
+            return ptr<iface>();
+        }
+    }
+
+    // Detect the interface index and link-layer address, from the link
+    // cache if it has been loaded.
+
+    int index;
+    const rtnl::link* ln = find_link(name);
+
+    memset(&ifr, 0, sizeof(ifr));
+
+    if (ln) {
+        index = ln->index;
+        memcpy(ifr.ifr_hwaddr.sa_data, &ln->hwaddr, sizeof(struct ether_addr));
+    } else {
+        strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
+        ifr.ifr_name[IFNAMSIZ - 1] = '\0';
+
+        if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+            if (fd != _shared_fd)
+                close(fd);
+            logger::error() << "Failed to detect index of interface '" << name << "'";
+            return ptr<iface>();
+        }
+
+        index = ifr.ifr_ifindex;
+
+        if (ioctl(fd, SIOCGIFHWADDR,& ifr) < 0) {
+            if (fd != _shared_fd)
+                close(fd);
+            logger::error()
+                << "Failed to detect link-layer address for interface '"
+                << name << "'";
+            return ptr<iface>();
+        }
+    }
+
+    if (logger::verbosity() >= LOG_DEBUG) {
+        logger::debug()
+            << "fd=" << fd << ", index=" << index << ", hwaddr="
+            << ether_ntoa((const struct ether_addr* )&ifr.ifr_hwaddr.sa_data);
     }
 
     // Set up an instance of 'iface'.
@@ -284,28 +699,41 @@ ptr<iface> iface::open_ifd(const std::string& name)
 
     if (it == _map.end()) {
         ifa = new iface();
-        ifa->_name = name;
-        ifa->_ptr  = ifa;
+        ifa->_name  = name;
+        ifa->_netns = netns::current();
+        ifa->_ptr   = ifa;
+        ifa->_rec.name(netns::qualify(name));
 
-        _map[name] = ifa;
+        _map[netns::qualify(name)] = ifa;
     } else {
         ifa = it->second;
     }
 
-    ifa->_ifd = fd;
+    ifa->_ifd   = fd;
+    ifa->_index = index;
+
+    if (shared)
+        _index_map[index] = ifa;
 
-    memcpy(&ifa->hwaddr, ifr.ifr_hwaddr.sa_data, sizeof(struct ether_addr));
+    // Without a ring, everything is sent through the ICMPv6 socket.
+    ifa->_tx.open(index, name);
+
+    memcpy(&ifa->_hwaddr, ifr.ifr_hwaddr.sa_data, sizeof(struct ether_addr));
 
     _map_dirty = true;
 
     return ifa;
 }
 
-ssize_t iface::read(int fd, struct sockaddr* saddr, ssize_t saddr_size, uint8_t* msg, size_t size)
+ssize_t iface::read(int fd, struct sockaddr* saddr, ssize_t saddr_size, uint8_t* msg, ssize_t size, int* hlim)
 {
     struct msghdr mhdr;
     struct iovec iov;
-    int len;
+    uint8_t cbuf[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(int))];
+    ssize_t len;
+
+    if (hlim)
+        *hlim = -1;
 
     if (!msg || (size < 0))
         return -1;
@@ -318,17 +746,43 @@ ssize_t iface::read(int fd, struct sockaddr* saddr, ssize_t saddr_size, uint8_t*
     mhdr.msg_namelen = saddr_size;
     mhdr.msg_iov =& iov;
     mhdr.msg_iovlen = 1;
+    mhdr.msg_control = cbuf;
+    mhdr.msg_controllen = sizeof(cbuf);
     
     if ((len = recvmsg(fd,& mhdr, 0)) < 0)
     {
         logger::error() << "iface::read() failed! error=" << logger::err() << ", ifa=" << name();
+        _stats.rx_errors++;
         return -1;
     }
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mhdr); cmsg; cmsg = CMSG_NXTHDR(&mhdr, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL)) {
+            uint32_t ovfl;
+            memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+
+            if (ovfl != _stats.ifd_ovfl) {
+                logger::warning() << "Kernel dropped " << (int)(ovfl - _stats.ifd_ovfl)
+                                  << " packet(s) on interface '" << name() << "'";
+                _stats.ifd_drops += ovfl - _stats.ifd_ovfl;
+                _stats.ifd_ovfl   = ovfl;
+            }
+        } else if (hlim && (cmsg->cmsg_level == IPPROTO_IPV6) && (cmsg->cmsg_type == IPV6_HOPLIMIT)) {
+            memcpy(hlim, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
     
-    logger::debug() << "iface::read() ifa=" << name() << ", len=" << len;
+    logger::debug() << "iface::read() ifa=" << name() << ", len=" << (int)len;
+
+    if (fd == _pfd)
+        _rec.frame(recorder::RX, msg, len);
+    else
+        _rec.icmp6(recorder::RX, ((struct sockaddr_in6* )saddr)->sin6_addr, in6addr_any, msg, len);
 
-    if (len < sizeof(struct icmp6_hdr))
+    if (len < (ssize_t)sizeof(struct icmp6_hdr)) {
+        _stats.rx_errors++;
         return -1;
+    }
 
     return len;
 }
@@ -338,6 +792,7 @@ ssize_t iface::write(int fd, const address& daddr, const uint8_t* msg, size_t si
     struct sockaddr_in6 daddr_tmp;
     struct msghdr mhdr;
     struct iovec iov;
+    uint8_t cbuf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
 
     memset(&daddr_tmp, 0, sizeof(struct sockaddr_in6));
     daddr_tmp.sin6_family = AF_INET6;
@@ -353,6 +808,24 @@ ssize_t iface::write(int fd, const address& daddr, const uint8_t* msg, size_t si
     mhdr.msg_iov =& iov;
     mhdr.msg_iovlen = 1;
 
+    if (fd == _shared_fd) {
+        // The shared socket isn't bound to any interface, so we'll have
+        // to tell the kernel which one to use.
+
+        struct in6_pktinfo pi;
+        memset(&pi, 0, sizeof(pi));
+        pi.ipi6_ifindex = _index;
+
+        mhdr.msg_control    = cbuf;
+        mhdr.msg_controllen = sizeof(cbuf);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mhdr);
+        cmsg->cmsg_level = IPPROTO_IPV6;
+        cmsg->cmsg_type  = IPV6_PKTINFO;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(pi));
+        memcpy(CMSG_DATA(cmsg), &pi, sizeof(pi));
+    }
+
     logger::debug() << "iface::write() ifa=" << name() << ", daddr=" << daddr.to_string() << ", len="
                     << size;
 
@@ -361,16 +834,19 @@ ssize_t iface::write(int fd, const address& daddr, const uint8_t* msg, size_t si
     if ((len = sendmsg(fd,& mhdr, 0)) < 0)
     {
         logger::error() << "iface::write() failed! error=" << logger::err() << ", ifa=" << name() << ", daddr=" << daddr.to_string();
+        _stats.tx_errors++;
         return -1;
     }
 
+    _rec.icmp6(recorder::TX, in6addr_any, daddr.const_addr(), msg, size);
+
     return len;
 }
 
-ssize_t iface::read_solicit(address& saddr, address& daddr, address& taddr)
+ssize_t iface::read_solicit(nd_packet& nd)
 {
     struct sockaddr_ll t_saddr;
-    uint8_t msg[256];
+    uint8_t msg[4096];
     ssize_t len;
 
     if ((len = read(_pfd, (struct sockaddr*)&t_saddr, sizeof(struct sockaddr_ll), msg, sizeof(msg))) < 0) {
@@ -378,48 +854,121 @@ ssize_t iface::read_solicit(address& saddr, address& daddr, address& taddr)
         return -1;
     }
 
-    struct ip6_hdr* ip6h =
-          (struct ip6_hdr* )(msg + ETH_HLEN);
+    // Router solicits and adverts are captured by the same socket.
 
-    struct nd_neighbor_solicit*  ns =
-        (struct nd_neighbor_solicit*)(msg + ETH_HLEN + sizeof(struct ip6_hdr));
+    if (len >= (ssize_t)(ETH_HLEN + sizeof(struct ip6_hdr) + sizeof(struct icmp6_hdr))) {
+        struct icmp6_hdr* icmp6h =
+            (struct icmp6_hdr* )(msg + ETH_HLEN + sizeof(struct ip6_hdr));
 
-    taddr = ns->nd_ns_target;
-    daddr = ip6h->ip6_dst;
-    saddr = ip6h->ip6_src;
-    
-    // Ignore packets sent from this machine
-    if (iface::is_local(saddr) == true) {
-        return 0;
+        if ((icmp6h->icmp6_type == ND_ROUTER_SOLICIT) ||
+            (icmp6h->icmp6_type == ND_ROUTER_ADVERT)) {
+            rsra::handle(_ptr, msg, len);
+            return 0;
+        }
     }
 
-    logger::debug() << "iface::read_solicit() saddr=" << saddr.to_string()
-                    << ", daddr=" << daddr.to_string() << ", taddr=" << taddr.to_string() << ", len=" << len;
-
-    return len;
+    return parse_solicit(msg, len, nd);
 }
 
-ssize_t iface::write_solicit(const address& taddr)
+ssize_t iface::read_trunk(ptr<iface>& ifa, nd_packet& nd)
 {
-    char buf[128];
+    struct sockaddr_ll t_saddr;
+    struct msghdr mhdr;
+    struct iovec iov;
+    uint8_t cbuf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+    uint8_t msg[256];
+    ssize_t len;
 
-    memset(buf, 0, sizeof(buf));
+    iov.iov_len  = sizeof(msg);
+    iov.iov_base = (caddr_t)msg;
 
-    struct nd_neighbor_solicit* ns =
-        (struct nd_neighbor_solicit* )&buf[0];
+    memset(&mhdr, 0, sizeof(mhdr));
+    mhdr.msg_name       = (caddr_t)&t_saddr;
+    mhdr.msg_namelen    = sizeof(struct sockaddr_ll);
+    mhdr.msg_iov        = &iov;
+    mhdr.msg_iovlen     = 1;
+    mhdr.msg_control    = cbuf;
+    mhdr.msg_controllen = sizeof(cbuf);
+
+    if ((len = recvmsg(_tfd, &mhdr, 0)) < 0) {
+        logger::warning() << "iface::read_trunk() failed: " << logger::err();
+        _stats.rx_errors++;
+        return -1;
+    }
 
-    struct nd_opt_hdr* opt =
-        (struct nd_opt_hdr* )&buf[sizeof(struct nd_neighbor_solicit)];
+    int vlan = -1;
 
-    opt->nd_opt_type = ND_OPT_SOURCE_LINKADDR;
-    opt->nd_opt_len  = 1;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mhdr); cmsg; cmsg = CMSG_NXTHDR(&mhdr, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_PACKET) && (cmsg->cmsg_type == PACKET_AUXDATA)) {
+            struct tpacket_auxdata aux;
+            memcpy(&aux, CMSG_DATA(cmsg), sizeof(aux));
 
-    ns->nd_ns_type   = ND_NEIGHBOR_SOLICIT;
+            if ((aux.tp_status & TP_STATUS_VLAN_VALID) || aux.tp_vlan_tci) {
+                vlan = aux.tp_vlan_tci & 0x0fff;
+            }
+        }
+    }
+
+    std::map<int, weak_ptr<iface> >::iterator it = _vlans.find(vlan);
+
+    if ((it == _vlans.end()) || !it->second) {
+        logger::debug() << "iface::read_trunk() trunk=" << _name << ", ignoring vlan=" << vlan;
+        return 0;
+    }
+
+    ifa = it->second;
+
+    logger::debug() << "iface::read_trunk() trunk=" << _name << ", ifa=" << ifa->name() << ", len=" << (int)len;
+
+    ifa->_rec.frame(recorder::RX, msg, len);
+
+    return ifa->parse_solicit(msg, len, nd);
+}
+
+ssize_t iface::parse_solicit(const uint8_t* msg, ssize_t len, nd_packet& nd)
+{
+    if (!nd.parse_frame(msg, len) || (nd.type != ND_NEIGHBOR_SOLICIT)) {
+        _stats.rx_errors++;
+        return 0;
+    }
+
+    // Ignore packets sent from this machine
+    if (iface::is_local(nd.saddr) == true) {
+        return 0;
+    }
+
+    _stats.rx_solicits++;
+
+    if (logger::verbosity() >= LOG_DEBUG) {
+        logger::debug() << "iface::read_solicit() saddr=" << address(nd.saddr).to_string()
+                        << ", daddr=" << address(nd.daddr).to_string() << ", taddr=" << address(nd.taddr).to_string()
+                        << ", len=" << len;
+    }
+
+    return len;
+}
+
+ssize_t iface::write_solicit(const address& taddr)
+{
+    char buf[128];
+
+    memset(buf, 0, sizeof(buf));
+
+    struct nd_neighbor_solicit* ns =
+        (struct nd_neighbor_solicit* )&buf[0];
+
+    struct nd_opt_hdr* opt =
+        (struct nd_opt_hdr* )&buf[sizeof(struct nd_neighbor_solicit)];
+
+    opt->nd_opt_type = ND_OPT_SOURCE_LINKADDR;
+    opt->nd_opt_len  = 1;
+
+    ns->nd_ns_type   = ND_NEIGHBOR_SOLICIT;
 
     memcpy(&ns->nd_ns_target,& taddr.const_addr(), sizeof(struct in6_addr));
 
     memcpy(buf + sizeof(struct nd_neighbor_solicit) + sizeof(struct nd_opt_hdr),
-           &hwaddr, 6);
+           &_hwaddr, 6);
 
     // FIXME: Alright, I'm lazy.
     static address multicast("ff02::1:ff00:0000");
@@ -435,11 +984,20 @@ ssize_t iface::write_solicit(const address& taddr)
     logger::debug() << "iface::write_solicit() taddr=" << taddr.to_string()
                     << ", daddr=" << daddr.to_string();
 
-    return write(_ifd, daddr, (uint8_t* )buf, sizeof(struct nd_neighbor_solicit)
-                 + sizeof(struct nd_opt_hdr) + 6);
+    ssize_t len = write_ring(_ns_frame, daddr, taddr, 0);
+
+    if (len < 0)
+        len = write(_ifd, daddr, (uint8_t* )buf, sizeof(struct nd_neighbor_solicit)
+                    + sizeof(struct nd_opt_hdr) + 6);
+
+    if (len >= 0)
+        _stats.tx_solicits++;
+
+    return len;
 }
 
-ssize_t iface::write_advert(const address& daddr, const address& taddr, bool router)
+ssize_t iface::write_advert(const address& daddr, const address& taddr, bool router,
+                            const struct ether_addr* dlla)
 {
     char buf[128];
 
@@ -460,43 +1018,233 @@ ssize_t iface::write_advert(const address& daddr, const address& taddr, bool rou
     memcpy(&na->nd_na_target,& taddr.const_addr(), sizeof(struct in6_addr));
 
     memcpy(buf + sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr),
-           &hwaddr, 6);
+           &_hwaddr, 6);
 
     logger::debug() << "iface::write_advert() daddr=" << daddr.to_string()
                     << ", taddr=" << taddr.to_string();
 
-    return write(_ifd, daddr, (uint8_t* )buf, sizeof(struct nd_neighbor_advert) +
-        sizeof(struct nd_opt_hdr) + 6);
+    // Unicast adverts need the link-layer address of the destination.
+    // If the solicit didn't carry it, it's left to the kernel to find.
+    if (daddr.is_multicast())
+        dlla = NULL;
+
+    ssize_t len = write_ring(_na_frame, daddr, taddr, na->nd_na_flags_reserved, dlla);
+
+    if ((len < 0) && dlla && (_pfd >= 0) && !_lladdr.is_empty()) {
+        uint8_t frame[ND_FRAME_LEN];
+        build_frame(frame, _na_frame, daddr, dlla, taddr, na->nd_na_flags_reserved);
+
+        if (write_frame(_index, frame, ND_FRAME_LEN) >= 0)
+            len = ND_FRAME_LEN - ETH_HLEN - sizeof(struct ip6_hdr);
+    }
+
+    if (len < 0)
+        len = write(_ifd, daddr, (uint8_t* )buf, sizeof(struct nd_neighbor_advert) +
+                    sizeof(struct nd_opt_hdr) + 6);
+
+    if (len >= 0)
+        _stats.tx_adverts++;
+
+    return len;
+}
+
+void iface::link_local(const address& addr)
+{
+    if (addr == _lladdr)
+        return;
+
+    _lladdr = addr;
+
+    if (_lladdr.is_empty())
+        return;
+
+    uint8_t* frames[] = { _ns_frame, _na_frame };
+
+    for (int i = 0; i < 2; i++) {
+        uint8_t* frame = frames[i];
+
+        memset(frame, 0, ND_FRAME_LEN);
+
+        struct ether_header* eh = (struct ether_header* )frame;
+        memcpy(eh->ether_shost, &_hwaddr, ETH_ALEN);
+        eh->ether_type = htons(ETHERTYPE_IPV6);
+
+        struct ip6_hdr* ip6h = (struct ip6_hdr* )(frame + ETH_HLEN);
+        ip6h->ip6_vfc  = 6 << 4;
+        ip6h->ip6_plen = htons(ND_FRAME_LEN - ETH_HLEN - sizeof(struct ip6_hdr));
+        ip6h->ip6_nxt  = IPPROTO_ICMPV6;
+        ip6h->ip6_hlim = 255;
+        ip6h->ip6_src  = _lladdr.const_addr();
+
+        uint8_t* icmp6 = frame + ETH_HLEN + sizeof(struct ip6_hdr);
+        ((struct icmp6_hdr* )icmp6)->icmp6_type = (i == 0) ? ND_NEIGHBOR_SOLICIT : ND_NEIGHBOR_ADVERT;
+
+        struct nd_opt_hdr* opt = (struct nd_opt_hdr* )(icmp6 + 24);
+        opt->nd_opt_type = (i == 0) ? ND_OPT_SOURCE_LINKADDR : ND_OPT_TARGET_LINKADDR;
+        opt->nd_opt_len  = 1;
+        memcpy(opt + 1, &_hwaddr, ETH_ALEN);
+    }
+}
+
+void iface::build_frame(uint8_t* frame, const uint8_t* tmpl, const address& daddr,
+                        const struct ether_addr* dlla, const address& taddr, uint32_t flags)
+{
+    memcpy(frame, tmpl, ND_FRAME_LEN);
+
+    if (dlla) {
+        memcpy(frame, dlla, ETH_ALEN);
+    } else {
+        // 33:33 followed by the low 32 bits of the group.
+        frame[0] = 0x33;
+        frame[1] = 0x33;
+        memcpy(frame + 2, &daddr.const_addr().s6_addr[12], 4);
+    }
+
+    struct ip6_hdr* ip6h = (struct ip6_hdr* )(frame + ETH_HLEN);
+    ip6h->ip6_dst = daddr.const_addr();
+
+    // Solicits and adverts have the target at the same offset, after the
+    // reserved field and the flags respectively.
+    struct nd_neighbor_advert* na = (struct nd_neighbor_advert* )(frame + ETH_HLEN + sizeof(struct ip6_hdr));
+    na->nd_na_flags_reserved = flags;
+    na->nd_na_target         = taddr.const_addr();
+    na->nd_na_cksum          = nd_packet::checksum(ip6h->ip6_src, ip6h->ip6_dst, (const uint8_t* )na,
+                                                   ND_FRAME_LEN - ETH_HLEN - sizeof(struct ip6_hdr));
+}
+
+ssize_t iface::write_ring(const uint8_t* tmpl, const address& daddr, const address& taddr, uint32_t flags,
+                          const struct ether_addr* dlla)
+{
+    if (!_tx.is_open() || _lladdr.is_empty() || (!dlla && !daddr.is_multicast()))
+        return -1;
+
+    uint8_t* frame = _tx.alloc();
+
+    if (!frame)
+        return -1;
+
+    build_frame(frame, tmpl, daddr, dlla, taddr, flags);
+
+    _tx.commit(ND_FRAME_LEN);
+
+    logger::debug() << "iface::write_ring() ifa=" << name() << ", daddr=" << daddr.to_string() << ", len="
+                    << (int)ND_FRAME_LEN;
+
+    _rec.frame(recorder::TX, frame, ND_FRAME_LEN);
+
+    return ND_FRAME_LEN - ETH_HLEN - sizeof(struct ip6_hdr);
 }
 
-ssize_t iface::read_advert(address& saddr, address& taddr)
+ssize_t iface::read_advert(nd_packet& nd)
 {
     struct sockaddr_in6 t_saddr;
     uint8_t msg[256];
     ssize_t len;
+    int hlim;
     
     memset(&t_saddr, 0, sizeof(struct sockaddr_in6));
     t_saddr.sin6_family = AF_INET6;
     t_saddr.sin6_port   = htons(IPPROTO_ICMPV6); // Needed?
 
-    if ((len = read(_ifd, (struct sockaddr* )&t_saddr, sizeof(struct sockaddr_in6), msg, sizeof(msg))) < 0) {
+    if ((len = read(_ifd, (struct sockaddr* )&t_saddr, sizeof(struct sockaddr_in6), msg, sizeof(msg), &hlim)) < 0) {
         logger::warning() << "iface::read_advert() failed: " << logger::err();
         return -1;
     }
 
-    saddr = t_saddr.sin6_addr;
-    
+    return parse_advert(t_saddr.sin6_addr, in6addr_any, hlim, msg, len, nd);
+}
+
+ssize_t iface::read_shared(ptr<iface>& ifa, nd_packet& nd)
+{
+    struct sockaddr_in6 t_saddr;
+    struct msghdr mhdr;
+    struct iovec iov;
+    uint8_t cbuf[CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(int))];
+    uint8_t msg[256];
+    ssize_t len;
+
+    memset(&t_saddr, 0, sizeof(struct sockaddr_in6));
+
+    iov.iov_len  = sizeof(msg);
+    iov.iov_base = (caddr_t)msg;
+
+    memset(&mhdr, 0, sizeof(mhdr));
+    mhdr.msg_name       = (caddr_t)&t_saddr;
+    mhdr.msg_namelen    = sizeof(struct sockaddr_in6);
+    mhdr.msg_iov        = &iov;
+    mhdr.msg_iovlen     = 1;
+    mhdr.msg_control    = cbuf;
+    mhdr.msg_controllen = sizeof(cbuf);
+
+    if ((len = recvmsg(_shared_fd, &mhdr, 0)) < 0) {
+        logger::warning() << "iface::read_shared() failed: " << logger::err();
+        return -1;
+    }
+
+    int index = 0, hlim = -1;
+    struct in6_addr daddr = in6addr_any;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mhdr); cmsg; cmsg = CMSG_NXTHDR(&mhdr, cmsg)) {
+        if ((cmsg->cmsg_level == IPPROTO_IPV6) && (cmsg->cmsg_type == IPV6_PKTINFO)) {
+            struct in6_pktinfo pi;
+            memcpy(&pi, CMSG_DATA(cmsg), sizeof(pi));
+            index = pi.ipi6_ifindex;
+            daddr = pi.ipi6_addr;
+        } else if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL)) {
+            uint32_t ovfl;
+            memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+
+            if (ovfl != _shared_ovfl) {
+                logger::warning() << "Kernel dropped " << (int)(ovfl - _shared_ovfl)
+                                  << " packet(s) on the shared ICMPv6 socket";
+                _shared_drops += ovfl - _shared_ovfl;
+                _shared_ovfl   = ovfl;
+            }
+        } else if ((cmsg->cmsg_level == IPPROTO_IPV6) && (cmsg->cmsg_type == IPV6_HOPLIMIT)) {
+            memcpy(&hlim, CMSG_DATA(cmsg), sizeof(hlim));
+        }
+    }
+
+    std::map<int, weak_ptr<iface> >::iterator it = _index_map.find(index);
+
+    if ((it == _index_map.end()) || !it->second) {
+        logger::debug() << "iface::read_shared() ignoring packet from ifindex=" << index;
+        return 0;
+    }
+
+    ifa = it->second;
+
+    logger::debug() << "iface::read_shared() ifa=" << ifa->name() << ", len=" << (int)len;
+
+    ifa->_rec.icmp6(recorder::RX, t_saddr.sin6_addr, daddr, msg, len);
+
+    if (len < (ssize_t)sizeof(struct icmp6_hdr)) {
+        ifa->_stats.rx_errors++;
+        return -1;
+    }
+
+    return ifa->parse_advert(t_saddr.sin6_addr, daddr, hlim, msg, len, nd);
+}
+
+ssize_t iface::parse_advert(const struct in6_addr& saddr, const struct in6_addr& daddr, int hlim,
+                            const uint8_t* msg, ssize_t len, nd_packet& nd)
+{
     // Ignore packets sent from this machine
     if (iface::is_local(saddr) == true) {
         return 0;
     }
 
-    if (((struct icmp6_hdr* )msg)->icmp6_type != ND_NEIGHBOR_ADVERT)
-        return -1;
+    if (!nd.parse_icmp6(msg, len, saddr, daddr, hlim) || (nd.type != ND_NEIGHBOR_ADVERT)) {
+        _stats.rx_errors++;
+        return 0;
+    }
 
-    taddr = ((struct nd_neighbor_solicit* )msg)->nd_ns_target;
+    _stats.rx_adverts++;
 
-    logger::debug() << "iface::read_advert() saddr=" << saddr.to_string() << ", taddr=" << taddr.to_string() << ", len=" << len;
+    if (logger::verbosity() >= LOG_DEBUG) {
+        logger::debug() << "iface::read_advert() saddr=" << address(nd.saddr).to_string()
+                        << ", taddr=" << address(nd.taddr).to_string() << ", len=" << len;
+    }
 
     return len;
 }
@@ -513,7 +1261,7 @@ bool iface::is_local(const address& addr)
     return false;
 }
 
-bool iface::handle_local(const address& saddr, const address& taddr)
+bool iface::handle_local(const address& saddr, const address& taddr, const struct ether_addr* slla)
 {
     // Check if the address is for an interface we own that is attached to
     // one of the slave interfaces    
@@ -529,10 +1277,11 @@ bool iface::handle_local(const address& saddr, const address& taddr)
                 for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
                     ptr<rule> ru = *it;
 
-                    if (ru->daughter() && ru->daughter()->name() == (*ad)->ifname())
+                    if (ru->daughter() &&
+                        netns::qualify(ru->daughter()->name(), ru->daughter()->netns_name()) == (*ad)->ifname())
                     {
                         logger::debug() << "proxy::handle_solicit() found local taddr=" << taddr;
-                        write_advert(saddr, taddr, false);
+                        write_advert(saddr, taddr, false, slla);
                         return true;
                     }
                 }
@@ -565,6 +1314,7 @@ void iface::handle_reverse_advert(const address& saddr, const std::string& ifnam
             ptr<rule> ru = *it;
 
             if (ru->addr() == saddr &&
+                ru->daughter() &&
                 ru->daughter()->name() == ifname)
             {
                 logger::debug() << " - generating artifical advertisement: " << ifname;
@@ -576,23 +1326,43 @@ void iface::handle_reverse_advert(const address& saddr, const std::string& ifnam
 
 void iface::fixup_pollfds()
 {
-    _pollfds.resize(_map.size()*  2);
-
-    int i = 0;
+    _pollfds.clear();
+    _pollifs.clear();
 
     logger::debug() << "iface::fixup_pollfds() _map.size()=" << _map.size();
 
     for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
             it != _map.end(); it++) {
-        _pollfds[i].fd      = it->second->_ifd;
-        _pollfds[i].events  = POLLIN;
-        _pollfds[i].revents = 0;
-        i++;
+        struct pollfd pfd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+
+        if ((it->second->_ifd >= 0) && (it->second->_ifd != _shared_fd)) {
+            pfd.fd = it->second->_ifd;
+            _pollfds.push_back(pfd);
+            _pollifs.push_back(it->second);
+        }
+
+        if (it->second->_pfd >= 0) {
+            pfd.fd = it->second->_pfd;
+            _pollfds.push_back(pfd);
+            _pollifs.push_back(it->second);
+        }
 
-        _pollfds[i].fd      = it->second->_pfd;
-        _pollfds[i].events  = POLLIN;
-        _pollfds[i].revents = 0;
-        i++;
+        if (it->second->_tfd >= 0) {
+            pfd.fd = it->second->_tfd;
+            _pollfds.push_back(pfd);
+            _pollifs.push_back(it->second);
+        }
+    }
+
+    if (_shared_fd >= 0) {
+        struct pollfd pfd;
+        pfd.fd      = _shared_fd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        _pollfds.push_back(pfd);
+        _pollifs.push_back(weak_ptr<iface>());
     }
 }
 
@@ -605,6 +1375,14 @@ void iface::cleanup()
             _map.erase(c_it);
         }
     }
+
+    for (std::map<int, weak_ptr<iface> >::iterator it = _index_map.begin();
+            it != _index_map.end(); ) {
+        std::map<int, weak_ptr<iface> >::iterator c_it = it++;
+        if (!c_it->second) {
+            _index_map.erase(c_it);
+        }
+    }
 }
 
 int iface::poll_all()
@@ -617,142 +1395,712 @@ int iface::poll_all()
 
     if (_pollfds.size() == 0) {
         ::sleep(1);
+        _poll_wait = 1000;
         return 0;
     }
 
-    assert(_pollfds.size() == _map.size()*  2);
+    assert(_pollfds.size() == _pollifs.size());
 
     int len;
 
-    if ((len = ::poll(&_pollfds[0], _pollfds.size(), 50)) < 0) {
-        logger::error() << "Failed to poll interfaces: " << logger::err();
-        return -1;
-    }
+    struct timespec t1, t2;
 
-    if (len == 0) {
-        return 0;
-    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (!_busy_poll) {
+        len = ::poll(&_pollfds[0], _pollfds.size(), 50);
+    } else {
+        // Spin for at most as long as we would otherwise have slept, so
+        // that the timers in the main loop still run at the same pace.
+        while (!(len = ::poll(&_pollfds[0], _pollfds.size(), 0))) {
+            // poll() only busy polls with net.core.busy_poll set, but a
+            // non-blocking read on an empty socket busy polls its device
+            // queue for SO_BUSY_POLL microseconds. Peek, so that whatever
+            // arrives is still there for the next poll().
+            for (size_t i = 0; i < _pollfds.size(); i++) {
+                char c;
+                ::recv(_pollfds[i].fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT);
+            }
 
-    std::map<std::string, weak_ptr<iface> >::iterator i_it = _map.begin();
+            clock_gettime(CLOCK_MONOTONIC, &t2);
 
-    int i = 0;
+            if (((t2.tv_sec - t1.tv_sec) * 1000) +
+                ((t2.tv_nsec - t1.tv_nsec) / 1000000) >= 50) {
+                break;
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
 
-    for (std::vector<struct pollfd>::iterator f_it = _pollfds.begin();
-            f_it != _pollfds.end(); f_it++) {
-        assert(i_it != _map.end());
+    _poll_wait = ((t2.tv_sec - t1.tv_sec) * 1000) + ((t2.tv_nsec - t1.tv_nsec) / 1000000);
 
-        if (i && !(i % 2)) {
-            i_it++;
+    if (len < 0) {
+        if (errno == EINTR) {
+            return 0;
         }
 
-        bool is_pfd = i++ % 2;
+        logger::error() << "Failed to poll interfaces: " << logger::err();
+        return -1;
+    }
+
+    if (len == 0) {
+        return 0;
+    }
 
-        ptr<iface> ifa = i_it->second;
+    for (size_t i = 0; i < _pollfds.size(); i++) {
+        const struct pollfd& pfd = _pollfds[i];
 
-        if (f_it->revents & POLLERR) {
-            logger::error() << "Error polling interface " << ifa->_name.c_str();
+        if (pfd.revents & POLLERR) {
+            if (pfd.fd == _shared_fd) {
+                logger::error() << "Error polling the shared ICMPv6 socket";
+            } else {
+                logger::error() << "Error polling interface " << ptr<iface>(_pollifs[i])->_name;
+            }
             return -1;
         }
 
-        if (!(f_it->revents & POLLIN)) {
+        if (!(pfd.revents & POLLIN)) {
             continue;
         }
 
-        address saddr, daddr, taddr;
+        nd_packet nd;
         ssize_t size;
 
-        if (is_pfd) {
-            size = ifa->read_solicit(saddr, daddr, taddr);
+        if (pfd.fd == _shared_fd) {
+            ptr<iface> ifa;
+
+            size = read_shared(ifa, nd);
             if (size < 0) {
-                logger::error() << "Failed to read from interface '%s'", ifa->_name.c_str();
+                logger::error() << "Failed to read from the shared ICMPv6 socket";
                 continue;
-            } 
+            }
             if (size == 0) {
-                logger::debug() << "iface::read_solicit() loopback received and ignored";
+                logger::debug() << "iface::read_shared() packet ignored";
                 continue;
             }
-            
-            // Process any local addresses for interfaces that we are proxying
-            if (ifa->handle_local(saddr, taddr) == true) {
+
+            ifa->handle_advert(nd.saddr, nd.taddr);
+            continue;
+        }
+
+        ptr<iface> ifa = _pollifs[i];
+
+        if (pfd.fd == ifa->_tfd) {
+            ptr<iface> vifa;
+
+            size = ifa->read_trunk(vifa, nd);
+            if (size < 0) {
+                logger::error() << "Failed to read from trunk '" << ifa->_name << "'";
                 continue;
             }
-            
-            // We have to handle all the parents who may be interested in
-            // the reverse path towards the one who sent this solicit.
-            // In fact, the parent need to know the source address in order
-            // to respond to NDP Solicitations
-            ifa->handle_reverse_advert(saddr, ifa->name());
-
-            // Loop through all the proxies that are using this iface to respond to NDP solicitation requests
-            bool handled = false;
-            for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
-                ptr<proxy> pr = (*pit);
-                if (!pr) continue;
-                
-                // Process the solicitation request by relating it to other
-                // interfaces or lookup up any statics routes we have configured
-                handled = true;
-                pr->handle_solicit(saddr, taddr, ifa->name());
+            if (size == 0) {
+                logger::debug() << "iface::read_trunk() packet ignored";
+                continue;
             }
-            
-            // If it was not handled then write an error message
-            if (handled == false) {
-                logger::debug() << " - solicit was ignored";
+
+            vifa->handle_solicit(nd.saddr, nd.taddr, nd.source_lla());
+        } else if (pfd.fd == ifa->_pfd) {
+            size = ifa->read_solicit(nd);
+            if (size < 0) {
+                logger::error() << "Failed to read from interface '" << ifa->_name << "'";
+                continue;
+            } 
+            if (size == 0) {
+                logger::debug() << "iface::read_solicit() packet ignored";
+                continue;
             }
-            
+
+            ifa->handle_solicit(nd.saddr, nd.taddr, nd.source_lla());
         } else {
-            size = ifa->read_advert(saddr, taddr);
+            size = ifa->read_advert(nd);
             if (size < 0) {
-                logger::error() << "Failed to read from interface '%s'", ifa->_name.c_str();
+                logger::error() << "Failed to read from interface '" << ifa->_name << "'";
                 continue;
             }
             if (size == 0) {
-                logger::debug() << "iface::read_advert() loopback received and ignored";
+                logger::debug() << "iface::read_advert() packet ignored";
                 continue;
             }
+
+            ifa->handle_advert(nd.saddr, nd.taddr);
+        }
+    }
+
+    return 0;
+}
+
+void iface::handle_solicit(const address& saddr, const address& taddr, const struct ether_addr* slla)
+{
+    if (IN6_IS_ADDR_UNSPECIFIED(&saddr.const_addr()))
+        handle_dad(taddr);
+
+    // Rule interfaces that aren't proxy interfaces as well only capture
+    // solicits to see duplicate address detection.
+    if (_serves.empty())
+        return;
+
+    // Process any local addresses for interfaces that we are proxying
+    if (handle_local(saddr, taddr, slla) == true) {
+        return;
+    }
+    
+    // We have to handle all the parents who may be interested in
+    // the reverse path towards the one who sent this solicit.
+    // In fact, the parent need to know the source address in order
+    // to respond to NDP Solicitations
+    handle_reverse_advert(saddr, name());
+
+    // Loop through all the proxies that are using this iface to respond to NDP solicitation requests
+    bool handled = false;
+    for (std::list<weak_ptr<proxy> >::iterator pit = serves_begin(); pit != serves_end(); pit++) {
+        ptr<proxy> pr = (*pit);
+        if (!pr) continue;
+        
+        // Process the solicitation request by relating it to other
+        // interfaces or lookup up any statics routes we have configured
+        handled = true;
+        pr->handle_solicit(saddr, taddr, name(), slla);
+    }
+    
+    // If it was not handled then write an error message
+    if (handled == false) {
+        logger::debug() << " - solicit was ignored";
+    }
+}
+
+void iface::handle_advert(const address& saddr, const address& taddr)
+{
+    // Process the NDP advert
+    bool handled = false;
+    for (std::list<weak_ptr<proxy> >::iterator pit = parents_begin(); pit != parents_end(); pit++) {
+        ptr<proxy> pr = (*pit);
+        if (!pr || !pr->ifa()) {
+            continue;
+        }
+        
+        // The proxy must have a rule for this interface or it is not meant to receive
+        // any notifications and thus they must be ignored
+        bool autovia = false;
+        bool is_relevant = false;
+        for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+            ptr<rule> ru = *it;
             
-            // Process the NDP advert
-            bool handled = false;
-            for (std::list<weak_ptr<proxy> >::iterator pit = ifa->parents_begin(); pit != ifa->parents_end(); pit++) {
-                ptr<proxy> pr = (*pit);
-                if (!pr || !pr->ifa()) {
-                    continue;
-                }
-                
-                // The proxy must have a rule for this interface or it is not meant to receive
-                // any notifications and thus they must be ignored
-                bool autovia = false;
-                bool is_relevant = false;
-                for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
-                    ptr<rule> ru = *it;
-                    
-                    if (ru->addr() == taddr &&
-                        ru->daughter() &&
-                        ru->daughter()->name() == ifa->name())
-                    {
-                        is_relevant = true;
-                        autovia = ru->autovia();
-                        break;
-                    }
-                }
-                if (is_relevant == false) {
-                    logger::debug() << "iface::read_advert() advert is not for " << ifa->name() << "...skipping";
-                    continue;
-                }
-                
-                // Process the NDP advertisement
-                handled = true;
-                pr->handle_advert(saddr, taddr, ifa->name(), autovia);
+            if (ru->addr() == taddr &&
+                ru->daughter() &&
+                ru->daughter()->name() == name())
+            {
+                is_relevant = true;
+                autovia = ru->autovia();
+                break;
             }
-            
-            // If it was not handled then write an error message
-            if (handled == false) {
-                logger::debug() << " - advert was ignored";
+        }
+        if (is_relevant == false) {
+            logger::debug() << "iface::read_advert() advert is not for " << name() << "...skipping";
+            continue;
+        }
+        
+        // Process the NDP advertisement
+        handled = true;
+        pr->handle_advert(saddr, taddr, name(), autovia);
+    }
+    
+    // If it was not handled then write an error message
+    if (handled == false) {
+        logger::debug() << " - advert was ignored";
+    }
+}
+
+void iface::handle_dad(const address& taddr)
+{
+    for (std::list<weak_ptr<proxy> >::iterator pit = parents_begin(); pit != parents_end(); pit++) {
+        ptr<proxy> pr = (*pit);
+        if (!pr || !pr->ifa() || !pr->learn()) {
+            continue;
+        }
+
+        for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+            ptr<rule> ru = *it;
+
+            if (ru->addr() == taddr &&
+                ru->daughter() &&
+                ru->daughter()->name() == name())
+            {
+                logger::debug() << "iface::handle_dad() taddr=" << taddr << ", ifname=" << name();
+                pr->handle_advert(address(), taddr, name(), ru->autovia());
+                break;
             }
         }
     }
+}
+
+void iface::shared_socket(bool val)
+{
+    _shared_socket = val;
+}
+
+bool iface::shared_socket()
+{
+    return _shared_socket;
+}
+
+int iface::index() const
+{
+    return _index;
+}
+
+const std::string& iface::netns_name() const
+{
+    return _netns;
+}
+
+void iface::busy_poll(int usec)
+{
+    _busy_poll = (usec >= 0) ? usec : 0;
+}
+
+int iface::busy_poll()
+{
+    return _busy_poll;
+}
+
+void iface::setup_busy_poll(int fd)
+{
+    if (!_busy_poll) {
+        return;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &_busy_poll, sizeof(_busy_poll)) < 0) {
+        logger::warning() << "Failed to set SO_BUSY_POLL: " << logger::err();
+    }
+
+#ifdef SO_PREFER_BUSY_POLL
+    int on = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0) {
+        logger::debug() << "Failed to set SO_PREFER_BUSY_POLL: " << logger::err();
+    }
+#endif
+}
+
+void iface::buffer_size(int rcvbuf, int sndbuf)
+{
+    int fds[] = { _ifd, _pfd };
+
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] < 0) {
+            continue;
+        }
+
+        // SO_*BUFFORCE lets us go beyond the rmem_max/wmem_max limits,
+        // but it requires CAP_NET_ADMIN.
+
+        if (rcvbuf > _rcvbuf &&
+            setsockopt(fds[i], SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0 &&
+            setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+            logger::warning() << "Failed to set receive buffer size on interface '" << _name << "': " << logger::err();
+        }
+
+        if (sndbuf > _sndbuf &&
+            setsockopt(fds[i], SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, sizeof(sndbuf)) < 0 &&
+            setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0) {
+            logger::warning() << "Failed to set send buffer size on interface '" << _name << "': " << logger::err();
+        }
+    }
 
+    if (rcvbuf > _rcvbuf)
+        _rcvbuf = rcvbuf;
+
+    if (sndbuf > _sndbuf)
+        _sndbuf = sndbuf;
+}
+
+void iface::flush_all()
+{
+    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
+            it != _map.end(); it++) {
+        if (it->second && !it->second->_tx.flush())
+            it->second->_stats.tx_errors++;
+    }
+}
+
+void iface::read_drops()
+{
+    // PACKET_STATISTICS resets the counters once read, so we'll have
+    // to accumulate them ourselves.
+
+    int fds[] = { _pfd, _tfd };
+
+    for (int i = 0; i < 2; i++) {
+        struct tpacket_stats st;
+        socklen_t st_len = sizeof(st);
+
+        if ((fds[i] >= 0) && (getsockopt(fds[i], SOL_PACKET, PACKET_STATISTICS, &st, &st_len) == 0)) {
+            _stats.pfd_drops += st.tp_drops;
+        }
+    }
+}
+
+// Returns how full the receive queue of 'fd' is, in percent.
+static int queue_fill(int fd)
+{
+#ifdef SO_MEMINFO
+    uint32_t mem[SK_MEMINFO_VARS];
+    socklen_t mem_len = sizeof(mem);
+
+    if ((fd < 0) || (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, mem, &mem_len) < 0) ||
+        !mem[SK_MEMINFO_RCVBUF]) {
+        return 0;
+    }
+
+    return (int)((uint64_t)mem[SK_MEMINFO_RMEM_ALLOC] * 100 / mem[SK_MEMINFO_RCVBUF]);
+#else
     return 0;
+#endif
+}
+
+uint64_t iface::kernel_drops(int& queue)
+{
+    uint64_t drops = _shared_drops;
+
+    queue = queue_fill(_shared_fd);
+
+    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
+            it != _map.end(); it++) {
+        if (!it->second)
+            continue;
+
+        ptr<iface> ifa = it->second;
+
+        ifa->read_drops();
+
+        drops += ifa->_stats.pfd_drops + ifa->_stats.ifd_drops;
+
+        queue = std::max(queue, queue_fill(ifa->_pfd));
+        queue = std::max(queue, queue_fill(ifa->_tfd));
+
+        if (ifa->_ifd != _shared_fd)
+            queue = std::max(queue, queue_fill(ifa->_ifd));
+    }
+
+    return drops;
+}
+
+int iface::poll_wait()
+{
+    return _poll_wait;
+}
+
+void iface::dump_stats()
+{
+    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
+            it != _map.end(); it++) {
+        if (!it->second)
+            continue;
+
+        ptr<iface> ifa = it->second;
+
+        ifa->read_drops();
+
+        const struct stats& st = ifa->_stats;
+
+        logger::notice()
+            << "iface " << it->first << ": "
+            << logger::format("rx ns=%llu na=%llu errors=%llu, tx ns=%llu na=%llu errors=%llu, "
+                              "kernel drops pfd=%llu ifd=%llu",
+                              (unsigned long long)st.rx_solicits, (unsigned long long)st.rx_adverts,
+                              (unsigned long long)st.rx_errors, (unsigned long long)st.tx_solicits,
+                              (unsigned long long)st.tx_adverts, (unsigned long long)st.tx_errors,
+                              (unsigned long long)st.pfd_drops, (unsigned long long)st.ifd_drops)
+            << (ifa->_srtt ? logger::format(", srtt=%d rttvar=%d rto=%d",
+                                            ifa->_srtt >> 3, ifa->_rttvar >> 2, ifa->rto(0)) : "")
+            << (ifa->_probe_rate ? logger::format(", throttled ns=%llu",
+                                                  (unsigned long long)st.tx_throttled) : "")
+            << (!ifa->_groups.empty() ? logger::format(", groups=%d", (int)ifa->_groups.size()) : "");
+    }
+
+    if (_shared_fd >= 0) {
+        logger::notice()
+            << "shared ICMPv6 socket: "
+            << logger::format("kernel drops=%llu", (unsigned long long)_shared_drops);
+    }
+}
+
+void iface::rtt_sample(int rtt)
+{
+    if (rtt < 1)
+        rtt = 1;
+
+    if (!_srtt) {
+        // SRTT = R, RTTVAR = R/2
+        _srtt   = rtt << 3;
+        _rttvar = rtt << 1;
+    } else {
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+        int delta = rtt - (_srtt >> 3);
+
+        _srtt   += delta;
+        _rttvar += ((delta < 0) ? -delta : delta) - (_rttvar >> 2);
+    }
+}
+
+int iface::rto(int initial) const
+{
+    if (!_srtt)
+        return initial;
+
+    // RTO = SRTT + 4 * RTTVAR
+    return (_srtt >> 3) + _rttvar;
+}
+
+void iface::probe_rate(int rate)
+{
+    if (rate <= 0 || (_probe_rate && _probe_rate <= rate))
+        return;
+
+    _probe_rate   = rate;
+    _probe_tokens = (long long)rate * 1000;
+    _probe_stamp  = 0;
+}
+
+bool iface::probe_budget(bool known)
+{
+    if (!_probe_rate)
+        return true;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    long long now = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    long long burst = (long long)_probe_rate * 1000;
+
+    // 'rate' thousandths of a solicit per millisecond.
+    if (_probe_stamp)
+        _probe_tokens = std::min(burst, _probe_tokens + (now - _probe_stamp) * _probe_rate);
+
+    _probe_stamp = now;
+
+    if (_probe_tokens < (known ? 1000 : std::max(1000LL, burst / 2))) {
+        _stats.tx_throttled++;
+        return false;
+    }
+
+    _probe_tokens -= 1000;
+    return true;
+}
+
+// Solicited-node groups are kept by the low 24 bits of their address;
+// this stands for all-routers (ff02::2) instead.
+static const uint32_t ALL_ROUTERS_GROUP = 0x1000000;
+
+static void group_mac(uint32_t group, uint8_t* mac)
+{
+    static const uint8_t all_routers[ETH_ALEN] = { 0x33, 0x33, 0x00, 0x00, 0x00, 0x02 };
+
+    if (group == ALL_ROUTERS_GROUP) {
+        memcpy(mac, all_routers, ETH_ALEN);
+        return;
+    }
+
+    mac[0] = 0x33;
+    mac[1] = 0x33;
+    mac[2] = 0xff;
+    mac[3] = (uint8_t)(group >> 16);
+    mac[4] = (uint8_t)(group >> 8);
+    mac[5] = (uint8_t)group;
+}
+
+void iface::multicast_groups(int max)
+{
+    if (_pfd < 0)
+        return;
+
+    // Work out the groups needed, unless there are too many. Solicited-
+    // node groups only depend on the low 24 bits of the target, so a
+    // prefix shorter than /104 needs all of them.
+
+    std::set<uint32_t> groups;
+
+    bool all = (max <= 0) || (_tfd >= 0);
+
+    for (std::list<weak_ptr<proxy> >::iterator pit = _serves.begin();
+            !all && (pit != _serves.end()); pit++) {
+        ptr<proxy> pr = *pit;
+
+        if (!pr)
+            continue;
+
+        if (pr->promiscuous()) {
+            all = true;
+            break;
+        }
+
+        for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+            const address& addr = (*it)->addr();
+
+            if ((addr.prefix() < 104) ||
+                    (groups.size() + (1U << (128 - addr.prefix())) > (size_t)max)) {
+                all = true;
+                break;
+            }
+
+            // Rule addresses aren't masked when parsed, so the host bits
+            // have to be cleared here.
+            const uint8_t* a = addr.const_addr().s6_addr;
+            uint32_t count = 1U << (128 - addr.prefix());
+            uint32_t base = (((uint32_t)a[13] << 16) | ((uint32_t)a[14] << 8) | a[15]) & ~(count - 1);
+
+            for (uint32_t i = 0; i < count; i++)
+                groups.insert(base | i);
+        }
+    }
+
+    uint8_t mac[ETH_ALEN];
+
+    if (all) {
+        logger::debug() << "iface::multicast_groups() if=" << _name << ", using ALLMULTI";
+
+        allmulti(1);
+
+        for (std::set<uint32_t>::iterator it = _groups.begin(); it != _groups.end(); it++) {
+            group_mac(*it, mac);
+            membership(false, mac);
+        }
+
+        _groups.clear();
+        return;
+    }
+
+    // Router solicits are sent to all-routers.
+    if (_capture & CAPTURE_RS)
+        groups.insert(ALL_ROUTERS_GROUP);
+
+    // Join the new groups before leaving the old ones, and before ALLMULTI
+    // is turned off, so that no solicits are missed in between.
+
+    for (std::set<uint32_t>::iterator it = groups.begin(); it != groups.end(); it++) {
+        group_mac(*it, mac);
+
+        if (!_groups.count(*it) && !membership(true, mac)) {
+            // Better to receive too much than to miss solicits.
+            groups.erase(it, groups.end());
+            _groups.insert(groups.begin(), groups.end());
+            return;
+        }
+    }
+
+    for (std::set<uint32_t>::iterator it = _groups.begin(); it != _groups.end(); it++) {
+        group_mac(*it, mac);
+
+        if (!groups.count(*it))
+            membership(false, mac);
+    }
+
+    _groups.swap(groups);
+
+    logger::debug() << "iface::multicast_groups() if=" << _name << ", groups=" << (int)_groups.size();
+
+    // Leave ALLMULTI as it was before we turned it on.
+    if (_prev_allmulti == 0)
+        allmulti(0);
+}
+
+bool iface::membership(bool add, const uint8_t* mac)
+{
+    struct packet_mreq mr;
+
+    memset(&mr, 0, sizeof(mr));
+    mr.mr_ifindex = _index;
+    mr.mr_type    = PACKET_MR_MULTICAST;
+    mr.mr_alen    = ETH_ALEN;
+    memcpy(mr.mr_address, mac, ETH_ALEN);
+
+    if (setsockopt(_pfd, SOL_PACKET, add ? PACKET_ADD_MEMBERSHIP : PACKET_DROP_MEMBERSHIP, &mr, sizeof(mr)) < 0) {
+        logger::error() << "Failed to " << (add ? "join" : "leave") << " multicast group on interface '"
+                        << _name << "': " << logger::err();
+        return false;
+    }
+
+    return true;
+}
+
+bool iface::proxy_ndp(bool state)
+{
+    if (!state) {
+        if (_prev_proxy_ndp.empty())
+            return true;
+
+        bool ok = write_sysctl("conf/" + _name + "/proxy_ndp", _prev_proxy_ndp) &&
+                  write_sysctl("neigh/" + _name + "/proxy_delay", _prev_proxy_delay);
+
+        _prev_proxy_ndp.clear();
+        _prev_proxy_delay.clear();
+
+        return ok;
+    }
+
+    std::string old_ndp, old_delay;
+
+    if (!read_sysctl("conf/" + _name + "/proxy_ndp", old_ndp) ||
+        !read_sysctl("neigh/" + _name + "/proxy_delay", old_delay)) {
+        return false;
+    }
+
+    // The kernel would otherwise delay its answers to multicast
+    // solicits by up to proxy_delay (0.8 seconds by default).
+
+    if (!write_sysctl("conf/" + _name + "/proxy_ndp", "1") ||
+        !write_sysctl("neigh/" + _name + "/proxy_delay", "0")) {
+        return false;
+    }
+
+    if (_prev_proxy_ndp.empty()) {
+        _prev_proxy_ndp   = old_ndp;
+        _prev_proxy_delay = old_delay;
+    }
+
+    return true;
+}
+
+bool iface::read_sysctl(const std::string& path, std::string& value)
+{
+    // What's under /proc/sys/net depends on the namespace it's opened in.
+    netns::scope ns(_netns);
+
+    if (!ns)
+        return false;
+
+    std::ifstream ifs(("/proc/sys/net/ipv6/" + path).c_str());
+
+    if (!ifs || !(ifs >> value)) {
+        logger::error() << "Failed to read /proc/sys/net/ipv6/" << path;
+        return false;
+    }
+
+    return true;
+}
+
+bool iface::write_sysctl(const std::string& path, const std::string& value)
+{
+    netns::scope ns(_netns);
+
+    if (!ns)
+        return false;
+
+    std::ofstream ofs(("/proc/sys/net/ipv6/" + path).c_str());
+
+    if (!ofs || !(ofs << value << std::endl)) {
+        logger::error() << "Failed to write /proc/sys/net/ipv6/" << path;
+        return false;
+    }
+
+    return true;
+}
+
+int iface::ctl_fd() const
+{
+    // Any socket will do for the interface ioctls.
+    return (_pfd >= 0) ? _pfd : (_ifd >= 0) ? _ifd : _tfd;
 }
 
 int iface::allmulti(int state)
@@ -769,7 +2117,7 @@ int iface::allmulti(int state)
 
     strncpy(ifr.ifr_name, _name.c_str(), IFNAMSIZ);
 
-    if (ioctl(_pfd, SIOCGIFFLAGS, &ifr) < 0) {
+    if (ioctl(ctl_fd(), SIOCGIFFLAGS, &ifr) < 0) {
         logger::error() << "Failed to get allmulti: " << logger::err();
         return -1;
     }
@@ -786,7 +2134,7 @@ int iface::allmulti(int state)
         ifr.ifr_flags &= ~IFF_ALLMULTI;
     }
 
-    if (ioctl(_pfd, SIOCSIFFLAGS, &ifr) < 0) {
+    if (ioctl(ctl_fd(), SIOCSIFFLAGS, &ifr) < 0) {
         logger::error() << "Failed to set allmulti: " << logger::err();
         return -1;
     }
@@ -808,7 +2156,7 @@ int iface::promiscuous(int state)
 
     strncpy(ifr.ifr_name, _name.c_str(), IFNAMSIZ);
 
-    if (ioctl(_pfd, SIOCGIFFLAGS, &ifr) < 0) {
+    if (ioctl(ctl_fd(), SIOCGIFFLAGS, &ifr) < 0) {
         logger::error() << "Failed to get promiscuous: " << logger::err();
         return -1;
     }
@@ -825,7 +2173,7 @@ int iface::promiscuous(int state)
         ifr.ifr_flags &= ~IFF_PROMISC;
     }
 
-    if (ioctl(_pfd, SIOCSIFFLAGS, &ifr) < 0) {
+    if (ioctl(ctl_fd(), SIOCSIFFLAGS, &ifr) < 0) {
         logger::error() << "Failed to set promiscuous: " << logger::err();
         return -1;
     }
@@ -855,6 +2203,13 @@ std::list<weak_ptr<proxy> >::iterator iface::serves_end()
 
 void iface::add_parent(const ptr<proxy>& pr)
 {
+    // Every rule of a proxy adds it again; keep a single entry.
+
+    for (std::list<weak_ptr<proxy> >::iterator it = _parents.begin(); it != _parents.end(); it++) {
+        if (*it == pr)
+            return;
+    }
+
     _parents.push_back(pr);
 }
 
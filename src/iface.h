@@ -19,11 +19,15 @@
 #include <list>
 #include <vector>
 #include <map>
+#include <set>
 
 #include <sys/poll.h>
 #include <net/ethernet.h>
 
 #include "ndppd.h"
+#include "recorder.h"
+#include "txring.h"
+#include "nd_packet.h"
 
 NDPPD_NS_BEGIN
 
@@ -31,34 +35,116 @@ class session;
 class proxy;
 
 class iface {
+    friend class handover;
+
 public:
+    // Kinds of messages captured by the PF_PACKET socket.
+    enum {
+        CAPTURE_NS = 1,
+        CAPTURE_RS = 2,
+        CAPTURE_RA = 4
+    };
 
     // Destructor.
     ~iface();
 
     static ptr<iface> open_ifd(const std::string& name);
 
-    static ptr<iface> open_pfd(const std::string& name, bool promiscuous);
+    static ptr<iface> open_pfd(const std::string& name, bool promiscuous, int capture = CAPTURE_NS);
+
+    // Like open_pfd(), but for a VLAN interface. Solicits are instead
+    // captured on the underlying trunk device, through a socket that is
+    // shared by all VLANs on that trunk.
+    static ptr<iface> open_trunk(const std::string& name, bool promiscuous);
 
     static int poll_all();
 
-    ssize_t read(int fd, struct sockaddr* saddr, ssize_t saddr_size, uint8_t* msg, size_t size);
+    // Sets the SO_BUSY_POLL budget (in microseconds) applied to every
+    // socket opened after this call. A non-zero value also makes
+    // poll_all() spin instead of sleeping in ::poll().
+    static void busy_poll(int usec);
+
+    static int busy_poll();
+
+    // Makes all interfaces share a single ICMPv6 socket, instead of
+    // opening one per interface. Must be set before any are opened.
+    static void shared_socket(bool val);
+
+    static bool shared_socket();
+
+    // Logs the packet counters of all interfaces.
+    static void dump_stats();
+
+    // Sends the frames queued on the transmit rings of all interfaces.
+    static void flush_all();
+
+    // Returns the number of packets the kernel has dropped on all
+    // interfaces so far, and sets 'queue' to how full the fullest
+    // receive queue is, in percent.
+    static uint64_t kernel_drops(int& queue);
+
+    // Returns how long the last poll_all() waited for packets, in
+    // milliseconds.
+    static int poll_wait();
+
+    // Reads a message, and sets 'hlim' to the hop limit it was received
+    // with if the socket reports it, or -1.
+    ssize_t read(int fd, struct sockaddr* saddr, ssize_t saddr_size, uint8_t* msg, ssize_t size, int* hlim = NULL);
 
     ssize_t write(int fd, const address& daddr, const uint8_t* msg, size_t size);
 
     // Writes a NB_NEIGHBOR_SOLICIT message to the _ifd socket.
     ssize_t write_solicit(const address& taddr);
 
-    // Writes a NB_NEIGHBOR_ADVERT message to the _ifd socket;
-    ssize_t write_advert(const address& daddr, const address& taddr, bool router);
+    // Writes a NB_NEIGHBOR_ADVERT message. If the link-layer address of
+    // a unicast destination is known, the advert is sent as a frame
+    // through the transmit ring or the _pfd socket, and otherwise to the
+    // _ifd socket.
+    ssize_t write_advert(const address& daddr, const address& taddr, bool router,
+                         const struct ether_addr* dlla = NULL);
+
+    // Sets the link-local address that the frames built by ndppd are sent
+    // from. Until there is one, adverts and solicits only go through the
+    // ICMPv6 sockets.
+    void link_local(const address& addr);
+
+    // Adds to the kinds of messages captured by the _pfd socket.
+    bool capture(int types);
+
+    // Writes an Ethernet frame through the _pfd socket, out of the
+    // interface with the specified index.
+    ssize_t write_frame(int ifindex, const uint8_t* msg, size_t size);
+
+    // Reads a NB_NEIGHBOR_SOLICIT message from the _pfd socket. Router
+    // solicits and adverts are passed on to rsra, and 0 is returned, as
+    // it is for messages that are invalid or sent by this machine.
+    ssize_t read_solicit(nd_packet& nd);
 
-    // Reads a NB_NEIGHBOR_SOLICIT message from the _pfd socket.
-    ssize_t read_solicit(address& saddr, address& daddr, address& taddr);
+    // Reads a NB_NEIGHBOR_SOLICIT message from the _tfd socket, and sets
+    // 'ifa' to the VLAN interface it was received on.
+    ssize_t read_trunk(ptr<iface>& ifa, nd_packet& nd);
 
     // Reads a NB_NEIGHBOR_ADVERT message from the _ifd socket;
-    ssize_t read_advert(address& saddr, address& taddr);
+    ssize_t read_advert(nd_packet& nd);
+
+    // Reads a NB_NEIGHBOR_ADVERT message from the shared ICMPv6 socket,
+    // and sets 'ifa' to the interface it was received on.
+    static ssize_t read_shared(ptr<iface>& ifa, nd_packet& nd);
+
+    // Dispatches a NB_NEIGHBOR_SOLICIT message to the proxies served by
+    // this interface. 'slla' is the source link-layer address option of
+    // the solicit, or NULL.
+    void handle_solicit(const address& saddr, const address& taddr, const struct ether_addr* slla);
+
+    // Dispatches a NB_NEIGHBOR_ADVERT message to the proxies that have
+    // rules for this interface.
+    void handle_advert(const address& saddr, const address& taddr);
+
+    // Lets the proxies that learn from their rule interfaces know that a
+    // node on this one is about to use 'taddr'.
+    void handle_dad(const address& taddr);
     
-    bool handle_local(const address& saddr, const address& taddr);
+    bool handle_local(const address& saddr, const address& taddr, const struct ether_addr* slla);
     
     bool is_local(const address& addr);
     
@@ -66,6 +152,16 @@ public:
 
     // Returns the name of the interface.
     const std::string& name() const;
+
+    // Returns the index of the interface.
+    int index() const;
+
+    // Returns the network namespace of the interface, or an empty string
+    // for the one ndppd was started in.
+    const std::string& netns_name() const;
+
+    // Returns the link-layer address of the interface.
+    const struct ether_addr& hwaddr() const;
     
     std::list<weak_ptr<proxy> >::iterator serves_begin();
     
@@ -78,6 +174,40 @@ public:
     std::list<weak_ptr<proxy> >::iterator parents_end();
     
     void add_parent(const ptr<proxy>& parent);
+
+    // Turns on the kernel's own proxy NDP for this interface, so that it
+    // answers solicits for the entries added by rtnl::neigh_proxy().
+    // The previous state is restored when it's turned off again, or
+    // once the interface is closed.
+    bool proxy_ndp(bool state);
+
+    // Feeds a measured solicit/advert round-trip time, in milliseconds,
+    // into the smoothed RTT estimate of this interface (RFC 6298).
+    void rtt_sample(int rtt);
+
+    // Returns the retransmission timeout derived from the RTT estimate,
+    // or 'initial' if no round-trip has been measured yet.
+    int rto(int initial) const;
+
+    // Limits the solicits sent out of this interface to 'rate' per
+    // second, with bursts of up to a second's worth. The lowest rate
+    // set by any proxy applies; 0 means no limit.
+    void probe_rate(int rate);
+
+    // Takes a solicit from the probe budget, returning false if there is
+    // none left. Unknown targets may only use the upper half of the
+    // budget, leaving the rest to targets that have answered before.
+    bool probe_budget(bool known);
+
+    // Sets the receive and send buffer sizes of the sockets. Buffers are
+    // only ever grown, since several proxies may share an interface.
+    void buffer_size(int rcvbuf, int sndbuf);
+
+    // Joins the solicited-node multicast groups of the rules of the
+    // proxies served by this interface, so that the NIC can filter out
+    // the rest, rather than receiving all multicast. ALLMULTI is kept if
+    // more than 'max' groups would be needed, or if 'max' is 0.
+    void multicast_groups(int max);
     
     static std::map<std::string, weak_ptr<iface> > _map;
 
@@ -88,11 +218,46 @@ private:
     // An array of objects used with ::poll.
     static std::vector<struct pollfd> _pollfds;
 
+    // The interface each of the entries above belongs to.
+    static std::vector<weak_ptr<iface> > _pollifs;
+
+    // Interfaces by index, used to demultiplex the shared socket.
+    static std::map<int, weak_ptr<iface> > _index_map;
+
+    static bool _shared_socket;
+
+    // The shared ICMPv6 socket, or -1.
+    static int _shared_fd;
+
+    // Drops reported by SO_RXQ_OVFL on the shared socket.
+    static uint64_t _shared_drops;
+
+    static uint32_t _shared_ovfl;
+
+    static int _poll_wait;
+
+    // Adds the drops reported by PACKET_STATISTICS, which resets them
+    // once read, to _stats.
+    void read_drops();
+
     // Updates the array above.
     static void fixup_pollfds();
 
     static void cleanup();
 
+    static int _busy_poll;
+
+    // Applies the busy polling options to the specified socket.
+    static void setup_busy_poll(int fd);
+
+    // Creates a raw ICMPv6 socket set up for NDP.
+    static int open_icmp6();
+
+    ssize_t parse_solicit(const uint8_t* msg, ssize_t len, nd_packet& nd);
+
+    ssize_t parse_advert(const struct in6_addr& saddr, const struct in6_addr& daddr, int hlim,
+                         const uint8_t* msg, ssize_t len, nd_packet& nd);
+
     // Weak pointer so this object can reference itself.
     weak_ptr<iface> _ptr;
 
@@ -104,25 +269,123 @@ private:
     // NB_NEIGHBOR_SOLICIT messages.
     int _pfd;
 
+    // The PF_PACKET socket used to read NB_NEIGHBOR_SOLICIT messages for
+    // all VLANs of this interface, if it's a trunk.
+    int _tfd;
+
+    // Index of this interface.
+    int _index;
+
+    // The trunk and VLAN id of this interface, if it's captured through
+    // a trunk.
+    ptr<iface> _trunk;
+
+    int _vlan;
+
+    // The VLAN interfaces of this trunk, by VLAN id.
+    std::map<int, weak_ptr<iface> > _vlans;
+
     // Previous state of ALLMULTI for the interface.
     int _prev_allmulti;
+
+    // Low 24 bits of the solicited-node groups that _pfd has joined.
+    std::set<uint32_t> _groups;
     
     // Previous state of PROMISC for the interface
     int _prev_promiscuous;
 
+    // Previous values of the proxy_ndp and proxy_delay sysctls, or empty.
+    std::string _prev_proxy_ndp, _prev_proxy_delay;
+
     // Name of this interface.
     std::string _name;
+
+    // Network namespace the sockets were opened in.
+    std::string _netns;
+
+    // Current buffer sizes, or 0 if the kernel defaults are used.
+    int _rcvbuf, _sndbuf;
+
+    // Smoothed RTT and RTT variance in milliseconds, scaled by 8 and 4
+    // respectively. _srtt is 0 until the first sample.
+    int _srtt, _rttvar;
+
+    // Solicits per second, or 0. The budget is kept in thousandths of a
+    // solicit, and refilled from the time it was last taken from.
+    int _probe_rate;
+
+    long long _probe_tokens, _probe_stamp;
+
+    struct stats {
+        uint64_t rx_solicits, rx_adverts, tx_solicits, tx_adverts;
+        uint64_t rx_errors, tx_errors;
+
+        // Solicits not sent since the probe budget was used up.
+        uint64_t tx_throttled;
+
+        // Packets dropped by the kernel before ndppd could read them, as
+        // reported by PACKET_STATISTICS and SO_RXQ_OVFL respectively.
+        uint64_t pfd_drops, ifd_drops;
+
+        // Last SO_RXQ_OVFL value, which is a running counter.
+        uint32_t ifd_ovfl;
+    } _stats;
     
     std::list<weak_ptr<proxy> > _serves;
     
     std::list<weak_ptr<proxy> > _parents;
 
     // The link-layer address of this interface.
-    struct ether_addr hwaddr;
+    struct ether_addr _hwaddr;
+
+    // CAPTURE_* flags of the messages captured by _pfd.
+    int _capture;
+
+    // The last packets received and sent.
+    recorder _rec;
+
+    enum {
+        // Ethernet, IPv6 and ICMPv6 headers, with a link-layer address
+        // option; solicits and adverts are the same size.
+        ND_FRAME_LEN = ETH_HLEN + sizeof(struct ip6_hdr) + 24 + 8
+    };
+
+    // Solicits and adverts are written to this, if enabled, unless they
+    // are unicast adverts to an unknown link-layer address.
+    txring _tx;
+
+    address _lladdr;
+
+    // Frames with all that doesn't change from one solicit or advert to
+    // another filled in, built once the link-local address is known.
+    uint8_t _ns_frame[ND_FRAME_LEN], _na_frame[ND_FRAME_LEN];
+
+    // Builds a frame from 'tmpl' in 'frame', sent to 'dlla', or to the
+    // MAC address of 'daddr' if it's multicast.
+    void build_frame(uint8_t* frame, const uint8_t* tmpl, const address& daddr,
+                     const struct ether_addr* dlla, const address& taddr, uint32_t flags);
+
+    // Queues a frame built from 'tmpl' on the transmit ring, to 'dlla' if
+    // it's set, or to multicast 'daddr'. Returns -1 if it wasn't, and the
+    // message should be sent the usual way.
+    ssize_t write_ring(const uint8_t* tmpl, const address& daddr, const address& taddr, uint32_t flags,
+                       const struct ether_addr* dlla = NULL);
+
+    // Reads or writes /proc/sys/net/ipv6/<path>. Returns false on failure.
+    bool read_sysctl(const std::string& path, std::string& value);
+
+    bool write_sysctl(const std::string& path, const std::string& value);
+
+    // Returns a socket that can be used for ioctls.
+    int ctl_fd() const;
 
     // Turns on/off ALLMULTI for this interface - returns the previous state
     // or -1 if there was an error.
     int allmulti(int state);
+
+    // Adds or drops the membership of _pfd in a multicast group, by the
+    // group's MAC address.
+    bool membership(bool add, const uint8_t* mac);
     
     // Turns on/off PROMISC for this interface - returns the previous state
     // or -1 if there was an error
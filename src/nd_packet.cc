@@ -0,0 +1,196 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netinet/ether.h>
+#include <net/ethernet.h>
+
+#include "ndppd.h"
+#include "nd_packet.h"
+
+NDPPD_NS_BEGIN
+
+// Sums 'len' bytes as 16-bit words in network byte order.
+static uint32_t sum16(uint32_t sum, const uint8_t* data, size_t len)
+{
+    for (; len > 1; data += 2, len -= 2)
+        sum += (data[0] << 8) | data[1];
+
+    if (len)
+        sum += data[0] << 8;
+
+    return sum;
+}
+
+// Whether 'daddr' is the solicited-node address of 'taddr', that is
+// ff02::1:ff00:0/104 followed by the low 24 bits of the target.
+static bool is_solicited_node(const struct in6_addr& daddr, const struct in6_addr& taddr)
+{
+    static const uint8_t prefix[13] = {
+        0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0xff
+    };
+
+    return !memcmp(daddr.s6_addr, prefix, sizeof(prefix)) &&
+           !memcmp(daddr.s6_addr + 13, taddr.s6_addr + 13, 3);
+}
+
+uint16_t nd_packet::checksum(const struct in6_addr& saddr, const struct in6_addr& daddr,
+                             const uint8_t* msg, size_t len)
+{
+    // Pseudo-header: source, destination, length and next header.
+    uint32_t sum = sum16(0, (const uint8_t* )&saddr, 16);
+    sum = sum16(sum, (const uint8_t* )&daddr, 16);
+    sum += len >> 16;
+    sum += len & 0xffff;
+    sum += IPPROTO_ICMPV6;
+    sum = sum16(sum, msg, len);
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return htons((uint16_t)~sum);
+}
+
+const struct ether_addr* nd_packet::source_lla() const
+{
+    return (opts & SLLA) ? &slla : NULL;
+}
+
+bool nd_packet::parse_frame(const uint8_t* msg, size_t len)
+{
+    if (len < ETH_HLEN + sizeof(struct ip6_hdr)) {
+        logger::debug() << "nd_packet::parse_frame() too short, len=" << (int)len;
+        return false;
+    }
+
+    const struct ip6_hdr* ip6h = (const struct ip6_hdr* )(msg + ETH_HLEN);
+
+    size_t plen = ntohs(ip6h->ip6_plen);
+
+    // Anything past the payload length is Ethernet padding. Extension
+    // headers aren't allowed through by the socket filter.
+    if (((ip6h->ip6_vfc >> 4) != 6) || (ip6h->ip6_nxt != IPPROTO_ICMPV6) ||
+        (ETH_HLEN + sizeof(struct ip6_hdr) + plen > len)) {
+        logger::debug() << "nd_packet::parse_frame() bad IPv6 header";
+        return false;
+    }
+
+    if (ip6h->ip6_hlim != 255) {
+        logger::debug() << "nd_packet::parse_frame() hop limit " << (int)ip6h->ip6_hlim;
+        return false;
+    }
+
+    const uint8_t* icmp6 = msg + ETH_HLEN + sizeof(struct ip6_hdr);
+
+    if (checksum(ip6h->ip6_src, ip6h->ip6_dst, icmp6, plen) != 0) {
+        logger::debug() << "nd_packet::parse_frame() bad checksum";
+        return false;
+    }
+
+    saddr = ip6h->ip6_src;
+    daddr = ip6h->ip6_dst;
+
+    return parse(icmp6, plen);
+}
+
+bool nd_packet::parse_icmp6(const uint8_t* msg, size_t len, const struct in6_addr& saddr,
+                            const struct in6_addr& daddr, int hlim)
+{
+    if ((hlim >= 0) && (hlim != 255)) {
+        logger::debug() << "nd_packet::parse_icmp6() hop limit " << hlim;
+        return false;
+    }
+
+    this->saddr = saddr;
+    this->daddr = daddr;
+
+    return parse(msg, len);
+}
+
+bool nd_packet::parse(const uint8_t* msg, size_t len)
+{
+    // Solicits and adverts have the same layout up to the options.
+    if (len < sizeof(struct nd_neighbor_solicit)) {
+        logger::debug() << "nd_packet::parse() too short, len=" << (int)len;
+        return false;
+    }
+
+    const struct icmp6_hdr* icmp6h = (const struct icmp6_hdr* )msg;
+
+    type = icmp6h->icmp6_type;
+
+    if (((type != ND_NEIGHBOR_SOLICIT) && (type != ND_NEIGHBOR_ADVERT)) || (icmp6h->icmp6_code != 0)) {
+        logger::debug() << "nd_packet::parse() type=" << (int)type << ", code=" << (int)icmp6h->icmp6_code;
+        return false;
+    }
+
+    uint32_t flags = (type == ND_NEIGHBOR_ADVERT) ? icmp6h->icmp6_data32[0] : 0;
+
+    memcpy(&taddr, msg + sizeof(struct icmp6_hdr), sizeof(struct in6_addr));
+
+    if (IN6_IS_ADDR_MULTICAST(&taddr)) {
+        logger::debug() << "nd_packet::parse() multicast target";
+        return false;
+    }
+
+    opts = 0;
+
+    for (size_t off = sizeof(struct nd_neighbor_solicit); off < len; ) {
+        if (off + 2 > len) {
+            logger::debug() << "nd_packet::parse() truncated option";
+            return false;
+        }
+
+        size_t olen = msg[off + 1] * 8;
+
+        if (!olen || (off + olen > len)) {
+            logger::debug() << "nd_packet::parse() bad option length";
+            return false;
+        }
+
+        if ((msg[off] == ND_OPT_SOURCE_LINKADDR) && (olen >= 2 + ETH_ALEN)) {
+            memcpy(&slla, msg + off + 2, ETH_ALEN);
+            opts |= SLLA;
+        }
+
+        off += olen;
+    }
+
+    bool daddr_known = !IN6_IS_ADDR_UNSPECIFIED(&daddr);
+
+    if (type == ND_NEIGHBOR_SOLICIT) {
+        // Duplicate address detection: must go to the solicited-node
+        // address of the target, and can't carry a source link-layer
+        // address.
+        if (IN6_IS_ADDR_UNSPECIFIED(&saddr) &&
+            ((opts & SLLA) || (daddr_known && !is_solicited_node(daddr, taddr)))) {
+            logger::debug() << "nd_packet::parse() bad DAD solicit";
+            return false;
+        }
+    } else {
+        if (daddr_known && IN6_IS_ADDR_MULTICAST(&daddr) && (flags & ND_NA_FLAG_SOLICITED)) {
+            logger::debug() << "nd_packet::parse() solicited advert to multicast";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+NDPPD_NS_END
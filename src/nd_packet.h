@@ -0,0 +1,69 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ether.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// A neighbor solicit or advert, parsed and validated in one pass over the
+// packet (RFC 4861, sections 7.1.1 and 7.1.2). Only the fields below are
+// copied out of it.
+struct nd_packet {
+    // Options that were present.
+    enum {
+        SLLA = 1
+    };
+
+    // ND_NEIGHBOR_SOLICIT or ND_NEIGHBOR_ADVERT.
+    uint8_t type;
+
+    int opts;
+
+    // The destination is :: if it isn't known.
+    struct in6_addr saddr, daddr, taddr;
+
+    struct ether_addr slla;
+
+    // Returns the source link-layer address, or NULL if the message
+    // didn't have one.
+    const struct ether_addr* source_lla() const;
+
+    // Parses an Ethernet frame, as read from a packet socket.
+    bool parse_frame(const uint8_t* msg, size_t len);
+
+    // Parses a message read from a raw ICMPv6 socket, where the kernel
+    // has already checked the checksum. 'hlim' is the hop limit it was
+    // received with, or -1 if it isn't known.
+    bool parse_icmp6(const uint8_t* msg, size_t len, const struct in6_addr& saddr,
+                     const struct in6_addr& daddr, int hlim);
+
+    // Returns the ICMPv6 checksum of 'msg', in network byte order. This
+    // is 0 for a message whose checksum is correct.
+    static uint16_t checksum(const struct in6_addr& saddr, const struct in6_addr& daddr,
+                             const uint8_t* msg, size_t len);
+
+private:
+    // Parses the ICMPv6 part, once the addresses are known.
+    bool parse(const uint8_t* msg, size_t len);
+};
+
+NDPPD_NS_END
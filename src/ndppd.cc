@@ -14,6 +14,7 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <cstdlib>
+#include <cstring>
 #include <csignal>
 
 #include <iostream>
@@ -22,7 +23,10 @@
 #include <memory>
 
 #include <getopt.h>
+#include <sched.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -30,6 +34,15 @@
 
 #include "ndppd.h"
 #include "route.h"
+#include "rtnl.h"
+#include "fib.h"
+#include "handover.h"
+#include "replica.h"
+#include "rsra.h"
+#include "netns.h"
+#include "recorder.h"
+#include "txring.h"
+#include "overload.h"
 
 using namespace ndppd;
 
@@ -64,6 +77,59 @@ static int daemonize()
     return 0;
 }
 
+static bool setup_low_latency(const ptr<conf>& cf)
+{
+    ptr<conf> x_cf;
+
+    if ((x_cf = cf->find("cpu-affinity"))) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET((int)*x_cf, &set);
+
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            logger::error() << "Failed to pin to CPU " << (int)*x_cf << ": " << logger::err();
+            return false;
+        }
+
+        logger::debug() << "pinned packet thread to CPU " << (int)*x_cf;
+    }
+
+    if ((x_cf = cf->find("realtime")) && (bool)*x_cf) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+
+        if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+            logger::error() << "Failed to switch to SCHED_FIFO: " << logger::err();
+            return false;
+        }
+    }
+
+    if ((x_cf = cf->find("lock-memory")) && (bool)*x_cf) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            logger::error() << "Failed to lock memory: " << logger::err();
+            return false;
+        }
+
+        // Memory allocated from now on is locked and faulted in, so set
+        // aside what the packet path would otherwise allocate later.
+        if ((x_cf = cf->find("reserve-sessions")))
+            session::reserve(*x_cf);
+
+        recorder::reserve();
+
+        // Pre-fault the stack so that the first packets won't take page
+        // faults in the receive path. Writes to a volatile array can't be
+        // optimized away, as a memset() of one that is never read can.
+        volatile char stack[64 * 1024];
+
+        for (size_t i = 0; i < sizeof(stack); i += 1024)
+            stack[i] = 0;
+    }
+
+    return true;
+}
+
 static ptr<conf> load_config(const std::string& path)
 {
     ptr<conf> cf, x_cf;
@@ -133,6 +199,48 @@ static ptr<conf> load_config(const std::string& path)
     return cf;
 }
 
+static void dump_topology()
+{
+    for (std::map<std::string, weak_ptr<iface> >::iterator i_it = iface::_map.begin(); i_it != iface::_map.end(); i_it++) {
+        ptr<iface> ifa = i_it->second;
+        
+        logger::debug() << "iface " << ifa->name() << " {";
+        
+        for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
+            ptr<proxy> pr = (*pit);
+            if (!pr) continue;
+            
+            logger::debug() << "  " << "proxy " << logger::format("%x", pr.get_pointer()) << " {";
+            
+             for (std::list<ptr<rule> >::iterator rit = pr->rules_begin(); rit != pr->rules_end(); rit++) {
+                ptr<rule> ru = *rit;
+                
+                logger::debug() << "    " << "rule " << logger::format("%x", ru.get_pointer()) << " {";
+                logger::debug() << "      " << "taddr " << ru->addr()<< ";";
+                if (ru->is_auto())
+                    logger::debug() << "      " << "auto;";
+                else if (!ru->daughter())
+                    logger::debug() << "      " << "static;";
+                else
+                    logger::debug() << "      " << "iface " << ru->daughter()->name() << ";";
+                logger::debug() << "    }";
+             }
+            
+            logger::debug() << "  }";
+        }
+        
+        logger::debug() << "  " << "parents {";
+        for (std::list<weak_ptr<proxy> >::iterator pit = ifa->parents_begin(); pit != ifa->parents_end(); pit++) {
+            ptr<proxy> pr = (*pit);
+            
+            logger::debug() << "    " << "parent " << logger::format("%x", pr.get_pointer()) << ";";
+        }
+        logger::debug() << "  }";
+        
+        logger::debug() << "}";
+    }
+}
+
 static bool configure(ptr<conf>& cf)
 {
     ptr<conf> x_cf;
@@ -146,6 +254,76 @@ static bool configure(ptr<conf>& cf)
         address::ttl(30000);
     else
         address::ttl(*x_cf);
+
+    if ((x_cf = cf->find("flight-recorder")))
+        recorder::size(*x_cf);
+
+    if ((x_cf = cf->find("flight-recorder-file")))
+        recorder::path((const std::string&)*x_cf);
+
+    if ((x_cf = cf->find("tx-ring")))
+        txring::frames(*x_cf);
+
+    if ((x_cf = cf->find("overload")) && (bool)*x_cf) {
+        int lag = 250, queue = 50;
+
+        if ((x_cf = cf->find("overload-lag")))
+            lag = *x_cf;
+
+        if ((x_cf = cf->find("overload-queue")))
+            queue = *x_cf;
+
+        overload::enable(lag, queue);
+
+        std::vector<ptr<conf> > allow(cf->find_all("overload-allow"));
+
+        for (std::vector<ptr<conf> >::const_iterator it = allow.begin(); it != allow.end(); it++)
+            overload::allow(address((const std::string&)**it));
+    }
+
+    std::string replicate_to, replicate_listen;
+    int replicate_port = 7480, replicate_interval = 30000;
+
+    if ((x_cf = cf->find("replicate-to")))
+        replicate_to = (const std::string&)*x_cf;
+
+    if ((x_cf = cf->find("replicate-listen")))
+        replicate_listen = (const std::string&)*x_cf;
+
+    if ((x_cf = cf->find("replicate-port")))
+        replicate_port = *x_cf;
+
+    if ((x_cf = cf->find("replicate-interval")))
+        replicate_interval = *x_cf;
+
+    std::vector<std::string> replicate_peers;
+    std::vector<ptr<conf> > peers(cf->find_all("replicate-peer"));
+
+    for (std::vector<ptr<conf> >::const_iterator it = peers.begin(); it != peers.end(); it++)
+        replicate_peers.push_back((const std::string&)**it);
+
+    if (!replica::open(replicate_to, replicate_listen, replicate_peers, replicate_port, replicate_interval))
+        return false;
+
+    int aggregate = 128, density = 100;
+
+    if ((x_cf = cf->find("autowire-aggregate")))
+        aggregate = *x_cf;
+
+    if ((x_cf = cf->find("autowire-density")))
+        density = *x_cf;
+
+    fib::aggregate(aggregate, density);
+
+    if (!(x_cf = cf->find("busy-poll")))
+        iface::busy_poll(0);
+    else
+        iface::busy_poll(*x_cf);
+
+    if (!(x_cf = cf->find("shared-socket")))
+        iface::shared_socket(false);
+    else
+        iface::shared_socket(*x_cf);
     
     std::list<ptr<rule> > myrules;
 
@@ -153,6 +331,10 @@ static bool configure(ptr<conf>& cf)
 
     std::vector<ptr<conf> > proxies(cf->find_all("proxy"));
 
+    // Proxy interfaces that join multicast groups, and the most groups
+    // each may join; set up once all the rules are known.
+    std::vector<std::pair<ptr<iface>, int> > mc_groups;
+
     for (p_it = proxies.begin(); p_it != proxies.end(); p_it++) {
         ptr<conf> pr_cf = *p_it;
 
@@ -166,7 +348,22 @@ static bool configure(ptr<conf>& cf)
         else
             promiscuous = *x_cf;
 
-        ptr<proxy> pr = proxy::open(*pr_cf, promiscuous);
+        bool trunk = false;
+        if ((x_cf = pr_cf->find("trunk")))
+            trunk = *x_cf;
+
+        std::string ns_name;
+        if ((x_cf = pr_cf->find("netns")))
+            ns_name = x_cf->as_str();
+
+        // The interfaces of the proxy, and those of its rules, are opened
+        // in its network namespace.
+        netns::scope ns(ns_name);
+
+        if (!ns)
+            return false;
+
+        ptr<proxy> pr = proxy::open(*pr_cf, promiscuous, trunk);
         if (!pr || pr.is_null() == true) {
             return false;
         }
@@ -206,6 +403,51 @@ static bool configure(ptr<conf>& cf)
         else
             pr->timeout(*x_cf);
 
+        if ((x_cf = pr_cf->find("offload")))
+            pr->offload(*x_cf);
+
+        if ((x_cf = pr_cf->find("multicast-threshold")))
+            pr->multicast_threshold(*x_cf);
+
+        if ((x_cf = pr_cf->find("adaptive-timeout")))
+            pr->adaptive_timeout(*x_cf);
+
+        if ((x_cf = pr_cf->find("timeout-min")))
+            pr->timeout_min(*x_cf);
+
+        if ((x_cf = pr_cf->find("timeout-max")))
+            pr->timeout_max(*x_cf);
+
+        if ((x_cf = pr_cf->find("deadtime-max")))
+            pr->deadtime_max(*x_cf);
+
+        int probe_rate = 0;
+
+        if ((x_cf = pr_cf->find("probe-rate")))
+            probe_rate = *x_cf;
+
+        if ((x_cf = pr_cf->find("relay-rs")))
+            pr->relay_rs(*x_cf);
+
+        if ((x_cf = pr_cf->find("relay-ra")))
+            pr->relay_ra(*x_cf);
+
+        if ((x_cf = pr_cf->find("learn")))
+            pr->learn(*x_cf);
+
+        int rcvbuf = 0, sndbuf = 0;
+
+        if ((x_cf = pr_cf->find("rcvbuf")))
+            rcvbuf = *x_cf;
+
+        if ((x_cf = pr_cf->find("sndbuf")))
+            sndbuf = *x_cf;
+
+        pr->ifa()->buffer_size(rcvbuf, sndbuf);
+
+        if ((x_cf = pr_cf->find("multicast-groups")))
+            mc_groups.push_back(std::make_pair(pr->ifa(), (int)*x_cf));
+
         std::vector<ptr<conf> >::const_iterator r_it;
 
         std::vector<ptr<conf> > rules(pr_cf->find_all("rule"));
@@ -229,71 +471,89 @@ static bool configure(ptr<conf>& cf)
                 }
                 
                 ifa->add_parent(pr);
+
+                ifa->buffer_size(rcvbuf, sndbuf);
+
+                ifa->probe_rate(probe_rate);
+
+                // Duplicate address detection is only seen by capturing
+                // the solicits on the interface.
+                if (pr->learn() && !iface::open_pfd(*x_cf, false, iface::CAPTURE_NS))
+                    return false;
                 
                 myrules.push_back(pr->add_rule(addr, ifa, autovia));
             } else if (ru_cf->find("auto")) {
+                // The routing table is only read in the initial namespace.
+                if (!ns_name.empty()) {
+                    logger::error() << "'auto' rules can't be used with 'netns' (proxy " << pr_cf->as_str() << ")";
+                    return false;
+                }
+
                 myrules.push_back(pr->add_rule(addr, true));
             } else {
                 myrules.push_back(pr->add_rule(addr, false));
             }
         }
+
+        if (!rsra::setup(pr))
+            return false;
     }
-    
-    // Print out all the topology    
-    for (std::map<std::string, weak_ptr<iface> >::iterator i_it = iface::_map.begin(); i_it != iface::_map.end(); i_it++) {
-        ptr<iface> ifa = i_it->second;
-        
-        logger::debug() << "iface " << ifa->name() << " {";
-        
-        for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
-            ptr<proxy> pr = (*pit);
-            if (!pr) continue;
-            
-            logger::debug() << "  " << "proxy " << logger::format("%x", pr.get_pointer()) << " {";
-            
-             for (std::list<ptr<rule> >::iterator rit = pr->rules_begin(); rit != pr->rules_end(); rit++) {
-                ptr<rule> ru = *rit;
-                
-                logger::debug() << "    " << "rule " << logger::format("%x", ru.get_pointer()) << " {";
-                logger::debug() << "      " << "taddr " << ru->addr()<< ";";
-                if (ru->is_auto())
-                    logger::debug() << "      " << "auto;";
-                else if (!ru->daughter())
-                    logger::debug() << "      " << "static;";
-                else
-                    logger::debug() << "      " << "iface " << ru->daughter()->name() << ";";
-                logger::debug() << "    }";
-             }
-            
-            logger::debug() << "  }";
-        }
-        
-        logger::debug() << "  " << "parents {";
-        for (std::list<weak_ptr<proxy> >::iterator pit = ifa->parents_begin(); pit != ifa->parents_end(); pit++) {
-            ptr<proxy> pr = (*pit);
-            
-            logger::debug() << "    " << "parent " << logger::format("%x", pr.get_pointer()) << ";";
-        }
-        logger::debug() << "  }";
-        
-        logger::debug() << "}";
+
+    for (std::vector<std::pair<ptr<iface>, int> >::iterator it = mc_groups.begin();
+            it != mc_groups.end(); it++) {
+        netns::scope ns(it->first->netns_name());
+
+        if (ns)
+            it->first->multicast_groups(it->second);
     }
-    
+
+    // Print out all the topology, unless it wouldn't be shown anyway;
+    // with many rules this takes a while.
+    if (logger::verbosity() >= LOG_DEBUG)
+        dump_topology();
+
     return true;
 }
 
 static bool running = true;
 
+// Milliseconds elapsed since 't', which is then reset to now.
+static int lap(struct timespec& t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int ms = (now.tv_sec - t.tv_sec) * 1000 + (now.tv_nsec - t.tv_nsec) / 1000000;
+    t = now;
+    return ms;
+}
+
+static bool dump_stats = false;
+
+static bool dump_records = false;
+
 static void exit_ndppd(int sig)
 {
     logger::error() << "Shutting down...";
     running = 0;
 }
 
+static void request_stats(int)
+{
+    dump_stats = true;
+}
+
+static void request_records(int)
+{
+    dump_records = true;
+}
+
 int main(int argc, char* argv[], char* env[])
 {
     signal(SIGINT, exit_ndppd);
     signal(SIGTERM, exit_ndppd);
+    signal(SIGUSR1, request_stats);
+    signal(SIGUSR2, request_records);
 
     std::string config_path("/etc/ndppd.conf");
     std::string pidfile;
@@ -347,10 +607,17 @@ int main(int argc, char* argv[], char* env[])
 
     // Load configuration.
 
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    int t_config, t_links, t_handover, t_configure, t_netlink;
+
     ptr<conf> cf = load_config(config_path);
     if (cf.is_null())
         return -1;
 
+    t_config = lap(ts);
+
     if (daemon) {
         logger::syslog(true);
 
@@ -358,9 +625,33 @@ int main(int argc, char* argv[], char* env[])
             return 1;
     }
 
+    // Take over the sockets of a running instance before configuring,
+    // so that the interfaces pick them up instead of opening new ones.
+    ptr<conf> x_cf;
+
+    if ((x_cf = cf->find("handover"))) {
+        handover::path(*x_cf);
+        handover::receive();
+    }
+
+    t_handover = lap(ts);
+
+    // Look up all links in one dump, rather than an ioctl or two for
+    // each interface; the cache is only used while configuring.
+    rtnl::load_links();
+
+    t_links = lap(ts);
+
     if (!configure(cf))
         return -1;
 
+    rtnl::clear_links();
+
+    if (!handover::complete())
+        return -1;
+
+    t_configure = lap(ts);
+
     if (!pidfile.empty()) {
         std::ofstream pf;
         pf.open(pidfile.c_str(), std::ios::out | std::ios::trunc);
@@ -378,6 +669,19 @@ int main(int argc, char* argv[], char* env[])
     netlink_setup();
 #endif
 
+    // This is done after the netlink thread has been set up, so that
+    // only the packet thread is pinned and/or running as SCHED_FIFO.
+    if (!setup_low_latency(cf))
+        return -1;
+
+    t_netlink = lap(ts);
+
+    logger::notice()
+        << "Started in " << (t_config + t_handover + t_links + t_configure + t_netlink)
+        << " ms (config=" << t_config << ", handover=" << t_handover
+        << ", links=" << t_links << ", configure=" << t_configure
+        << ", setup=" << t_netlink << ")";
+
     while (running) {
         if (iface::poll_all() < 0) {
             if (running) {
@@ -396,19 +700,65 @@ int main(int argc, char* argv[], char* env[])
         t1.tv_sec  = t2.tv_sec;
         t1.tv_usec = t2.tv_usec;
 
-        if (rule::any_auto())
+        overload::update(elapsed_time, iface::poll_wait());
+
+        // Reloading routes and addresses can wait while overloaded.
+        if (rule::any_auto() && !overload::active())
             route::update(elapsed_time);
         
-        if (rule::any_iface())
+        // Addresses are needed for all proxies, since adverts built as
+        // frames are sent from the link-local address.
+        if (!overload::active())
             address::update(elapsed_time);
 
         session::update_all(elapsed_time);
+
+        replica::update_all(elapsed_time);
+
+        rsra::update();
+
+        fib::sync();
+        rtnl::flush();
+        iface::flush_all();
+
+        if (handover::poll())
+            running = false;
+
+        if (dump_stats) {
+            dump_stats = false;
+            iface::dump_stats();
+            proxy::dump_stats();
+            fib::dump_stats();
+            rtnl::dump_stats();
+            replica::dump_stats();
+            rsra::dump_stats();
+            overload::dump_stats();
+        }
+
+        if (dump_records) {
+            dump_records = false;
+            recorder::dump();
+        }
     }
 
 #ifdef WITH_ND_NETLINK
     netlink_teardown();
 #endif
 
+    // Make sure the neighbour entries and routes of the sessions that
+    // are torn down below are removed as well, unless another instance
+    // has taken over.
+    proxy::close_all();
+
+    if (!handover::handed_over()) {
+        fib::sync();
+        rtnl::flush();
+    }
+
+    handover::close();
+    replica::close();
+    netns::close();
+
     logger::notice() << "Bye";
 
     return 0;
@@ -0,0 +1,132 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <string>
+#include <vector>
+#include <map>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "ndppd.h"
+#include "netns.h"
+
+NDPPD_NS_BEGIN
+
+int netns::_self_fd = -1;
+
+std::map<std::string, int> netns::_fds;
+
+std::vector<std::string> netns::_all(1, "");
+
+std::string netns::_current;
+
+netns::scope::scope(const std::string& name) :
+    _prev(netns::_current), _ok(netns::enter(name))
+{
+}
+
+netns::scope::~scope()
+{
+    if (_ok)
+        netns::enter(_prev);
+}
+
+netns::scope::operator bool() const
+{
+    return _ok;
+}
+
+bool netns::enter(const std::string& name)
+{
+    if (name == _current)
+        return true;
+
+    // Hold on to the initial namespace, so that we can return to it.
+    if (_self_fd < 0 && (_self_fd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC)) < 0) {
+        logger::error() << "Failed to open the current network namespace: " << logger::err();
+        return false;
+    }
+
+    int fd = _self_fd;
+
+    if (!name.empty()) {
+        std::map<std::string, int>::iterator it = _fds.find(name);
+
+        if (it != _fds.end()) {
+            fd = it->second;
+        } else {
+            std::string path = "/var/run/netns/" + name;
+
+            if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+                logger::error() << "Failed to open network namespace '" << name << "': " << logger::err();
+                return false;
+            }
+
+            _fds[name] = fd;
+            _all.push_back(name);
+        }
+    }
+
+    if (setns(fd, CLONE_NEWNET) < 0) {
+        logger::error() << "Failed to enter network namespace '" << name << "': " << logger::err();
+        return false;
+    }
+
+    _current = name;
+
+    return true;
+}
+
+const std::string& netns::current()
+{
+    return _current;
+}
+
+std::string netns::qualify(const std::string& name)
+{
+    return qualify(name, _current);
+}
+
+std::string netns::qualify(const std::string& name, const std::string& ns)
+{
+    // Interface names can't contain ':', so this can't be mistaken
+    // for an interface of the initial namespace.
+    return ns.empty() ? name : name + ":" + ns;
+}
+
+const std::vector<std::string>& netns::all()
+{
+    return _all;
+}
+
+void netns::close()
+{
+    enter("");
+
+    for (std::map<std::string, int>::iterator it = _fds.begin(); it != _fds.end(); it++)
+        ::close(it->second);
+
+    _fds.clear();
+    _all.resize(1);
+
+    if (_self_fd >= 0) {
+        ::close(_self_fd);
+        _self_fd = -1;
+    }
+}
+
+NDPPD_NS_END
@@ -0,0 +1,79 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Network namespaces, as named by 'ip netns' under /var/run/netns.
+//
+// Sockets belong to the namespace they were created in, so the
+// interfaces of a proxy are opened while in its namespace, after which
+// they are served by the same event loop as all others. The empty name
+// stands for the namespace ndppd was started in.
+class netns {
+public:
+    // Enters a namespace for as long as the object lives, and then
+    // returns to the one that was current before.
+    class scope {
+    public:
+        scope(const std::string& name);
+
+        ~scope();
+
+        // Returns false if the namespace could not be entered.
+        operator bool() const;
+
+    private:
+        std::string _prev;
+
+        bool _ok;
+    };
+
+    // Returns the current namespace.
+    static const std::string& current();
+
+    // Returns the key of the interface 'name' in the current namespace,
+    // which is just 'name' in the initial one.
+    static std::string qualify(const std::string& name);
+
+    // Returns the key of the interface 'name' in the namespace 'ns'.
+    static std::string qualify(const std::string& name, const std::string& ns);
+
+    // Returns all namespaces entered so far, the initial one first.
+    static const std::vector<std::string>& all();
+
+    static void close();
+
+private:
+    // The initial namespace, and the others by name.
+    static int _self_fd;
+
+    static std::map<std::string, int> _fds;
+
+    static std::vector<std::string> _all;
+
+    static std::string _current;
+
+    static bool enter(const std::string& name);
+};
+
+NDPPD_NS_END
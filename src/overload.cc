@@ -0,0 +1,149 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <algorithm>
+
+#include "ndppd.h"
+#include "overload.h"
+
+NDPPD_NS_BEGIN
+
+// Length of the window that the load is looked at over, and how many
+// calm windows in a row it takes to leave degraded mode.
+static const int WINDOW = 1000;
+static const int CALM_WINDOWS = 5;
+
+bool overload::_enabled = false;
+
+bool overload::_active = false;
+
+int overload::_lag = 0, overload::_queue = 0;
+
+std::vector<address> overload::_allow;
+
+int overload::_window = 0, overload::_max_lag = 0;
+
+int overload::_calm = 0;
+
+uint64_t overload::_drops = 0;
+
+bool overload::_primed = false;
+
+uint64_t overload::_entered = 0, overload::_refused = 0, overload::_deferred = 0;
+
+int overload::_last_lag = 0, overload::_last_queue = 0;
+
+uint64_t overload::_last_drops = 0;
+
+void overload::enable(int lag, int queue)
+{
+    _enabled = true;
+    _lag     = lag;
+    _queue   = queue;
+}
+
+void overload::allow(const address& prefix)
+{
+    _allow.push_back(prefix);
+}
+
+bool overload::active()
+{
+    return _active;
+}
+
+bool overload::admit(const address& saddr)
+{
+    if (!_active)
+        return true;
+
+    for (std::vector<address>::const_iterator it = _allow.begin(); it != _allow.end(); it++) {
+        if (*it == saddr)
+            return true;
+    }
+
+    _refused++;
+    return false;
+}
+
+bool overload::defer_renewal()
+{
+    if (!_active)
+        return false;
+
+    _deferred++;
+    return true;
+}
+
+void overload::update(int elapsed_time, int wait_time)
+{
+    if (!_enabled)
+        return;
+
+    _max_lag = std::max(_max_lag, elapsed_time - wait_time);
+
+    if ((_window += elapsed_time) < WINDOW)
+        return;
+
+    int queue;
+    uint64_t drops = iface::kernel_drops(queue);
+
+    // The first window only sets the baseline of the drops.
+    bool first = !_primed;
+    _primed = true;
+
+    _last_lag   = _max_lag;
+    _last_queue = queue;
+    _last_drops = (drops >= _drops) ? (drops - _drops) : 0;
+
+    bool overloaded = (_lag && (_last_lag > _lag)) ||
+                      (_queue && (_last_queue > _queue)) ||
+                      (!first && _last_drops);
+
+    _drops   = drops;
+    _window  = 0;
+    _max_lag = 0;
+
+    if (overloaded) {
+        _calm = 0;
+
+        if (!_active) {
+            _active = true;
+            _entered++;
+
+            logger::warning()
+                << "Overloaded (lag=" << _last_lag << " ms, queue=" << _last_queue << "%, drops="
+                << logger::format("%llu", (unsigned long long)_last_drops) << "), entering degraded mode";
+        }
+    } else if (_active && (++_calm >= CALM_WINDOWS)) {
+        _active = false;
+
+        logger::notice() << "No longer overloaded, leaving degraded mode";
+    }
+}
+
+void overload::dump_stats()
+{
+    if (!_enabled)
+        return;
+
+    logger::notice()
+        << "overload: " << (_active ? "degraded" : "normal")
+        << logger::format(", lag=%d ms queue=%d%% drops=%llu, entered=%llu, refused sessions=%llu, deferred renewals=%llu",
+                          _last_lag, _last_queue, (unsigned long long)_last_drops, (unsigned long long)_entered,
+                          (unsigned long long)_refused, (unsigned long long)_deferred);
+}
+
+NDPPD_NS_END
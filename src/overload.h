@@ -0,0 +1,88 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <vector>
+
+#include <stdint.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Detects when solicits arrive faster than the main loop can handle
+// them, and switches to a degraded mode until they no longer do.
+//
+// Once a second, the longest time the loop spent on a single iteration,
+// the fill level of the socket receive queues and the packets dropped
+// by the kernel are looked at. In degraded mode, solicits for targets
+// with a session are still answered, but new sessions are only set up
+// for allowed sources, and renewals and route reloads are put off.
+class overload {
+public:
+    // Enables detection. The loop is overloaded when an iteration takes
+    // more than 'lag' milliseconds, or a receive queue is more than
+    // 'queue' percent full, or the kernel has dropped packets.
+    static void enable(int lag, int queue);
+
+    // Allows sources within 'prefix' to set up sessions while degraded.
+    static void allow(const address& prefix);
+
+    // Returns true while in degraded mode.
+    static bool active();
+
+    // Returns true if a solicit from 'saddr' may set up a new session.
+    // Counts those that may not.
+    static bool admit(const address& saddr);
+
+    // Returns true if the work that isn't urgent, such as renewals and
+    // route reloads, should be put off. Counts renewals put off.
+    static bool defer_renewal();
+
+    // Called once per main loop iteration, with the time since the last
+    // one and how much of that was spent waiting for packets.
+    static void update(int elapsed_time, int wait_time);
+
+    static void dump_stats();
+
+private:
+    static bool _enabled, _active;
+
+    static int _lag, _queue;
+
+    static std::vector<address> _allow;
+
+    // Time into the current window, and what was seen during it.
+    static int _window, _max_lag;
+
+    // Windows in a row that were fine, while degraded.
+    static int _calm;
+
+    // Packets dropped by the kernel, as of the last window, and whether
+    // that has been read yet.
+    static uint64_t _drops;
+
+    static bool _primed;
+
+    static uint64_t _entered, _refused, _deferred;
+
+    // Last values seen, for dump_stats().
+    static int _last_lag, _last_queue;
+
+    static uint64_t _last_drops;
+};
+
+NDPPD_NS_END
@@ -13,9 +13,11 @@
 //
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "ndppd.h"
 
@@ -24,15 +26,30 @@
 #include "iface.h"
 #include "rule.h"
 #include "session.h"
+#include "netns.h"
+#include "overload.h"
 
 NDPPD_NS_BEGIN
         
 static address all_nodes = address("ff02::1");
+
+// Upper bound of the number of targets with a probing history, per proxy.
+static const size_t MAX_HISTORY = 8192;
+
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
         
 std::list<ptr<proxy> > proxy::_list;
 
 proxy::proxy() :
-    _router(true), _ttl(30000), _deadtime(3000), _timeout(500), _autowire(false), _keepalive(true), _promiscuous(false), _retries(3)
+    _static_solicits(0), _static_adverts(0), _learn(false), _learned(0), _moves(0),
+    _promiscuous(false), _router(true), _autowire(false), _retries(3), _keepalive(true), _offload(false),
+    _ttl(30000), _deadtime(3000), _timeout(500), _deadtime_max(0), _multicast_threshold(0),
+    _adaptive_timeout(false), _timeout_min(50), _timeout_max(5000), _relay_rs(false), _relay_ra(false)
 {
 }
 
@@ -80,9 +97,10 @@ ptr<proxy> proxy::create(const ptr<iface>& ifa, bool promiscuous)
     return pr;
 }
 
-ptr<proxy> proxy::open(const std::string& ifname, bool promiscuous)
+ptr<proxy> proxy::open(const std::string& ifname, bool promiscuous, bool trunk)
 {
-    ptr<iface> ifa = iface::open_pfd(ifname, promiscuous);
+    ptr<iface> ifa = trunk ? iface::open_trunk(ifname, promiscuous) :
+                             iface::open_pfd(ifname, promiscuous);
 
     if (!ifa) {
         return ptr<proxy>();
@@ -91,86 +109,152 @@ ptr<proxy> proxy::open(const std::string& ifname, bool promiscuous)
     return create(ifa, promiscuous);
 }
 
+ptr<proxy> proxy::find(const std::string& ifname)
+{
+    for (std::list<ptr<proxy> >::iterator it = _list.begin();
+            it != _list.end(); it++) {
+        if ((*it)->_ifa && (*it)->_ifa->name() == ifname && (*it)->_ifa->netns_name().empty())
+            return *it;
+    }
+
+    return ptr<proxy>();
+}
+
+void proxy::close_all()
+{
+    _list.clear();
+}
+
+void proxy::dump_stats()
+{
+    for (std::list<ptr<proxy> >::iterator it = _list.begin();
+            it != _list.end(); it++) {
+        ptr<proxy> pr = *it;
+
+        if (!pr->_ifa)
+            continue;
+
+        logger::notice()
+            << "proxy " << netns::qualify(pr->_ifa->name(), pr->_ifa->netns_name()) << ": "
+            << logger::format("sessions=%llu, static ns=%llu na=%llu, moves=%llu",
+                              (unsigned long long)pr->_sessions.size(),
+                              (unsigned long long)pr->_static_solicits,
+                              (unsigned long long)pr->_static_adverts,
+                              (unsigned long long)pr->_moves)
+            << (pr->_learn ? logger::format(", learned=%llu", (unsigned long long)pr->_learned) : "");
+    }
+}
+
+ptr<session> proxy::find_session(const address& taddr)
+{
+    return session::find(this, taddr);
+}
+
 ptr<session> proxy::find_or_create_session(const address& taddr)
 {
     // Let's check this proxy's list of sessions to see if we can
     // find one with the same target address.
 
-    for (std::list<ptr<session> >::iterator sit = _sessions.begin();
-            sit != _sessions.end(); sit++) {
-        
-        if ((*sit)->taddr() == taddr)
-            return (*sit);
-    }
-    
-    ptr<session> se;
-    
+    ptr<session> se = find_session(taddr);
+
+    if (se)
+        return se;
+
     // Since we couldn't find a session that matched, we'll try to find
-    // a matching rule instead, and then set up a new session.
-    
-    for (std::list<ptr<rule> >::iterator it = _rules.begin();
-            it != _rules.end(); it++) {
+    // a matching rule instead, and then set up a new session. Static
+    // targets don't need a session.
+
+    std::list<ptr<rule> >::const_iterator it = find_rule(taddr);
+
+    if ((it == _rules.end()) || (*it)->is_static())
+        return se;
+
+    return create_session(taddr, it);
+}
+
+std::list<ptr<rule> >::const_iterator proxy::find_rule(const address& taddr) const
+{
+    std::list<ptr<rule> >::const_iterator it;
+
+    for (it = _rules.begin(); it != _rules.end(); it++) {
+        logger::debug() << "checking " << (*it)->addr() << " against " << taddr;
+
+        if ((*it)->addr() == taddr)
+            break;
+    }
+
+    return it;
+}
+
+ptr<session> proxy::create_session(const address& taddr, std::list<ptr<rule> >::const_iterator it)
+{
+    ptr<session> se = session::create(_ptr, taddr, _autowire, _keepalive, _retries);
+
+    // The first rule decides whether the target is static; any static
+    // rule further down adds nothing to the session.
+    for (; it != _rules.end(); it++) {
         ptr<rule> ru = *it;
 
-        logger::debug() << "checking " << ru->addr() << " against " << taddr;
+        if (!(ru->addr() == taddr))
+            continue;
 
-        if (ru->addr() == taddr) {
-            if (!se) {
-                se = session::create(_ptr, taddr, _autowire, _keepalive, _retries);
-            }
-            
-            if (ru->is_auto()) {
-                ptr<route> rt = route::find(taddr);
+        if (ru->is_auto()) {
+            ptr<route> rt = route::find(taddr);
 
-                if (rt->ifname() == _ifa->name()) {
-                    logger::debug() << "skipping route since it's using interface " << rt->ifname();
-                } else {
-                    ptr<iface> ifa = rt->ifa();
+            if (rt->ifname() == _ifa->name()) {
+                logger::debug() << "skipping route since it's using interface " << rt->ifname();
+            } else {
+                ptr<iface> ifa = rt->ifa();
 
-                    if (ifa && (ifa != ru->daughter())) {
-                        se->add_iface(ifa);
-                    }
+                if (ifa && (ifa != ru->daughter())) {
+                    se->add_iface(ifa);
                 }
-            } else if (!ru->daughter()) {
-                // This rule doesn't have an interface, and thus we'll consider
-                // it "static" and immediately send the response.
+            }
+        } else if (ru->daughter()) {
+            ptr<iface> ifa = ru->daughter();
+            se->add_iface(ifa);
+ 
+            #ifdef WITH_ND_NETLINK
+            if (if_addr_find(ifa->name(), &taddr.const_addr())) {
+                logger::debug() << "Sending NA out " << ifa->name();
+                se->add_iface(_ifa);
                 se->handle_advert();
-                return se;
-                
-            } else {
-                
-                ptr<iface> ifa = ru->daughter();
-                se->add_iface(ifa);
-     
-                #ifdef WITH_ND_NETLINK
-                if (if_addr_find(ifa->name(), &taddr.const_addr())) {
-                    logger::debug() << "Sending NA out " << ifa->name();
-                    se->add_iface(_ifa);
-                    se->handle_advert();
-                }
-                #endif
             }
+            #endif
         }
     }
-    
-    if (se) {
-        _sessions.push_back(se);
-    }
-    
+
+    se->_pr_it = _sessions.insert(_sessions.end(), se);
+
     return se;
 }
 
 void proxy::handle_advert(const address& saddr, const address& taddr, const std::string& ifname, bool use_via)
 {
     // If a session exists then process the advert in the context of the session
-    for (std::list<ptr<session> >::iterator s_it = _sessions.begin();
-            s_it != _sessions.end(); s_it++)
-    {
-        const ptr<session> sess = *s_it;
+    ptr<session> se = find_session(taddr);
 
-        if ((sess->taddr() == taddr)) {
-            sess->handle_advert(saddr, ifname, use_via);
-        }
+    bool moved = se && se->moved(ifname);
+
+    // The target has moved to another interface, so the route and kernel
+    // entries of its session are stale; start over from this advert.
+    if (moved) {
+        logger::debug() << "proxy::handle_advert() taddr=" << taddr << " moved to " << ifname;
+        _moves++;
+        remove_session(se);
+        se = ptr<session>();
+    }
+
+    // Without a session, the advert is either unsolicited or late. It
+    // still tells where the target is, if we're learning from that.
+    if (!se && (_learn || moved)) {
+        if ((se = find_or_create_session(taddr)) && _learn && !moved)
+            _learned++;
+    }
+
+    if (se) {
+        recorder::annotate(se->status());
+        se->handle_advert(saddr, ifname, use_via);
     }
 }
 
@@ -187,14 +271,46 @@ void proxy::handle_stateless_advert(const address& saddr, const address& taddr,
     }
 }
 
-void proxy::handle_solicit(const address& saddr, const address& taddr, const std::string& ifname)
+void proxy::handle_solicit(const address& saddr, const address& taddr, const std::string& ifname,
+                           const struct ether_addr* slla)
 {
     logger::debug()
         << "proxy::handle_solicit()";
     
-    // Otherwise find or create a session to scan for this address
-    ptr<session> se = find_or_create_session(taddr);
-    if (!se) return;
+    ptr<session> se = find_session(taddr);
+
+    if (!se) {
+        std::list<ptr<rule> >::const_iterator it = find_rule(taddr);
+
+        if (it == _rules.end())
+            return;
+
+        // Static rules don't have an interface to probe, so we'll respond
+        // immediately and keep no state.
+        if ((*it)->is_static()) {
+            recorder::annotate(session::VALID);
+
+            _static_solicits++;
+
+            if (saddr != taddr) {
+                logger::debug() << "proxy::handle_solicit() static taddr=" << taddr;
+                _ifa->write_advert(saddr, taddr, _router, slla);
+                _static_adverts++;
+            }
+
+            return;
+        }
+
+        // Setting up sessions is what costs, so only allowed sources may
+        // while overloaded.
+        if (!overload::admit(saddr))
+            return;
+
+        // Otherwise create a session to scan for this address
+        se = create_session(taddr, it);
+    }
+
+    recorder::annotate(se->status());
     
     // Touching the session will cause an NDP advert to be transmitted to all
     // the daughters
@@ -206,12 +322,17 @@ void proxy::handle_solicit(const address& saddr, const address& taddr, const std
         switch (se->status()) {
             case session::WAITING:
             case session::INVALID:
-                se->add_pending(saddr);
+                se->add_pending(saddr, slla);
                 break;
 
             case session::VALID:
             case session::RENEWING:
-                se->send_advert(saddr);
+                // Offloaded sessions are answered by the kernel.
+                if (se->offloaded()) {
+                    logger::debug() << "proxy::handle_solicit() offloaded taddr=" << taddr;
+                    break;
+                }
+                se->send_advert(saddr, slla);
                 break;
         }
      }
@@ -244,7 +365,100 @@ std::list<ptr<rule> >::iterator proxy::rules_end()
 
 void proxy::remove_session(const ptr<session>& se)
 {
-    _sessions.remove(se);
+    if (se->_pr_it == _sessions.end())
+        return;
+
+    std::list<ptr<session> >::iterator it = se->_pr_it;
+    se->_pr_it = _sessions.end();
+    _sessions.erase(it);
+}
+
+proxy::history* proxy::find_history(const address& taddr, bool create)
+{
+    std::map<struct in6_addr, history, in6_less>::iterator it = _history.find(taddr.const_addr());
+
+    if (it != _history.end()) {
+        std::list<struct in6_addr>& lru = _history_lru[it->second.answered];
+
+        if (create)
+            lru.splice(lru.end(), lru, it->second.lru);
+
+        return &it->second;
+    }
+
+    if (!create)
+        return NULL;
+
+    if (_history.size() >= MAX_HISTORY) {
+        // Forget what has gone stale first, and then the targets that
+        // have never answered; those are typically from scans.
+        long long stale = now_ms() - 2 * (long long)std::max(std::max(_deadtime_max, _deadtime), _ttl);
+
+        std::list<struct in6_addr>* lru = &_history_lru[false];
+
+        if (lru->empty() || (!_history_lru[true].empty() &&
+                             _history.find(_history_lru[true].front())->second.updated < stale))
+            lru = &_history_lru[true];
+
+        _history.erase(lru->front());
+        lru->pop_front();
+    }
+
+    history& h = _history[taddr.const_addr()];
+    h.fails    = 0;
+    h.answered = false;
+    h.updated  = 0;
+    h.lru      = _history_lru[false].insert(_history_lru[false].end(), taddr.const_addr());
+    return &h;
+}
+
+int proxy::probe_failed(const address& taddr)
+{
+    if (_deadtime_max <= _deadtime)
+        return _deadtime;
+
+    history* h = find_history(taddr, true);
+
+    if (!h)
+        return _deadtime;
+
+    h->updated = now_ms();
+
+    long long deadtime = _deadtime;
+
+    for (int i = 0; (i < h->fails) && (deadtime < _deadtime_max); i++)
+        deadtime <<= 1;
+
+    if ((deadtime < _deadtime_max) && (h->fails < 30))
+        h->fails++;
+
+    deadtime = std::min(deadtime, (long long)_deadtime_max);
+
+    logger::debug() << "proxy::probe_failed() taddr=" << taddr << ", fails=" << h->fails << ", deadtime=" << (int)deadtime;
+
+    return (int)deadtime;
+}
+
+void proxy::probe_answered(const address& taddr)
+{
+    history* h = find_history(taddr, true);
+
+    if (!h)
+        return;
+
+    if (!h->answered)
+        _history_lru[true].splice(_history_lru[true].end(), _history_lru[false], h->lru);
+
+    h->fails    = 0;
+    h->answered = true;
+    h->updated  = now_ms();
+}
+
+bool proxy::known_target(const address& taddr) const
+{
+    std::map<struct in6_addr, history, in6_less>::const_iterator it = _history.find(taddr.const_addr());
+
+    return (it != _history.end()) && it->second.answered;
 }
 
 const ptr<iface>& proxy::ifa() const
@@ -327,5 +541,109 @@ void proxy::timeout(int val)
     _timeout = (val >= 0) ? val : 500;
 }
 
+bool proxy::offload() const
+{
+    return _offload;
+}
+
+void proxy::offload(bool val)
+{
+    if (val == _offload)
+        return;
+
+    _offload = val;
+
+    if (val) {
+        if (!_ifa->proxy_ndp(true))
+            logger::warning() << "Kernel proxy NDP could not be enabled on interface '" << _ifa->name() << "'";
+        return;
+    }
+
+    for (std::list<ptr<session> >::iterator it = _sessions.begin(); it != _sessions.end(); it++)
+        (*it)->offload(false);
+
+    _ifa->proxy_ndp(false);
+}
+
+int proxy::multicast_threshold() const
+{
+    return _multicast_threshold;
+}
+
+void proxy::multicast_threshold(int val)
+{
+    _multicast_threshold = (val >= 0) ? val : 0;
+}
+
+bool proxy::adaptive_timeout() const
+{
+    return _adaptive_timeout;
+}
+
+void proxy::adaptive_timeout(bool val)
+{
+    _adaptive_timeout = val;
+}
+
+int proxy::timeout_min() const
+{
+    return _timeout_min;
+}
+
+void proxy::timeout_min(int val)
+{
+    _timeout_min = (val >= 0) ? val : 50;
+}
+
+int proxy::timeout_max() const
+{
+    return _timeout_max;
+}
+
+void proxy::timeout_max(int val)
+{
+    _timeout_max = (val >= 0) ? val : 5000;
+}
+
+int proxy::deadtime_max() const
+{
+    return _deadtime_max;
+}
+
+void proxy::deadtime_max(int val)
+{
+    _deadtime_max = (val >= 0) ? val : 0;
+}
+
+bool proxy::relay_rs() const
+{
+    return _relay_rs;
+}
+
+void proxy::relay_rs(bool val)
+{
+    _relay_rs = val;
+}
+
+bool proxy::learn() const
+{
+    return _learn;
+}
+
+void proxy::learn(bool val)
+{
+    _learn = val;
+}
+
+bool proxy::relay_ra() const
+{
+    return _relay_ra;
+}
+
+void proxy::relay_ra(bool val)
+{
+    _relay_ra = val;
+}
+
 NDPPD_NS_END
 
@@ -18,8 +18,10 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <cstring>
 
 #include <sys/poll.h>
+#include <net/ethernet.h>
 
 #include "ndppd.h"
 
@@ -34,18 +36,42 @@ public:
     
     static ptr<proxy> find_aunt(const std::string& ifname, const address& taddr);
 
-    static ptr<proxy> open(const std::string& ifn, bool promiscuous);
+    static ptr<proxy> open(const std::string& ifn, bool promiscuous, bool trunk = false);
+
+    // Returns the proxy listening on the specified interface of the
+    // initial network namespace, if any.
+    static ptr<proxy> find(const std::string& ifname);
+
+    // Releases all proxies, and with them all sessions.
+    static void close_all();
+
+    static void dump_stats();
     
+    ptr<session> find_session(const address& taddr);
+
     ptr<session> find_or_create_session(const address& taddr);
     
     void handle_advert(const address& saddr, const address& taddr, const std::string& ifname, bool use_via);
     
     void handle_stateless_advert(const address& saddr, const address& taddr, const std::string& ifname, bool use_via);
     
-    void handle_solicit(const address& saddr, const address& taddr, const std::string& ifname);
+    void handle_solicit(const address& saddr, const address& taddr, const std::string& ifname,
+                        const struct ether_addr* slla);
 
     void remove_session(const ptr<session>& se);
 
+    // Records that probing 'taddr' went unanswered, and returns how long
+    // its session should stay invalid; this doubles with each failure in
+    // a row, up to deadtime_max().
+    int probe_failed(const address& taddr);
+
+    // Records that 'taddr' answered, clearing its failures.
+    void probe_answered(const address& taddr);
+
+    // Returns true if 'taddr' has answered recently, so that probing it
+    // is preferred when the probe budget of an interface runs low.
+    bool known_target(const address& taddr) const;
+
     ptr<rule> add_rule(const address& addr, const ptr<iface>& ifa, bool autovia);
 
     ptr<rule> add_rule(const address& addr, bool aut = false);
@@ -86,6 +112,42 @@ public:
 
     void deadtime(int val);
 
+    bool offload() const;
+
+    void offload(bool val);
+
+    int multicast_threshold() const;
+
+    void multicast_threshold(int val);
+
+    bool adaptive_timeout() const;
+
+    void adaptive_timeout(bool val);
+
+    int timeout_min() const;
+
+    void timeout_min(int val);
+
+    int timeout_max() const;
+
+    void timeout_max(int val);
+
+    int deadtime_max() const;
+
+    void deadtime_max(int val);
+
+    bool relay_rs() const;
+
+    void relay_rs(bool val);
+
+    bool relay_ra() const;
+
+    void relay_ra(bool val);
+
+    bool learn() const;
+
+    void learn(bool val);
+
 private:
     static std::list<ptr<proxy> > _list;
 
@@ -96,6 +158,56 @@ private:
     std::list<ptr<rule> > _rules;
 
     std::list<ptr<session> > _sessions;
+
+    // Returns the first rule matching 'taddr', or the end of _rules.
+    std::list<ptr<rule> >::const_iterator find_rule(const address& taddr) const;
+
+    // Sets up a session for 'taddr' from the rules matching it, starting
+    // with the first one, 'it'.
+    ptr<session> create_session(const address& taddr, std::list<ptr<rule> >::const_iterator it);
+
+    struct in6_less {
+        bool operator()(const struct in6_addr& a, const struct in6_addr& b) const
+        {
+            return memcmp(&a, &b, sizeof(struct in6_addr)) < 0;
+        }
+    };
+
+    // Outcome of recent probing cycles, by target.
+    struct history {
+        // Cycles in a row that went unanswered.
+        int fails;
+
+        // Whether the target has answered at all.
+        bool answered;
+
+        // When this was last updated, in milliseconds.
+        long long updated;
+
+        // Entry in _history_lru[answered].
+        std::list<struct in6_addr>::iterator lru;
+    };
+
+    std::map<struct in6_addr, history, in6_less> _history;
+
+    // Targets of _history, least recently updated first: those that have
+    // never answered, and those that have. They are kept apart so that
+    // scans don't push out the targets that answer.
+    std::list<struct in6_addr> _history_lru[2];
+
+    // Returns the history of 'taddr', making room for it if needed.
+    history* find_history(const address& taddr, bool create);
+
+    // Solicits matched by static rules, and the adverts sent for them.
+    uint64_t _static_solicits, _static_adverts;
+
+    // Whether sessions are set up from adverts and duplicate address
+    // detection seen on the rule interfaces, without probing.
+    bool _learn;
+
+    // Sessions set up that way, and targets found to have moved from one
+    // rule interface to another.
+    uint64_t _learned, _moves;
     
     bool _promiscuous;
 
@@ -107,8 +219,29 @@ private:
     
     bool _keepalive;
 
+    // Whether VALID sessions are installed as kernel proxy neighbours.
+    bool _offload;
+
     int _ttl, _deadtime, _timeout;
 
+    // Upper bound of the backed off deadtime. Backoff is disabled if
+    // this is not above _deadtime.
+    int _deadtime_max;
+
+    // Number of pending nodes above which a single advert is sent to
+    // all-nodes instead. 0 disables.
+    int _multicast_threshold;
+
+    // Whether retries are timed from the measured RTT of the daughter
+    // interfaces, bounded by _timeout_min and _timeout_max.
+    bool _adaptive_timeout;
+
+    int _timeout_min, _timeout_max;
+
+    // Whether router solicits from the rule interfaces are relayed to
+    // the proxy interface, and router adverts the other way around.
+    bool _relay_rs, _relay_ra;
+
     proxy();
 };
 
@@ -0,0 +1,303 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <list>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+
+#include "ndppd.h"
+#include "recorder.h"
+
+NDPPD_NS_BEGIN
+
+int recorder::_size = 0;
+
+std::string recorder::_path = "/var/run/ndppd.pcapng";
+
+std::list<recorder*> recorder::_all;
+
+recorder::slot* recorder::_last = NULL;
+
+// Link types, as used in pcapng interface descriptions.
+static const uint16_t linktype_ethernet = 1;
+
+static const uint16_t linktype_ipv6 = 229;
+
+recorder::recorder() :
+    _count(0)
+{
+    _all.push_back(this);
+}
+
+recorder::~recorder()
+{
+    _all.remove(this);
+
+    if (!_slots.empty() && _last >= &_slots[0] && _last < &_slots[0] + _slots.size())
+        _last = NULL;
+}
+
+void recorder::size(int n)
+{
+    _size = (n > 0) ? n : 0;
+}
+
+int recorder::size()
+{
+    return _size;
+}
+
+void recorder::path(const std::string& path)
+{
+    _path = path;
+}
+
+void recorder::name(const std::string& name)
+{
+    _name = name;
+}
+
+void recorder::reserve()
+{
+    for (std::list<recorder*>::iterator it = _all.begin(); it != _all.end(); it++) {
+        if ((*it)->_slots.empty())
+            (*it)->_slots.resize(_size);
+    }
+}
+
+recorder::slot* recorder::next(int dir, bool ether, size_t len)
+{
+    if (_slots.empty())
+        _slots.resize(_size);
+
+    slot* sl = &_slots[_count++ % _slots.size()];
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    sl->time   = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    sl->len    = (uint16_t)std::min(len, (size_t)0xffff);
+    sl->caplen = 0;
+    sl->dir    = dir;
+    sl->ether  = ether;
+    sl->status = -1;
+
+    if (dir == RX)
+        _last = sl;
+
+    return sl;
+}
+
+void recorder::frame(int dir, const uint8_t* msg, size_t len)
+{
+    if (!_size)
+        return;
+
+    slot* sl = next(dir, true, len);
+
+    sl->caplen = std::min(len, (size_t)SNAPLEN);
+    memcpy(sl->data, msg, sl->caplen);
+}
+
+void recorder::icmp6(int dir, const struct in6_addr& saddr, const struct in6_addr& daddr,
+                     const uint8_t* msg, size_t len)
+{
+    if (!_size)
+        return;
+
+    slot* sl = next(dir, false, sizeof(struct ip6_hdr) + len);
+
+    // The raw socket only gives us the payload; the addresses are what
+    // we know of them, which is :: for the source of what we send.
+    struct ip6_hdr ip6h;
+    memset(&ip6h, 0, sizeof(ip6h));
+    ip6h.ip6_flow = htonl(6 << 28);
+    ip6h.ip6_plen = htons(len);
+    ip6h.ip6_nxt  = IPPROTO_ICMPV6;
+    ip6h.ip6_hlim = 255;
+    ip6h.ip6_src  = saddr;
+    ip6h.ip6_dst  = daddr;
+
+    memcpy(sl->data, &ip6h, sizeof(ip6h));
+
+    size_t n = std::min(len, (size_t)SNAPLEN - sizeof(ip6h));
+    memcpy(sl->data + sizeof(ip6h), msg, n);
+
+    sl->caplen = sizeof(ip6h) + n;
+}
+
+void recorder::annotate(int status)
+{
+    if (_last)
+        _last->status = status;
+}
+
+// Appends a pcapng option, padded to 32 bits.
+static void put_option(std::vector<uint8_t>& buf, uint16_t code, const void* data, size_t len)
+{
+    uint16_t hdr[2] = { code, (uint16_t)len };
+
+    buf.insert(buf.end(), (const uint8_t* )hdr, (const uint8_t* )hdr + sizeof(hdr));
+    buf.insert(buf.end(), (const uint8_t* )data, (const uint8_t* )data + len);
+    buf.resize((buf.size() + 3) & ~3);
+}
+
+// Writes a block, with 'body' as everything between the leading and
+// trailing lengths.
+static bool put_block(FILE* f, uint32_t type, std::vector<uint8_t>& body)
+{
+    static const uint16_t end_of_options[2] = { 0, 0 };
+
+    body.insert(body.end(), (const uint8_t* )end_of_options,
+                (const uint8_t* )end_of_options + sizeof(end_of_options));
+
+    uint32_t len = body.size() + 12;
+
+    return (fwrite(&type, 4, 1, f) == 1) && (fwrite(&len, 4, 1, f) == 1) &&
+           (fwrite(&body[0], body.size(), 1, f) == 1) && (fwrite(&len, 4, 1, f) == 1);
+}
+
+static const char* status_name(int status)
+{
+    switch (status) {
+    case session::WAITING:  return "WAITING";
+    case session::RENEWING: return "RENEWING";
+    case session::VALID:    return "VALID";
+    case session::INVALID:  return "INVALID";
+    default:                return "?";
+    }
+}
+
+bool recorder::dump()
+{
+    if (!_size) {
+        logger::warning() << "Nothing to dump, since packet recording is disabled";
+        return false;
+    }
+
+    // The capture holds client traffic, and the path may be in a world
+    // writable directory, so don't follow links and keep it private.
+    int fd = open(_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    FILE* f;
+
+    if ((fd < 0) || !(f = fdopen(fd, "wb"))) {
+        logger::error() << "Failed to open '" << _path << "': " << logger::err();
+
+        if (fd >= 0)
+            ::close(fd);
+
+        return false;
+    }
+
+    bool ok = true;
+
+    std::vector<uint8_t> body;
+
+    // Section header: byte-order magic, version 1.0, unknown length.
+    uint32_t magic = 0x1a2b3c4d;
+    uint16_t version[2] = { 1, 0 };
+    int64_t section_len = -1;
+
+    body.insert(body.end(), (const uint8_t* )&magic, (const uint8_t* )&magic + 4);
+    body.insert(body.end(), (const uint8_t* )version, (const uint8_t* )version + 4);
+    body.insert(body.end(), (const uint8_t* )&section_len, (const uint8_t* )&section_len + 8);
+    put_option(body, 4, "ndppd", 5);
+
+    ok = ok && put_block(f, 0x0a0d0d0a, body);
+
+    // Two interface descriptions per interface, for the frames captured
+    // from the packet socket and the messages of the ICMPv6 socket.
+
+    std::vector<std::pair<uint64_t, std::pair<const slot*, uint32_t> > > order;
+
+    uint32_t id = 0;
+
+    for (std::list<recorder*>::iterator it = _all.begin(); it != _all.end(); it++, id += 2) {
+        const recorder* rec = *it;
+
+        for (int i = 0; i < 2; i++) {
+            uint16_t lt[2] = { i ? linktype_ipv6 : linktype_ethernet, 0 };
+            uint32_t snaplen = SNAPLEN + (i ? sizeof(struct ip6_hdr) : 0);
+
+            body.clear();
+            body.insert(body.end(), (const uint8_t* )lt, (const uint8_t* )lt + 4);
+            body.insert(body.end(), (const uint8_t* )&snaplen, (const uint8_t* )&snaplen + 4);
+            put_option(body, 2, rec->_name.c_str(), rec->_name.size());
+
+            std::string desc = i ? "ICMPv6 socket" : "packet socket";
+            put_option(body, 3, desc.c_str(), desc.size());
+
+            ok = ok && put_block(f, 1, body);
+        }
+
+        uint64_t n = std::min(rec->_count, (uint64_t)rec->_slots.size());
+
+        for (uint64_t i = rec->_count - n; i < rec->_count; i++) {
+            const slot* sl = &rec->_slots[i % rec->_slots.size()];
+            order.push_back(std::make_pair(sl->time, std::make_pair(sl, id + (sl->ether ? 0 : 1))));
+        }
+    }
+
+    std::stable_sort(order.begin(), order.end());
+
+    for (size_t i = 0; i < order.size(); i++) {
+        const slot* sl = order[i].second.first;
+
+        uint32_t hdr[5] = {
+            order[i].second.second,
+            (uint32_t)(sl->time >> 32), (uint32_t)sl->time,
+            sl->caplen, sl->len
+        };
+
+        body.clear();
+        body.insert(body.end(), (const uint8_t* )hdr, (const uint8_t* )hdr + sizeof(hdr));
+        body.insert(body.end(), sl->data, sl->data + sl->caplen);
+        body.resize((body.size() + 3) & ~3);
+
+        // Direction: 1 is inbound, 2 is outbound.
+        uint32_t flags = sl->dir;
+        put_option(body, 2, &flags, 4);
+
+        if (sl->status >= 0) {
+            std::string comment = std::string("session ") + status_name(sl->status);
+            put_option(body, 1, comment.c_str(), comment.size());
+        }
+
+        ok = ok && put_block(f, 6, body);
+    }
+
+    if (fclose(f) != 0)
+        ok = false;
+
+    if (!ok) {
+        logger::error() << "Failed to write '" << _path << "'";
+        return false;
+    }
+
+    logger::notice() << "Wrote " << (int)order.size() << " packet(s) to '" << _path << "'";
+
+    return true;
+}
+
+NDPPD_NS_END
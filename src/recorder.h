@@ -0,0 +1,120 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Keeps the last NDP packets received and sent on an interface, so that
+// they can be looked at after the fact.
+//
+// Each interface has a ring of fixed-size slots, which is filled in
+// place by the packet path; there is only the one thread, so there is
+// nothing to lock. The rings of all interfaces are written to a pcapng
+// file on request, with the state of the session each received packet
+// was matched against as a comment.
+class recorder {
+public:
+    enum {
+        RX = 1,
+        TX = 2
+    };
+
+    recorder();
+
+    ~recorder();
+
+    // Sets the number of packets kept per interface. 0, the default,
+    // disables recording. Must be set before any packets are recorded.
+    static void size(int n);
+
+    static int size();
+
+    static void path(const std::string& path);
+
+    // Sets the name that the interface is written out as.
+    void name(const std::string& name);
+
+    // Records an Ethernet frame.
+    void frame(int dir, const uint8_t* msg, size_t len);
+
+    // Records an ICMPv6 message, which is written out with an IPv6
+    // header in front of it.
+    void icmp6(int dir, const struct in6_addr& saddr, const struct in6_addr& daddr,
+               const uint8_t* msg, size_t len);
+
+    // Notes the status of the session that the last received packet was
+    // matched against.
+    static void annotate(int status);
+
+    // Writes the recorded packets of all interfaces to the pcapng file.
+    static bool dump();
+
+    // Allocates the rings of all interfaces now, rather than when their
+    // first packet is recorded.
+    static void reserve();
+
+private:
+    enum {
+        SNAPLEN = 256
+    };
+
+    struct slot {
+        // Time of capture, in microseconds since the epoch.
+        uint64_t time;
+
+        uint16_t len, caplen;
+
+        uint8_t dir;
+
+        // Whether this is an Ethernet frame, rather than an IPv6 packet.
+        bool ether;
+
+        // Session status, or -1.
+        int8_t status;
+
+        uint8_t data[SNAPLEN];
+    };
+
+    static int _size;
+
+    static std::string _path;
+
+    static std::list<recorder*> _all;
+
+    // Last received packet, for annotate().
+    static slot* _last;
+
+    std::string _name;
+
+    std::vector<slot> _slots;
+
+    // Total number of packets recorded; the next slot is this modulo
+    // the size of the ring.
+    uint64_t _count;
+
+    slot* next(int dir, bool ether, size_t len);
+};
+
+NDPPD_NS_END
@@ -0,0 +1,608 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ndppd.h"
+#include "replica.h"
+#include "rtnl.h"
+#include "route.h"
+
+NDPPD_NS_BEGIN
+
+int replica::_tx_fd = -1;
+
+int replica::_rx_fd = -1;
+
+struct sockaddr_storage replica::_to;
+
+socklen_t replica::_to_len = 0;
+
+std::vector<struct sockaddr_storage> replica::_peers;
+
+bool replica::_check_peers = false;
+
+std::vector<uint8_t> replica::_buf;
+
+std::string replica::_proxy;
+
+uint32_t replica::_seq = 0;
+
+uint32_t replica::_rx_seq = 0;
+
+int replica::_interval = 30000;
+
+int replica::_c_interval = 0;
+
+bool replica::_applying = false;
+
+uint64_t replica::_tx_records = 0, replica::_tx_datagrams = 0;
+
+uint64_t replica::_rx_records = 0, replica::_rx_datagrams = 0, replica::_rx_errors = 0, replica::_rx_lost = 0;
+
+uint64_t replica::_rx_denied = 0;
+
+// Datagram layout, all in network byte order:
+//
+//   'N' 'R' <version> <reserved:8> <seq:32>
+//
+// followed by records, each starting with an op:
+//
+//   OP_PROXY   <len:8> <name>     Proxy of the records that follow.
+//   OP_UPDATE  <taddr> <status:8> <ttl:32>
+//   OP_EXPIRE  <taddr>
+//   OP_WIRE    <taddr> <via> <len:8> <ifname>
+//   OP_UNWIRE  <taddr>
+
+static const uint8_t version = 1;
+
+enum {
+    OP_PROXY = 1,
+    OP_UPDATE,
+    OP_EXPIRE,
+    OP_WIRE,
+    OP_UNWIRE
+};
+
+static const size_t hdr_len = 8;
+
+// Keep datagrams below the usual path MTU.
+static const size_t max_datagram = 1400;
+
+// Largest possible record, including a preceding OP_PROXY.
+static const size_t max_record = (2 + IFNAMSIZ) + (1 + 16 + 16 + 1 + IFNAMSIZ);
+
+static void put8(std::vector<uint8_t>& buf, uint8_t v)
+{
+    buf.push_back(v);
+}
+
+static void put32(std::vector<uint8_t>& buf, uint32_t v)
+{
+    v = htonl(v);
+    buf.insert(buf.end(), (uint8_t* )&v, (uint8_t* )&v + 4);
+}
+
+static void put_addr(std::vector<uint8_t>& buf, const address& addr)
+{
+    const uint8_t* p = (const uint8_t* )&addr.const_addr();
+    buf.insert(buf.end(), p, p + 16);
+}
+
+static void put_str(std::vector<uint8_t>& buf, const std::string& str)
+{
+    size_t len = std::min(str.size(), (size_t)IFNAMSIZ);
+    buf.push_back(len);
+    buf.insert(buf.end(), str.begin(), str.begin() + len);
+}
+
+// Returns the rule through which pr itself would wire taddr on ifname,
+// or a null pointer if there is none.
+static ptr<rule> wire_rule(const ptr<proxy>& pr, const address& taddr, const std::string& ifname)
+{
+    for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+        ptr<rule> ru = *it;
+
+        if (!(ru->addr() == taddr))
+            continue;
+
+        if (ru->daughter()) {
+            if (ru->daughter()->name() == ifname)
+                return ru;
+        } else if (ru->is_auto()) {
+            ptr<route> rt = route::find(taddr);
+
+            if (rt && rt->ifname() == ifname)
+                return ru;
+        }
+    }
+
+    return ptr<rule>();
+}
+
+static int resolve(const std::string& str, int port, struct sockaddr_storage& ss, socklen_t& len)
+{
+    memset(&ss, 0, sizeof(ss));
+
+    if (str[0] == '/') {
+        struct sockaddr_un* sun = (struct sockaddr_un* )&ss;
+        sun->sun_family = AF_UNIX;
+        strncpy(sun->sun_path, str.c_str(), sizeof(sun->sun_path) - 1);
+        len = sizeof(struct sockaddr_un);
+        return AF_UNIX;
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags    = AI_NUMERICHOST | AI_NUMERICSERV;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    char port_str[8];
+    sprintf(port_str, "%d", port);
+
+    if (getaddrinfo(str.c_str(), port_str, &hints, &res) != 0) {
+        logger::error() << "replica: invalid address '" << str << "'";
+        return -1;
+    }
+
+    memcpy(&ss, res->ai_addr, res->ai_addrlen);
+    len = res->ai_addrlen;
+
+    int family = res->ai_family;
+    freeaddrinfo(res);
+
+    return family;
+}
+
+bool replica::open(const std::string& to, const std::string& listen,
+                   const std::vector<std::string>& peers, int port, int interval)
+{
+    _interval   = (interval > 0) ? interval : 30000;
+    _c_interval = _interval;
+
+    if (!to.empty()) {
+        int family;
+
+        if ((family = resolve(to, port, _to, _to_len)) < 0)
+            return false;
+
+        if ((_tx_fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+            logger::error() << "replica: unable to create socket: " << logger::err();
+            return false;
+        }
+
+        logger::notice() << "Replicating sessions to " << to;
+    }
+
+    if (!listen.empty()) {
+        struct sockaddr_storage ss;
+        socklen_t len;
+        int family;
+
+        if ((family = resolve(listen, port, ss, len)) < 0)
+            return false;
+
+        if ((_rx_fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+            logger::error() << "replica: unable to create socket: " << logger::err();
+            return false;
+        }
+
+        if (family == AF_UNIX)
+            unlink(listen.c_str());
+
+        // Anyone who can reach the socket can install routes and sessions,
+        // so UDP is limited to the peers, and Unix sockets to root.
+        if (family != AF_UNIX) {
+            _check_peers = true;
+
+            if (!to.empty() && (_to.ss_family != AF_UNIX))
+                _peers.push_back(_to);
+
+            for (std::vector<std::string>::const_iterator it = peers.begin(); it != peers.end(); it++) {
+                struct sockaddr_storage peer;
+                socklen_t peer_len;
+
+                if (resolve(*it, port, peer, peer_len) < 0)
+                    return false;
+
+                _peers.push_back(peer);
+            }
+
+            if (_peers.empty()) {
+                logger::error() << "replica: 'replicate-listen' needs 'replicate-to' or 'replicate-peer'";
+                return false;
+            }
+        }
+
+        // Lets a new instance bind while handing over.
+        int on = 1;
+        setsockopt(_rx_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+        if (bind(_rx_fd, (struct sockaddr* )&ss, len) < 0) {
+            logger::error() << "replica: failed to bind to '" << listen << "': " << logger::err();
+            ::close(_rx_fd);
+            _rx_fd = -1;
+            return false;
+        }
+
+        if (family == AF_UNIX)
+            chmod(listen.c_str(), 0600);
+
+        logger::notice() << "Receiving replicated sessions on " << listen;
+    }
+
+    return true;
+}
+
+void replica::close()
+{
+    if (_tx_fd >= 0) {
+        ::close(_tx_fd);
+        _tx_fd = -1;
+    }
+
+    if (_rx_fd >= 0) {
+        ::close(_rx_fd);
+        _rx_fd = -1;
+    }
+}
+
+bool replica::enabled()
+{
+    return _tx_fd >= 0 && !_applying;
+}
+
+bool replica::begin(const session& se, int op)
+{
+    if (!enabled())
+        return false;
+
+    // Sessions whose proxy is going away (such as on shutdown) are not
+    // replicated; the peer will take care of them itself.
+    if (se._pr.is_null())
+        return false;
+
+    ptr<proxy> pr = se._pr;
+
+    // Proxies are known to the peer by name, which is only unique in the
+    // initial network namespace.
+    if (!pr->ifa() || !pr->ifa()->netns_name().empty())
+        return false;
+
+    if (_buf.size() + max_record > max_datagram)
+        flush();
+
+    if (_buf.empty()) {
+        put8(_buf, 'N');
+        put8(_buf, 'R');
+        put8(_buf, version);
+        put8(_buf, 0);
+        put32(_buf, ++_seq);
+        _proxy.clear();
+    }
+
+    if (_proxy != pr->ifa()->name()) {
+        _proxy = pr->ifa()->name();
+        put8(_buf, OP_PROXY);
+        put_str(_buf, _proxy);
+    }
+
+    put8(_buf, op);
+    put_addr(_buf, se._taddr);
+
+    _tx_records++;
+
+    return true;
+}
+
+void replica::update(const session& se)
+{
+    int status = se.status();
+
+    // The peer doesn't need to know we're probing.
+    if (status == session::WAITING)
+        return;
+
+    if (status == session::RENEWING)
+        status = session::VALID;
+
+    if (!begin(se, OP_UPDATE))
+        return;
+
+    put8(_buf, status);
+    put32(_buf, (se.hot().ttl > 0) ? se.hot().ttl : 0);
+}
+
+void replica::expire(const session& se)
+{
+    begin(se, OP_EXPIRE);
+}
+
+void replica::wire(const session& se, const std::string& ifname)
+{
+    if (!begin(se, OP_WIRE))
+        return;
+
+    put_addr(_buf, se._wired_via);
+    put_str(_buf, ifname);
+}
+
+void replica::unwire(const session& se)
+{
+    begin(se, OP_UNWIRE);
+}
+
+void replica::flush()
+{
+    if (_buf.size() <= hdr_len) {
+        _buf.clear();
+        return;
+    }
+
+    if (sendto(_tx_fd, &_buf[0], _buf.size(), 0, (struct sockaddr* )&_to, _to_len) < 0) {
+        logger::debug() << "replica::flush() failed: " << logger::err();
+    } else {
+        _tx_datagrams++;
+    }
+
+    _buf.clear();
+}
+
+void replica::full_sync()
+{
+    flush();
+
+    for (size_t i = 0; i < session::_records.size(); i++) {
+        ptr<session> se = session::_records[i].se->_ptr;
+
+        update(*se);
+
+        if (se->wired() && se->_wired_index > 0) {
+            char ifname[IF_NAMESIZE];
+
+            if (if_indextoname(se->_wired_index, ifname))
+                wire(*se, ifname);
+        }
+    }
+
+    flush();
+}
+
+void replica::update_all(int elapsed_time)
+{
+    if (_rx_fd >= 0)
+        receive();
+
+    if (_tx_fd < 0)
+        return;
+
+    if ((_c_interval -= elapsed_time) <= 0) {
+        _c_interval = _interval;
+        full_sync();
+    }
+
+    flush();
+}
+
+bool replica::is_peer(const struct sockaddr_storage& ss)
+{
+    for (std::vector<struct sockaddr_storage>::const_iterator it = _peers.begin(); it != _peers.end(); it++) {
+        if (it->ss_family != ss.ss_family)
+            continue;
+
+        if (ss.ss_family == AF_INET6) {
+            if (!memcmp(&((const struct sockaddr_in6* )&*it)->sin6_addr,
+                        &((const struct sockaddr_in6* )&ss)->sin6_addr, sizeof(struct in6_addr)))
+                return true;
+        } else if (ss.ss_family == AF_INET) {
+            if (((const struct sockaddr_in* )&*it)->sin_addr.s_addr ==
+                ((const struct sockaddr_in* )&ss)->sin_addr.s_addr)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+void replica::receive()
+{
+    uint8_t buf[2048];
+
+    while (1) {
+        struct sockaddr_storage ss;
+        socklen_t ss_len = sizeof(ss);
+
+        ssize_t len = recvfrom(_rx_fd, buf, sizeof(buf), 0, (struct sockaddr* )&ss, &ss_len);
+
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                logger::error() << "replica: failed to receive: " << logger::err();
+            return;
+        }
+
+        if (_check_peers && !is_peer(ss)) {
+            _rx_denied++;
+            continue;
+        }
+
+        if ((size_t)len < hdr_len || buf[0] != 'N' || buf[1] != 'R' || buf[2] != version) {
+            _rx_errors++;
+            continue;
+        }
+
+        uint32_t seq;
+        memcpy(&seq, buf + 4, 4);
+        seq = ntohl(seq);
+
+        if (_rx_datagrams && seq > _rx_seq + 1)
+            _rx_lost += seq - _rx_seq - 1;
+
+        _rx_seq = seq;
+        _rx_datagrams++;
+
+        _applying = true;
+        apply(buf + hdr_len, len - hdr_len);
+        _applying = false;
+    }
+}
+
+void replica::apply(const uint8_t* p, size_t len)
+{
+    const uint8_t* end = p + len;
+    ptr<proxy> pr;
+
+    while (p < end) {
+        int op = *p++;
+
+        if (op == OP_PROXY) {
+            if (p >= end || p + 1 + *p > end)
+                break;
+
+            pr = proxy::find(std::string((const char* )p + 1, *p));
+            p += 1 + *p;
+            continue;
+        }
+
+        if (p + 16 > end)
+            break;
+
+        struct in6_addr addr;
+        memcpy(&addr, p, 16);
+        address taddr(addr);
+        p += 16;
+
+        _rx_records++;
+
+        ptr<session> se;
+
+        switch (op) {
+        case OP_UPDATE: {
+            if (p + 5 > end)
+                return;
+
+            int status = p[0];
+            uint32_t ttl;
+            memcpy(&ttl, p + 1, 4);
+            ttl = ntohl(ttl);
+            p += 5;
+
+            if (status < session::WAITING || status > session::INVALID) {
+                _rx_errors++;
+                return;
+            }
+
+            if (!pr || !(se = pr->find_or_create_session(taddr)))
+                break;
+
+            logger::debug() << "replica::apply() update taddr=" << taddr << ", status=" << status;
+
+            // The peer's timers can't outlast ours.
+            uint32_t max_ttl;
+
+            switch (status) {
+            case session::WAITING:
+                max_ttl = pr->timeout();
+                break;
+
+            case session::INVALID:
+                max_ttl = std::max(pr->deadtime(), pr->deadtime_max());
+                break;
+
+            default:
+                max_ttl = pr->ttl();
+            }
+
+            se->status(status);
+            se->hot().ttl    = std::min(ttl, max_ttl);
+            se->hot().fails  = 0;
+
+            if (status == session::VALID)
+                se->offload(true);
+            break;
+        }
+
+        case OP_EXPIRE:
+            if (pr && (se = pr->find_session(taddr))) {
+                logger::debug() << "replica::apply() expire taddr=" << taddr;
+                pr->remove_session(se);
+            }
+            break;
+
+        case OP_WIRE: {
+            if (p + 17 > end || p + 17 + p[16] > end)
+                return;
+
+            memcpy(&addr, p, 16);
+            address via(addr);
+            std::string ifname((const char* )p + 17, p[16]);
+            p += 17 + p[16];
+
+            // A route can point anywhere, so only wire the way this proxy
+            // would itself: through a rule that matches the target.
+            ptr<rule> ru;
+
+            if (!pr || !pr->autowire() || !(ru = wire_rule(pr, taddr, ifname))) {
+                logger::debug() << "replica::apply() refusing wire taddr=" << taddr << ", ifname=" << ifname;
+                _rx_errors++;
+                break;
+            }
+
+            // Sessions are wired before they become valid, so this may
+            // well be the first we hear of it.
+            if ((se = pr->find_or_create_session(taddr))) {
+                logger::debug() << "replica::apply() wire taddr=" << taddr << ", ifname=" << ifname;
+                se->handle_auto_wire(via, ifname, ru->autovia() && !via.is_empty());
+            }
+            break;
+        }
+
+        case OP_UNWIRE:
+            if (pr && (se = pr->find_session(taddr)) && se->wired())
+                se->handle_auto_unwire();
+            break;
+
+        default:
+            _rx_errors++;
+            return;
+        }
+    }
+}
+
+void replica::dump_stats()
+{
+    if (_tx_fd < 0 && _rx_fd < 0)
+        return;
+
+    logger::notice()
+        << "replica: "
+        << logger::format("tx records=%llu datagrams=%llu, rx records=%llu datagrams=%llu errors=%llu lost=%llu denied=%llu",
+                          (unsigned long long)_tx_records, (unsigned long long)_tx_datagrams,
+                          (unsigned long long)_rx_records, (unsigned long long)_rx_datagrams,
+                          (unsigned long long)_rx_errors, (unsigned long long)_rx_lost,
+                          (unsigned long long)_rx_denied);
+}
+
+NDPPD_NS_END
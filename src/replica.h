@@ -0,0 +1,107 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+class session;
+
+// Replicates session state to a peer, typically the other router of a
+// VRRP pair, so that it already knows the targets when it takes over.
+//
+// State changes are sent as small records in datagrams (UDP or Unix),
+// once per main loop iteration, and the whole table is sent periodically
+// in case anything was lost. Records received from the peer are applied
+// to the local sessions.
+class replica {
+public:
+    // Sets up replication. Either may be empty. A destination starting
+    // with '/' is a Unix socket path, otherwise an IP address. Records
+    // received over UDP are only accepted from 'to' and 'peers'.
+    static bool open(const std::string& to, const std::string& listen,
+                     const std::vector<std::string>& peers, int port, int interval);
+
+    static void close();
+
+    // Called whenever a session changes state.
+    static void update(const session& se);
+
+    // Called when a session goes away.
+    static void expire(const session& se);
+
+    // Called when a session is wired to, or unwired from, an interface.
+    static void wire(const session& se, const std::string& ifname);
+
+    static void unwire(const session& se);
+
+    // Sends what has been queued, applies what has been received, and
+    // does a full sync when it's time to.
+    static void update_all(int elapsed_time);
+
+    static void dump_stats();
+
+private:
+    static int _tx_fd, _rx_fd;
+
+    static struct sockaddr_storage _to;
+
+    static socklen_t _to_len;
+
+    // Hosts that records are accepted from, if receiving over UDP.
+    static std::vector<struct sockaddr_storage> _peers;
+
+    static bool _check_peers;
+
+    static std::vector<uint8_t> _buf;
+
+    // Proxy interface of the last record in _buf.
+    static std::string _proxy;
+
+    static uint32_t _seq, _rx_seq;
+
+    static int _interval, _c_interval;
+
+    // Set while applying records from the peer, so they're not sent back.
+    static bool _applying;
+
+    static uint64_t _tx_records, _tx_datagrams, _rx_records, _rx_datagrams, _rx_errors, _rx_lost, _rx_denied;
+
+    static bool enabled();
+
+    // Starts a record, returning false if it should be skipped.
+    static bool begin(const session& se, int op);
+
+    static void flush();
+
+    static void full_sync();
+
+    static void receive();
+
+    // Returns true if 'ss' is the address of a peer.
+    static bool is_peer(const struct sockaddr_storage& ss);
+
+    static void apply(const uint8_t* data, size_t len);
+};
+
+NDPPD_NS_END
@@ -0,0 +1,327 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include <time.h>
+
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netinet/ether.h>
+
+#include "ndppd.h"
+#include "rsra.h"
+
+NDPPD_NS_BEGIN
+
+std::map<std::pair<std::string, std::string>, rsra::advert> rsra::_adverts;
+
+uint64_t rsra::_rx_rs = 0, rsra::_rx_ra = 0, rsra::_tx_rs = 0, rsra::_tx_ra = 0, rsra::_dropped = 0;
+
+uint64_t rsra::_answered = 0, rsra::_deferred = 0;
+
+// MIN_DELAY_BETWEEN_RAS from RFC 4861, in milliseconds.
+static const int min_delay_between_ras = 3000;
+
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Replaces the address in the source link-layer address option, if there
+// is one, and updates the ICMPv6 checksum incrementally (RFC 1624).
+static void rewrite_slla(uint8_t* icmp6, size_t len, size_t hlen, const struct ether_addr& hwaddr)
+{
+    const uint8_t* lla = (const uint8_t* )&hwaddr;
+
+    for (size_t off = hlen; off + 8 <= len; ) {
+        size_t olen = icmp6[off + 1] * 8;
+
+        if (!olen || (off + olen > len))
+            return;
+
+        if (icmp6[off] != ND_OPT_SOURCE_LINKADDR) {
+            off += olen;
+            continue;
+        }
+
+        uint8_t* old = icmp6 + off + 2;
+
+        uint16_t cksum;
+        memcpy(&cksum, icmp6 + 2, sizeof(cksum));
+
+        uint32_t sum = (uint16_t)~ntohs(cksum);
+
+        for (int i = 0; i < ETH_ALEN; i += 2) {
+            sum += (uint16_t)~((old[i] << 8) | old[i + 1]);
+            sum += (lla[i] << 8) | lla[i + 1];
+        }
+
+        while (sum >> 16)
+            sum = (sum & 0xffff) + (sum >> 16);
+
+        cksum = htons((uint16_t)~sum);
+        memcpy(icmp6 + 2, &cksum, sizeof(cksum));
+
+        memcpy(old, lla, ETH_ALEN);
+        return;
+    }
+}
+
+bool rsra::setup(const ptr<proxy>& pr)
+{
+    if (pr->relay_ra()) {
+        // Plain interfaces already capture through _pfd; for VLANs that
+        // are captured through their trunk, this opens one.
+        if (!iface::open_pfd(pr->ifa()->name(), pr->promiscuous(), iface::CAPTURE_RA))
+            return false;
+    }
+
+    if (pr->relay_rs()) {
+        for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+            ptr<iface> ifa = (*it)->daughter();
+
+            if (!ifa || (ifa == pr->ifa()))
+                continue;
+
+            if (!iface::open_pfd(ifa->name(), false, iface::CAPTURE_RS))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void rsra::handle(const ptr<iface>& ifa, uint8_t* msg, size_t len)
+{
+    struct ether_header* eh = (struct ether_header* )msg;
+
+    struct ip6_hdr* ip6h = (struct ip6_hdr* )(msg + ETH_HLEN);
+
+    struct icmp6_hdr* icmp6h = (struct icmp6_hdr* )(msg + ETH_HLEN + sizeof(struct ip6_hdr));
+
+    bool rs = (icmp6h->icmp6_type == ND_ROUTER_SOLICIT);
+
+    size_t hlen = rs ? sizeof(struct nd_router_solicit) : sizeof(struct nd_router_advert);
+
+    size_t plen = ntohs(ip6h->ip6_plen);
+
+    // Only relay what a router or host would accept (RFC 4861), and only
+    // to multicast destinations, since the Ethernet destination is kept.
+
+    if ((plen < hlen) || (ETH_HLEN + sizeof(struct ip6_hdr) + plen > len) ||
+        (ip6h->ip6_hlim != 255) || (icmp6h->icmp6_code != 0) ||
+        IN6_IS_ADDR_MULTICAST(&ip6h->ip6_src) ||
+        !IN6_IS_ADDR_MULTICAST(&ip6h->ip6_dst) ||
+        (eh->ether_dhost[0] != 0x33) || (eh->ether_dhost[1] != 0x33)) {
+        logger::debug() << "rsra::handle() ifa=" << ifa->name() << ", ignoring invalid "
+                        << (rs ? "solicit" : "advert");
+        _dropped++;
+        return;
+    }
+
+    // Strip any Ethernet padding.
+    len = ETH_HLEN + sizeof(struct ip6_hdr) + plen;
+
+    if (logger::verbosity() >= LOG_DEBUG) {
+        logger::debug() << "rsra::handle() ifa=" << ifa->name() << ", " << (rs ? "solicit" : "advert")
+                        << " saddr=" << address(ip6h->ip6_src).to_string() << ", len=" << (int)len;
+    }
+
+    if (rs) {
+        _rx_rs++;
+
+        // Solicits go to the proxies that have rules for this interface.
+        for (std::list<weak_ptr<proxy> >::iterator pit = ifa->parents_begin(); pit != ifa->parents_end(); pit++) {
+            ptr<proxy> pr = *pit;
+
+            if (!pr || !pr->relay_rs() || (pr->ifa() == ifa))
+                continue;
+
+            if (answer(ifa, pr->ifa()))
+                continue;
+
+            if (forward(ifa, pr->ifa(), msg, len))
+                _tx_rs++;
+        }
+    } else {
+        _rx_ra++;
+
+        // Adverts go to the rule interfaces of the proxies served here,
+        // once per interface.
+        for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
+            ptr<proxy> pr = *pit;
+
+            if (!pr || !pr->relay_ra())
+                continue;
+
+            struct nd_router_advert* ra = (struct nd_router_advert* )icmp6h;
+
+            long long now = now_ms(), expires = now + ntohs(ra->nd_ra_router_lifetime) * 1000LL;
+
+            std::vector<iface*> done;
+
+            for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+                ptr<iface> out = (*it)->daughter();
+
+                if (!out || (out == ifa) ||
+                    (std::find(done.begin(), done.end(), out.get_pointer()) != done.end()))
+                    continue;
+
+                done.push_back(out.get_pointer());
+
+                if (!forward(ifa, out, msg, len))
+                    continue;
+
+                _tx_ra++;
+
+                // Keep the advert as it was sent, unless the router is
+                // going away.
+
+                std::pair<std::string, std::string> key(ifa->name(), out->name());
+
+                if (expires > now) {
+                    advert& ad = _adverts[key];
+                    ad.frame.assign(msg, msg + len);
+                    ad.ifa     = out;
+                    ad.expires = expires;
+                    ad.sent    = now;
+                    ad.owed    = false;
+                } else {
+                    _adverts.erase(key);
+                }
+            }
+        }
+    }
+}
+
+bool rsra::answer(const ptr<iface>& ifa, const ptr<iface>& up)
+{
+    std::map<std::pair<std::string, std::string>, advert>::iterator it =
+        _adverts.find(std::make_pair(up->name(), ifa->name()));
+
+    if (it == _adverts.end())
+        return false;
+
+    advert& ad = it->second;
+
+    long long now = now_ms();
+
+    if (ad.expires <= now) {
+        _adverts.erase(it);
+        return false;
+    }
+
+    // The advert goes to all nodes, so there's no need to repeat it for
+    // every host that solicits at the same time. Send it once more from
+    // update() when the interval is over.
+    if (now - ad.sent < min_delay_between_ras) {
+        logger::debug() << "rsra::answer() ifa=" << ifa->name() << ", advert sent recently, deferring";
+
+        if (!ad.owed) {
+            ad.owed = true;
+            _deferred++;
+        }
+
+        return true;
+    }
+
+    logger::debug() << "rsra::answer() ifa=" << ifa->name() << ", cached advert from " << up->name();
+
+    if (ifa->write_frame(ifa->index(), &ad.frame[0], ad.frame.size()) < 0)
+        return false;
+
+    ad.sent = now;
+    _answered++;
+    _tx_ra++;
+    return true;
+}
+
+void rsra::update()
+{
+    long long now = -1;
+
+    for (std::map<std::pair<std::string, std::string>, advert>::iterator it = _adverts.begin();
+         it != _adverts.end(); ) {
+        advert& ad = it->second;
+
+        if (!ad.owed) {
+            it++;
+            continue;
+        }
+
+        if (now < 0)
+            now = now_ms();
+
+        ptr<iface> ifa = ad.ifa;
+
+        if (!ifa || (ad.expires <= now)) {
+            _adverts.erase(it++);
+            continue;
+        }
+
+        if (now - ad.sent >= min_delay_between_ras) {
+            logger::debug() << "rsra::update() ifa=" << ifa->name() << ", deferred advert from " << it->first.first;
+
+            if (ifa->write_frame(ifa->index(), &ad.frame[0], ad.frame.size()) >= 0) {
+                _answered++;
+                _tx_ra++;
+            }
+
+            ad.sent = now;
+            ad.owed = false;
+        }
+
+        it++;
+    }
+}
+
+bool rsra::forward(const ptr<iface>& in, const ptr<iface>& out, uint8_t* msg, size_t len)
+{
+    size_t off = ETH_HLEN + sizeof(struct ip6_hdr);
+
+    struct icmp6_hdr* icmp6h = (struct icmp6_hdr* )(msg + off);
+
+    size_t hlen = (icmp6h->icmp6_type == ND_ROUTER_SOLICIT) ?
+        sizeof(struct nd_router_solicit) : sizeof(struct nd_router_advert);
+
+    rewrite_slla(msg + off, len - off, hlen, out->hwaddr());
+
+    memcpy(((struct ether_header* )msg)->ether_shost, &out->hwaddr(), ETH_ALEN);
+
+    logger::debug() << "rsra::forward() " << in->name() << " -> " << out->name();
+
+    return in->write_frame(out->index(), msg, len) >= 0;
+}
+
+void rsra::dump_stats()
+{
+    logger::notice()
+        << "rsra: rx rs=" << logger::format("%llu", (unsigned long long)_rx_rs)
+        << " ra=" << logger::format("%llu", (unsigned long long)_rx_ra)
+        << ", tx rs=" << logger::format("%llu", (unsigned long long)_tx_rs)
+        << " ra=" << logger::format("%llu", (unsigned long long)_tx_ra)
+        << ", dropped=" << logger::format("%llu", (unsigned long long)_dropped)
+        << ", answered=" << logger::format("%llu", (unsigned long long)_answered)
+        << " deferred=" << logger::format("%llu", (unsigned long long)_deferred)
+        << ", cached=" << (int)_adverts.size();
+}
+
+NDPPD_NS_END
@@ -0,0 +1,91 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+class iface;
+class proxy;
+
+// Relays router solicits from the rule interfaces of a proxy to its own
+// interface, and router adverts the other way around, so that hosts
+// behind ndppd can configure themselves from the upstream router.
+//
+// The messages are captured by the same PF_PACKET socket that captures
+// neighbor solicits, and are forwarded as link-layer frames with the
+// Ethernet source and the source link-layer address option rewritten.
+//
+// The last advert relayed to each interface is kept, as it was sent, and
+// solicits are answered with it for as long as its router lifetime lasts,
+// at most once every MIN_DELAY_BETWEEN_RAS.
+// Solicits are only relayed upstream when there is no such advert.
+class rsra {
+public:
+    // Sets up capturing for the specified proxy, as configured.
+    static bool setup(const ptr<proxy>& pr);
+
+    // Handles a router solicit or advert captured on 'ifa'. 'msg' holds
+    // the whole frame, and is rewritten as it's forwarded.
+    static void handle(const ptr<iface>& ifa, uint8_t* msg, size_t len);
+
+    // Sends the cached adverts that solicits are still owed.
+    static void update();
+
+    static void dump_stats();
+
+private:
+    struct advert {
+        std::vector<uint8_t> frame;
+
+        // The interface the advert is sent out on.
+        weak_ptr<iface> ifa;
+
+        // When the router lifetime runs out, and when the advert was
+        // last sent, in monotonic milliseconds.
+        long long expires, sent;
+
+        // Set if a solicit arrived too soon after the advert was last
+        // sent, and it should be sent again as soon as that's allowed.
+        bool owed;
+    };
+
+    // Cached adverts by upstream and downstream interface name.
+    static std::map<std::pair<std::string, std::string>, advert> _adverts;
+
+    static uint64_t _rx_rs, _rx_ra, _tx_rs, _tx_ra, _dropped;
+
+    // Solicits answered from the cache, and solicits whose answer was
+    // deferred because an advert was multicast on that interface
+    // moments ago.
+    static uint64_t _answered, _deferred;
+
+    // Answers a solicit received on 'ifa' from the adverts cached for
+    // upstream interface 'up'. Returns false if there are none.
+    static bool answer(const ptr<iface>& ifa, const ptr<iface>& up);
+
+    static bool forward(const ptr<iface>& in, const ptr<iface>& out, uint8_t* msg, size_t len);
+};
+
+NDPPD_NS_END
@@ -0,0 +1,475 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+#include <linux/if_link.h>
+
+#include "ndppd.h"
+#include "rtnl.h"
+#include "netns.h"
+
+NDPPD_NS_BEGIN
+
+std::map<std::string, int> rtnl::_fds;
+
+uint32_t rtnl::_seq = 0;
+
+std::map<rtnl::neigh_key, bool> rtnl::_neigh_ops;
+
+std::map<std::string, rtnl::link> rtnl::_links;
+
+std::map<rtnl::route_key, rtnl::route_op> rtnl::_route_ops;
+
+uint64_t rtnl::_neigh_added = 0, rtnl::_neigh_removed = 0, rtnl::_neigh_coalesced = 0;
+
+uint64_t rtnl::_route_added = 0, rtnl::_route_removed = 0, rtnl::_route_coalesced = 0;
+
+uint64_t rtnl::_batches = 0, rtnl::_errors = 0;
+
+// Largest number of bytes we'll put in a single datagram.
+static const size_t max_batch = 32768;
+
+bool rtnl::neigh_key::operator<(const neigh_key& key) const
+{
+    if (ns != key.ns)
+        return ns < key.ns;
+
+    if (ifindex != key.ifindex)
+        return ifindex < key.ifindex;
+
+    return memcmp(&addr, &key.addr, sizeof(addr)) < 0;
+}
+
+bool rtnl::route_key::operator<(const route_key& key) const
+{
+    if (ns != key.ns)
+        return ns < key.ns;
+
+    if (len != key.len)
+        return len < key.len;
+
+    return memcmp(&dst, &key.dst, sizeof(dst)) < 0;
+}
+
+int rtnl::open(const std::string& ns)
+{
+    std::map<std::string, int>::iterator it = _fds.find(ns);
+
+    if (it != _fds.end())
+        return it->second;
+
+    // A netlink socket talks to the namespace it was created in.
+    netns::scope scope(ns);
+
+    if (!scope)
+        return -1;
+
+    int fd;
+
+    if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        logger::error() << "Unable to create netlink socket: " << logger::err();
+        return -1;
+    }
+
+    struct sockaddr_nl snl;
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+
+    if (bind(fd, (struct sockaddr* )&snl, sizeof(snl)) < 0) {
+        logger::error() << "Failed to bind netlink socket: " << logger::err();
+        close(fd);
+        return -1;
+    }
+
+    _fds[ns] = fd;
+
+    return fd;
+}
+
+void rtnl::neigh_proxy(bool add, const std::string& ns, int ifindex, const address& addr)
+{
+    neigh_key key;
+    key.ns      = ns;
+    key.ifindex = ifindex;
+    key.addr    = addr.const_addr();
+
+    std::map<neigh_key, bool>::iterator it = _neigh_ops.find(key);
+
+    if (it != _neigh_ops.end()) {
+        // An add followed by a remove (or the other way around) within
+        // the same batch cancels out.
+        if (it->second != add) {
+            _neigh_ops.erase(it);
+            _neigh_coalesced++;
+        }
+        return;
+    }
+
+    _neigh_ops[key] = add;
+}
+
+void rtnl::route(bool add, const address& dst, const std::string& ns, int ifindex, const address& via)
+{
+    route_key key;
+    key.ns  = ns;
+    key.dst = dst.const_addr();
+    key.len = dst.prefix();
+
+    std::map<route_key, route_op>::iterator it = _route_ops.find(key);
+
+    if (it != _route_ops.end() && it->second.add != add)
+        _route_coalesced++;
+
+    route_op& op = _route_ops[key];
+    op.add     = add;
+    op.ifindex = ifindex;
+    op.via     = via.const_addr();
+}
+
+void rtnl::add_attr(std::vector<uint8_t>& buf, size_t offset, int type, const void* data, size_t len)
+{
+    struct rtattr rta;
+    rta.rta_type = type;
+    rta.rta_len  = RTA_LENGTH(len);
+
+    buf.insert(buf.end(), (const uint8_t* )&rta, (const uint8_t* )&rta + sizeof(rta));
+    buf.insert(buf.end(), (const uint8_t* )data, (const uint8_t* )data + len);
+    buf.resize(buf.size() + RTA_ALIGN(len) - len, 0);
+
+    ((struct nlmsghdr* )&buf[offset])->nlmsg_len = buf.size() - offset;
+}
+
+void rtnl::queue(int fd, std::vector<uint8_t>& buf, int& count, const std::vector<uint8_t>& msg)
+{
+    if (buf.size() + msg.size() > max_batch)
+        send(fd, buf, count);
+
+    buf.insert(buf.end(), msg.begin(), msg.end());
+    count++;
+}
+
+void rtnl::flush()
+{
+    if (_neigh_ops.empty() && _route_ops.empty())
+        return;
+
+    std::vector<uint8_t> buf;
+    int count = 0;
+
+    buf.reserve(max_batch);
+
+    // Requests are ordered by namespace, and each namespace gets its
+    // own batches.
+    const std::string* ns = NULL;
+    int fd = -1;
+
+    for (std::map<neigh_key, bool>::iterator it = _neigh_ops.begin();
+            it != _neigh_ops.end(); it++) {
+        if (!ns || (*ns != it->first.ns)) {
+            send(fd, buf, count);
+            ns = &it->first.ns;
+            fd = open(*ns);
+        }
+
+        if (fd < 0) {
+            _errors++;
+            continue;
+        }
+
+        struct {
+            struct nlmsghdr n;
+            struct ndmsg    ndm;
+            struct rtattr   rta;
+            struct in6_addr dst;
+        } req;
+
+        memset(&req, 0, sizeof(req));
+
+        req.n.nlmsg_len   = sizeof(req);
+        req.n.nlmsg_type  = it->second ? RTM_NEWNEIGH : RTM_DELNEIGH;
+        req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+        req.n.nlmsg_seq   = ++_seq;
+
+        if (it->second)
+            req.n.nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+
+        req.ndm.ndm_family  = AF_INET6;
+        req.ndm.ndm_ifindex = it->first.ifindex;
+        req.ndm.ndm_flags   = NTF_PROXY;
+        req.ndm.ndm_state   = NUD_PERMANENT;
+
+        req.rta.rta_type = NDA_DST;
+        req.rta.rta_len  = RTA_LENGTH(sizeof(struct in6_addr));
+        req.dst          = it->first.addr;
+
+        queue(fd, buf, count, std::vector<uint8_t>((uint8_t* )&req, (uint8_t* )&req + sizeof(req)));
+
+        if (it->second)
+            _neigh_added++;
+        else
+            _neigh_removed++;
+    }
+
+    send(fd, buf, count);
+
+    _neigh_ops.clear();
+
+    // Adds go out first, longest prefix first, and deletes after them.
+    // When an aggregate is split into host routes, or host routes are
+    // folded into one, the targets then always have a route.
+    typedef std::pair<const route_key, route_op> route_entry;
+
+    std::vector<const route_entry*> order;
+    order.reserve(_route_ops.size());
+
+    for (std::map<route_key, route_op>::reverse_iterator it = _route_ops.rbegin();
+            it != _route_ops.rend(); it++) {
+        if (it->second.add)
+            order.push_back(&*it);
+    }
+
+    for (std::map<route_key, route_op>::iterator it = _route_ops.begin();
+            it != _route_ops.end(); it++) {
+        if (!it->second.add)
+            order.push_back(&*it);
+    }
+
+    ns = NULL;
+
+    for (std::vector<const route_entry*>::iterator it = order.begin();
+            it != order.end(); it++) {
+        const route_op& op = (*it)->second;
+
+        if (!ns || (*ns != (*it)->first.ns)) {
+            send(fd, buf, count);
+            ns = &(*it)->first.ns;
+            fd = open(*ns);
+        }
+
+        if (fd < 0) {
+            _errors++;
+            continue;
+        }
+
+        struct {
+            struct nlmsghdr n;
+            struct rtmsg    rtm;
+        } req;
+
+        memset(&req, 0, sizeof(req));
+
+        req.n.nlmsg_len   = sizeof(req);
+        req.n.nlmsg_type  = op.add ? RTM_NEWROUTE : RTM_DELROUTE;
+        req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+        req.n.nlmsg_seq   = ++_seq;
+
+        if (op.add)
+            req.n.nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+
+        // Same as what 'ip -6 route replace' would use.
+        req.rtm.rtm_family   = AF_INET6;
+        req.rtm.rtm_dst_len  = (*it)->first.len;
+        req.rtm.rtm_table    = RT_TABLE_MAIN;
+        req.rtm.rtm_protocol = RTPROT_BOOT;
+        req.rtm.rtm_scope    = op.add ? RT_SCOPE_UNIVERSE : RT_SCOPE_NOWHERE;
+        req.rtm.rtm_type     = RTN_UNICAST;
+
+        std::vector<uint8_t> msg((uint8_t* )&req, (uint8_t* )&req + sizeof(req));
+
+        add_attr(msg, 0, RTA_DST, &(*it)->first.dst, sizeof(struct in6_addr));
+        add_attr(msg, 0, RTA_OIF, &op.ifindex, sizeof(int));
+
+        if (!IN6_IS_ADDR_UNSPECIFIED(&op.via))
+            add_attr(msg, 0, RTA_GATEWAY, &op.via, sizeof(struct in6_addr));
+
+        queue(fd, buf, count, msg);
+
+        if (op.add)
+            _route_added++;
+        else
+            _route_removed++;
+    }
+
+    send(fd, buf, count);
+
+    _route_ops.clear();
+}
+
+void rtnl::send(int fd, std::vector<uint8_t>& buf, int& count)
+{
+    if (buf.empty())
+        return;
+
+    logger::debug() << "rtnl::send() count=" << count << ", len=" << (int)buf.size();
+
+    if (::send(fd, &buf[0], buf.size(), 0) < 0) {
+        logger::error() << "Failed to send netlink request: " << logger::err();
+        _errors += count;
+        buf.clear();
+        count = 0;
+        return;
+    }
+
+    _batches++;
+    buf.clear();
+
+    // The kernel processes the requests synchronously, so the acks are
+    // already queued by the time send() returns.
+
+    uint8_t rbuf[8192];
+
+    while (count > 0) {
+        ssize_t len = recv(fd, rbuf, sizeof(rbuf), MSG_DONTWAIT);
+
+        if (len < 0) {
+            if ((errno != EAGAIN) && (errno != EINTR))
+                logger::error() << "Failed to read netlink ack: " << logger::err();
+            break;
+        }
+
+        for (struct nlmsghdr* n = (struct nlmsghdr* )rbuf; NLMSG_OK(n, len); n = NLMSG_NEXT(n, len)) {
+            if (n->nlmsg_type != NLMSG_ERROR)
+                continue;
+
+            count--;
+
+            struct nlmsgerr* err = (struct nlmsgerr* )NLMSG_DATA(n);
+
+            // Removing an entry that is already gone is fine.
+            if (err->error && (err->error != -ENOENT) && (err->error != -ESRCH)) {
+                _errors++;
+                logger::debug() << "rtnl::send() request failed: " << strerror(-err->error);
+            }
+        }
+    }
+
+    count = 0;
+}
+
+bool rtnl::load_links()
+{
+    int fd;
+
+    if ((fd = open("")) < 0)
+        return false;
+
+    struct {
+        struct nlmsghdr  n;
+        struct ifinfomsg ifi;
+    } req;
+
+    memset(&req, 0, sizeof(req));
+
+    req.n.nlmsg_len    = sizeof(req);
+    req.n.nlmsg_type   = RTM_GETLINK;
+    req.n.nlmsg_flags  = NLM_F_REQUEST | NLM_F_DUMP;
+    req.n.nlmsg_seq    = ++_seq;
+    req.ifi.ifi_family = AF_UNSPEC;
+
+    if (::send(fd, &req, sizeof(req), 0) < 0) {
+        logger::error() << "Failed to request links: " << logger::err();
+        return false;
+    }
+
+    std::vector<uint8_t> rbuf(65536);
+
+    while (1) {
+        ssize_t len = recv(fd, &rbuf[0], rbuf.size(), 0);
+
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+
+            logger::error() << "Failed to read links: " << logger::err();
+            return false;
+        }
+
+        for (struct nlmsghdr* n = (struct nlmsghdr* )&rbuf[0]; NLMSG_OK(n, len); n = NLMSG_NEXT(n, len)) {
+            if (n->nlmsg_seq != _seq)
+                continue;
+
+            if (n->nlmsg_type == NLMSG_DONE) {
+                logger::debug() << "rtnl::load_links() links=" << (int)_links.size();
+                return true;
+            }
+
+            if (n->nlmsg_type == NLMSG_ERROR) {
+                logger::error() << "Failed to dump links";
+                return false;
+            }
+
+            if (n->nlmsg_type != RTM_NEWLINK)
+                continue;
+
+            struct ifinfomsg* ifi = (struct ifinfomsg* )NLMSG_DATA(n);
+            int alen = IFLA_PAYLOAD(n);
+
+            std::string name;
+            link ln;
+            memset(&ln, 0, sizeof(ln));
+            ln.index = ifi->ifi_index;
+            ln.flags = ifi->ifi_flags;
+
+            for (struct rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+                if (rta->rta_type == IFLA_IFNAME) {
+                    name = (const char* )RTA_DATA(rta);
+                } else if (rta->rta_type == IFLA_ADDRESS && RTA_PAYLOAD(rta) >= sizeof(struct ether_addr)) {
+                    memcpy(&ln.hwaddr, RTA_DATA(rta), sizeof(struct ether_addr));
+                }
+            }
+
+            if (!name.empty())
+                _links[name] = ln;
+        }
+    }
+}
+
+const rtnl::link* rtnl::find_link(const std::string& name)
+{
+    std::map<std::string, link>::iterator it = _links.find(name);
+    return (it != _links.end()) ? &it->second : 0;
+}
+
+void rtnl::clear_links()
+{
+    _links.clear();
+}
+
+void rtnl::dump_stats()
+{
+    logger::notice()
+        << "rtnl: "
+        << logger::format("proxy neighbours added=%llu removed=%llu coalesced=%llu, batches=%llu errors=%llu",
+                          (unsigned long long)_neigh_added, (unsigned long long)_neigh_removed,
+                          (unsigned long long)_neigh_coalesced, (unsigned long long)_batches,
+                          (unsigned long long)_errors);
+
+    logger::notice()
+        << "rtnl: "
+        << logger::format("routes added=%llu removed=%llu coalesced=%llu",
+                          (unsigned long long)_route_added, (unsigned long long)_route_removed,
+                          (unsigned long long)_route_coalesced);
+}
+
+NDPPD_NS_END
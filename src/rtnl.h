@@ -0,0 +1,119 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <stdint.h>
+#include <netinet/ether.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Minimal rtnetlink client. Requests are queued, and sent to the kernel
+// in batches by flush(), which is called once per main loop iteration.
+// Interfaces are given by index within the network namespace 'ns', which
+// gets a netlink socket of its own.
+class rtnl {
+public:
+    // Queues the addition or removal of a proxy neighbour entry
+    // (NTF_PROXY) for 'addr' on the specified interface. If an entry is
+    // queued twice before flush(), only the last request is sent.
+    static void neigh_proxy(bool add, const std::string& ns, int ifindex, const address& addr);
+
+    // Queues the addition or removal of a route to 'dst' (using its
+    // prefix length) out of the specified interface, optionally via a
+    // gateway. Only the last request for a given destination is sent.
+    static void route(bool add, const address& dst, const std::string& ns, int ifindex, const address& via);
+
+    // Sends all queued requests.
+    static void flush();
+
+    static void dump_stats();
+
+    struct link {
+        int index;
+        unsigned int flags;
+        struct ether_addr hwaddr;
+    };
+
+    // Reads all links from the kernel in one go, so that interfaces can
+    // be looked up without an ioctl each. Used while starting up.
+    static bool load_links();
+
+    // Returns the cached link with the specified name, or NULL.
+    static const link* find_link(const std::string& name);
+
+    static void clear_links();
+
+private:
+    struct neigh_key {
+        std::string ns;
+        int ifindex;
+        struct in6_addr addr;
+
+        bool operator<(const neigh_key& key) const;
+    };
+
+    struct route_key {
+        std::string ns;
+        struct in6_addr dst;
+        int len;
+
+        bool operator<(const route_key& key) const;
+    };
+
+    struct route_op {
+        bool add;
+        int ifindex;
+        struct in6_addr via;
+    };
+
+    // Netlink sockets, by namespace.
+    static std::map<std::string, int> _fds;
+
+    static std::map<std::string, link> _links;
+
+    static uint32_t _seq;
+
+    // Pending proxy neighbour requests, true meaning "add".
+    static std::map<neigh_key, bool> _neigh_ops;
+
+    // Pending route requests.
+    static std::map<route_key, route_op> _route_ops;
+
+    static uint64_t _neigh_added, _neigh_removed, _neigh_coalesced;
+
+    static uint64_t _route_added, _route_removed, _route_coalesced;
+
+    static uint64_t _batches, _errors;
+
+    // Returns the socket of namespace 'ns', opening it if needed, or -1.
+    static int open(const std::string& ns);
+
+    // Appends an attribute to the message at 'offset' in 'buf'.
+    static void add_attr(std::vector<uint8_t>& buf, size_t offset, int type, const void* data, size_t len);
+
+    static void queue(int fd, std::vector<uint8_t>& buf, int& count, const std::vector<uint8_t>& msg);
+
+    // Sends the messages in 'buf' in one go, and reads back the acks.
+    static void send(int fd, std::vector<uint8_t>& buf, int& count);
+};
+
+NDPPD_NS_END
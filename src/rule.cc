@@ -46,18 +46,15 @@ ptr<rule> rule::create(const ptr<proxy>& pr, const address& addr, const ptr<ifac
     ru->_addr = addr;
     ru->_aut  = false;
     _any_iface = true;
-    unsigned int ifindex;
 
-    ifindex = if_nametoindex(pr->ifa()->name().c_str());
 #ifdef WITH_ND_NETLINK
-    if_add_to_list(ifindex, pr->ifa());
-#endif
-    ifindex = if_nametoindex(ifa->name().c_str());
-#ifdef WITH_ND_NETLINK
-    if_add_to_list(ifindex, ifa);
+    if_add_to_list(pr->ifa()->index(), pr->ifa());
+    if_add_to_list(ifa->index(), ifa);
 #endif
 
-    logger::debug() << "rule::create() if=" << pr->ifa()->name() << ", slave=" << ifa->name() << ", addr=" << addr;
+    if (logger::verbosity() >= LOG_DEBUG) {
+        logger::debug() << "rule::create() if=" << pr->ifa()->name() << ", slave=" << ifa->name() << ", addr=" << addr;
+    }
 
     return ru;
 }
@@ -96,6 +93,11 @@ bool rule::is_auto() const
     return _aut;
 }
 
+bool rule::is_static() const
+{
+    return !_aut && !_daughter;
+}
+
 bool rule::autovia() const
 {
     return _autovia;
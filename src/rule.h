@@ -41,6 +41,9 @@ public:
 
     bool is_auto() const;
 
+    // Returns true for a rule with neither an interface nor 'auto'.
+    bool is_static() const;
+
     bool check(const address& addr) const;
 
     static bool any_auto();
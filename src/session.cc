@@ -14,88 +14,116 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <algorithm>
-#include <sstream>
+#include <cstring>
+#include <net/if.h>
+#include <time.h>
 
 #include "ndppd.h"
 #include "proxy.h"
 #include "iface.h"
 #include "session.h"
+#include "rtnl.h"
+#include "fib.h"
+#include "replica.h"
+#include "overload.h"
+#include "netns.h"
 
 NDPPD_NS_BEGIN
 
-std::list<weak_ptr<session> > session::_sessions;
+std::vector<session::record> session::_records;
+
+std::vector<int> session::_slots;
 
 static address all_nodes = address("ff02::1");
 
+// How long a renewal is put off for while overloaded, in milliseconds.
+static const int DEFER_TIME = 1000;
+
 void session::update_all(int elapsed_time)
 {
-    for (std::list<weak_ptr<session> >::iterator it = _sessions.begin();
-            it != _sessions.end(); ) {
-        if (!*it) {
-            _sessions.erase(it++);
-            continue;
-        }
-
-        ptr<session> se = *it++;
-
-        if ((se->_ttl -= elapsed_time) >= 0) {
+    for (size_t i = 0; i < _records.size(); ) {
+        if ((_records[i].ttl -= elapsed_time) >= 0) {
+            i++;
             continue;
         }
 
-        switch (se->_status) {
-            
-        case session::WAITING:
-            if (se->_fails < se->_retries) {
-                logger::debug() << "session will keep trying [taddr=" << se->_taddr << "]";
-                
-                se->_ttl     = se->_pr->timeout();
-                se->_fails++;
-                
-                // Send another solicit
-                se->send_solicit();
-            } else {
-                
-                logger::debug() << "session is now invalid [taddr=" << se->_taddr << "]";
-                
-                se->_status = session::INVALID;
-                se->_ttl    = se->_pr->deadtime();
-            }
-            break;
-            
-        case session::RENEWING:
-            logger::debug() << "session is became invalid [taddr=" << se->_taddr << "]";
-            
-            if (se->_fails < se->_retries) {
-                se->_ttl     = se->_pr->timeout();
-                se->_fails++;
-                
-                // Send another solicit
-                se->send_solicit();
-            } else {            
+        session* p = _records[i].se;
+
+        {
+            ptr<session> se = p->_ptr;
+            record& rec = se->hot();
+
+            switch (rec.status) {
+
+            case session::WAITING:
+                if (rec.fails < rec.retries) {
+                    logger::debug() << "session will keep trying [taddr=" << se->_taddr << "]";
+
+                    rec.fails++;
+                    rec.ttl = se->probe_timeout();
+
+                    // Send another solicit
+                    se->send_solicit();
+                } else {
+
+                    logger::debug() << "session is now invalid [taddr=" << se->_taddr << "]";
+
+                    rec.status = session::INVALID;
+
+                    // The kernel mustn't go on answering for it.
+                    se->offload(false);
+                    rec.ttl    = se->_pr->probe_failed(se->_taddr);
+
+                    replica::update(*se);
+                }
+                break;
+
+            case session::RENEWING:
+                logger::debug() << "session is became invalid [taddr=" << se->_taddr << "]";
+
+                if (rec.fails < rec.retries) {
+                    rec.fails++;
+                    rec.ttl = se->probe_timeout();
+
+                    // Send another solicit
+                    se->send_solicit();
+                } else {
+                    se->_pr->remove_session(se);
+                }
+                break;
+
+            case session::VALID:
+                if ((se->touched() == true || se->keepalive() == true) &&
+                    overload::defer_renewal())
+                {
+                    // Keep answering from what we know, and try again
+                    // in a while.
+                    rec.ttl = DEFER_TIME;
+                }
+                else if (se->touched() == true ||
+                    se->keepalive() == true)
+                {
+                    logger::debug() << "session is renewing [taddr=" << se->_taddr << "]";
+                    rec.status = session::RENEWING;
+                    rec.fails  = 0;
+                    rec.ttl    = se->probe_timeout();
+                    se->flag(TOUCHED, false);
+
+                    // Send another solicit to make sure the route is still valid
+                    se->send_solicit();
+                } else {
+                    se->_pr->remove_session(se);
+                }
+                break;
+
+            default:
                 se->_pr->remove_session(se);
             }
-            break;
-            
-        case session::VALID:            
-            if (se->touched() == true ||
-                se->keepalive() == true)
-            {
-                logger::debug() << "session is renewing [taddr=" << se->_taddr << "]";
-                se->_status  = session::RENEWING;
-                se->_ttl     = se->_pr->timeout();
-                se->_fails   = 0;
-                se->_touched = false;
-
-                // Send another solicit to make sure the route is still valid
-                se->send_solicit();
-            } else {
-                se->_pr->remove_session(se);
-            }            
-            break;
-
-        default:
-            se->_pr->remove_session(se);
         }
+
+        // If the session went away, the last record has taken its place.
+        if ((i < _records.size()) && (_records[i].se == p))
+            i++;
     }
 }
 
@@ -103,12 +131,17 @@ session::~session()
 {
     logger::debug() << "session::~session() this=" << logger::format("%x", this);
     
-    if (_wired == true) {
-        for (std::list<ptr<iface> >::iterator it = _ifaces.begin();
-            it != _ifaces.end(); it++) {
-            handle_auto_unwire((*it)->name());
-        }
+    if (flag(WIRED) == true) {
+        handle_auto_unwire();
+    }
+
+    if (_offload_index > 0) {
+        rtnl::neigh_proxy(false, _netns, _offload_index, _taddr);
     }
+
+    replica::expire(*this);
+
+    remove_record(_index);
 }
 
 ptr<session> session::create(const ptr<proxy>& pr, const address& taddr, bool auto_wire, bool keepalive, int retries)
@@ -118,14 +151,28 @@ ptr<session> session::create(const ptr<proxy>& pr, const address& taddr, bool au
     se->_ptr       = se;
     se->_pr        = pr;
     se->_taddr     = taddr;
-    se->_autowire  = auto_wire;
-    se->_keepalive = keepalive;
-    se->_retries   = retries;
-    se->_wired     = false;
-    se->_ttl       = pr->ttl();
-    se->_touched   = false;
-
-    _sessions.push_back(se);
+    se->_wired_index = 0;
+    se->_offload_index = 0;
+    se->_found_index   = 0;
+    se->_found_time    = 0;
+    se->_probe_time    = 0;
+
+    if (pr->ifa())
+        se->_netns = pr->ifa()->netns_name();
+
+    record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.taddr   = taddr.const_addr();
+    rec.pr      = pr.get_pointer();
+    rec.se      = se.get_pointer();
+    rec.ttl     = pr->ttl();
+    rec.status  = WAITING;
+    rec.retries = std::min(std::max(retries, 0), 255);
+    rec.flags   = (auto_wire ? AUTOWIRE : 0) | (keepalive ? KEEPALIVE : 0);
+
+    se->_index = _records.size();
+    _records.push_back(rec);
+    index_insert(se->_index);
 
     logger::debug()
         << "session::create() pr=" << logger::format("%x", (proxy* )pr) << ", proxy=" << ((pr->ifa()) ? pr->ifa()->name() : "null")
@@ -134,6 +181,155 @@ ptr<session> session::create(const ptr<proxy>& pr, const address& taddr, bool au
     return se;
 }
 
+ptr<session> session::find(const proxy* pr, const address& taddr)
+{
+    int n = find_slot(taddr.const_addr(), pr);
+
+    if (n < 0)
+        return ptr<session>();
+
+    return _records[_slots[n]].se->_ptr;
+}
+
+int session::find_slot(const struct in6_addr& taddr, const proxy* pr)
+{
+    if (_slots.empty())
+        return -1;
+
+    size_t mask = _slots.size() - 1;
+
+    for (size_t n = address_set::hash(taddr) & mask; _slots[n] >= 0; n = (n + 1) & mask) {
+        const record& rec = _records[_slots[n]];
+
+        if ((rec.pr == pr) && !memcmp(&rec.taddr, &taddr, sizeof(struct in6_addr)))
+            return n;
+    }
+
+    return -1;
+}
+
+int session::slot_of(int idx)
+{
+    size_t mask = _slots.size() - 1;
+
+    size_t n = address_set::hash(_records[idx].taddr) & mask;
+
+    while (_slots[n] != idx)
+        n = (n + 1) & mask;
+
+    return n;
+}
+
+void session::index_insert(int idx)
+{
+    // Keep the load factor at or below 1/2. Rehashing picks up 'idx' as
+    // well, since it's already in _records.
+    if (_records.size() * 2 > _slots.size()) {
+        index_rehash(std::max((size_t)64, _slots.size() * 2));
+        return;
+    }
+
+    size_t mask = _slots.size() - 1;
+
+    size_t n = address_set::hash(_records[idx].taddr) & mask;
+
+    while (_slots[n] >= 0)
+        n = (n + 1) & mask;
+
+    _slots[n] = idx;
+}
+
+void session::index_erase(int idx)
+{
+    size_t mask = _slots.size() - 1;
+
+    size_t i = slot_of(idx);
+
+    // Shift back the entries that follow, so that no lookup stops short
+    // at the slot that was emptied.
+    for (size_t j = (i + 1) & mask; _slots[j] >= 0; j = (j + 1) & mask) {
+        size_t k = address_set::hash(_records[_slots[j]].taddr) & mask;
+
+        if ((i <= j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j))) {
+            _slots[i] = _slots[j];
+            i = j;
+        }
+    }
+
+    _slots[i] = -1;
+}
+
+void session::reserve(int count)
+{
+    if (count <= 0)
+        return;
+
+    _records.reserve(count);
+
+    // The same load factor as index_insert() keeps.
+    size_t slots = 64;
+
+    while (slots < (size_t)count * 2)
+        slots <<= 1;
+
+    if (slots > _slots.size())
+        index_rehash(slots);
+}
+
+void session::index_rehash(size_t count)
+{
+    _slots.assign(count, -1);
+
+    size_t mask = count - 1;
+
+    for (size_t idx = 0; idx < _records.size(); idx++) {
+        size_t n = address_set::hash(_records[idx].taddr) & mask;
+
+        while (_slots[n] >= 0)
+            n = (n + 1) & mask;
+
+        _slots[n] = idx;
+    }
+}
+
+void session::remove_record(int idx)
+{
+    index_erase(idx);
+
+    int last = _records.size() - 1;
+
+    if (idx != last) {
+        _slots[slot_of(last)] = idx;
+        _records[idx] = _records[last];
+        _records[idx].se->_index = idx;
+    }
+
+    _records.pop_back();
+}
+
+session::record& session::hot()
+{
+    return _records[_index];
+}
+
+const session::record& session::hot() const
+{
+    return _records[_index];
+}
+
+bool session::flag(int f) const
+{
+    return (hot().flags & f) != 0;
+}
+
+void session::flag(int f, bool val)
+{
+    if (val)
+        hot().flags |= f;
+    else
+        hot().flags &= ~f;
+}
+
 void session::add_iface(const ptr<iface>& ifa)
 {
     if (std::find(_ifaces.begin(), _ifaces.end(), ifa) != _ifaces.end())
@@ -142,35 +338,86 @@ void session::add_iface(const ptr<iface>& ifa)
     _ifaces.push_back(ifa);
 }
 
-void session::add_pending(const address& addr)
+void session::add_pending(const address& addr, const struct ether_addr* lla)
+{
+    if (!_pending.insert(addr))
+        return;
+
+    struct ether_addr none;
+    memset(&none, 0, sizeof(none));
+
+    _pending_lla.push_back(lla ? *lla : none);
+}
+
+static long long now_ms()
 {
-    for (std::list<ptr<address> >::iterator ad = _pending.begin(); ad != _pending.end(); ad++) {
-        if (addr == (*ad))
-            return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int session::probe_timeout() const
+{
+    if (!_pr->adaptive_timeout())
+        return _pr->timeout();
+
+    // Wait for the slowest of the daughters, and back off exponentially
+    // on each retry.
+    int rto = 0;
+
+    for (std::list<ptr<iface> >::const_iterator it = _ifaces.begin();
+            it != _ifaces.end(); it++) {
+        rto = std::max(rto, (*it)->rto(_pr->timeout()));
     }
 
-    _pending.push_back(new address(addr));
+    if (!rto)
+        rto = _pr->timeout();
+
+    rto = std::max(rto, _pr->timeout_min());
+
+    for (int i = 0; i < hot().fails && rto < _pr->timeout_max(); i++)
+        rto <<= 1;
+
+    return std::min(rto, _pr->timeout_max());
 }
 
 void session::send_solicit()
 {
     logger::debug() << "session::send_solicit() (_ifaces.size() = " << _ifaces.size() << ")";
 
+    // Targets being renewed, or that have answered before, go first
+    // when the probe budget runs low.
+    bool known = (status() == RENEWING) || _pr->known_target(_taddr);
+
+    bool sent = false;
+
     for (std::list<ptr<iface> >::iterator it = _ifaces.begin();
             it != _ifaces.end(); it++) {
+        if (!(*it)->probe_budget(known)) {
+            logger::debug() << " - " << (*it)->name() << " (throttled)";
+            continue;
+        }
+
         logger::debug() << " - " << (*it)->name();
-        (*it)->write_solicit(_taddr);
+
+        if ((*it)->write_solicit(_taddr) >= 0)
+            sent = true;
     }
+
+    // An advert that comes in when nothing was sent doesn't answer this
+    // probe, so it mustn't be taken as a round-trip sample.
+    if (!hot().fails)
+        _probe_time = sent ? now_ms() : 0;
 }
 
 void session::touch()
 {
-    if (_touched == false)
+    if (flag(TOUCHED) == false)
     {
-        _touched = true;
+        flag(TOUCHED, true);
         
         if (status() == session::WAITING || status() == session::INVALID) {
-            _ttl = _pr->timeout();
+            hot().ttl = probe_timeout();
             
             logger::debug() << "session is now probing [taddr=" << _taddr << "]";
             
@@ -179,114 +426,105 @@ void session::touch()
     }
 }
 
-void session::send_advert(const address& daddr)
+void session::send_advert(const address& daddr, const struct ether_addr* dlla)
 {
-    _pr->ifa()->write_advert(daddr, _taddr, _pr->router());
+    _pr->ifa()->write_advert(daddr, _taddr, _pr->router(), dlla);
 }
 
 void session::handle_auto_wire(const address& saddr, const std::string& ifname, bool use_via)
 {
-    if (_wired == true && (_wired_via.is_empty() || _wired_via == saddr))
+    if (flag(WIRED) == true && (_wired_via.is_empty() || _wired_via == saddr))
         return;
     
     logger::debug()
         << "session::handle_auto_wire() taddr=" << _taddr << ", ifname=" << ifname;
+
+    int ifindex;
+
+    {
+        // The index of an interface depends on its namespace.
+        netns::scope ns(_netns);
+        ifindex = ns ? if_nametoindex(ifname.c_str()) : 0;
+    }
+
+    if (!ifindex) {
+        logger::error() << "Failed to get index of interface '" << ifname << "'";
+        return;
+    }
+
+    // The gateway has changed.
+    if (flag(WIRED) == true)
+        handle_auto_unwire();
     
     if (use_via == true &&
         _taddr != saddr &&
         saddr.is_unicast() == true &&
         saddr.is_multicast() == false)
     {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "replace";
-        route_cmd << " " << std::string(saddr);
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
-
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-        
-        system(route_cmd.str().c_str());
+        fib::wire(saddr, _netns, ifindex, address());
         
         _wired_via = saddr;
     }
     else
         _wired_via.reset();
     
-    {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "replace";
-        route_cmd << " " << std::string(_taddr);
-        if (_wired_via.is_empty() == false) {
-            route_cmd << " " << "via";
-            route_cmd << " " << std::string(_wired_via);
-        }
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
-
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-
-        system(route_cmd.str().c_str());
-    }
+    fib::wire(_taddr, _netns, ifindex, _wired_via);
     
-    _wired = true;
+    flag(WIRED, true);
+    _wired_index = ifindex;
+
+    replica::wire(*this, ifname);
 }
 
-void session::handle_auto_unwire(const std::string& ifname)
+void session::handle_auto_unwire()
 {
     logger::debug()
-        << "session::handle_auto_unwire() taddr=" << _taddr << ", ifname=" << ifname;
+        << "session::handle_auto_unwire() taddr=" << _taddr;
     
-    {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "flush";
-        route_cmd << " " << std::string(_taddr);
-        if (_wired_via.is_empty() == false) {
-            route_cmd << " " << "via";
-            route_cmd << " " << std::string(_wired_via);
-        }
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
-
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-
-        system(route_cmd.str().c_str());
-    }
+    fib::unwire(_taddr, _netns, _wired_index, _wired_via);
     
-    if (_wired_via.is_empty() == false) {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "flush";
-        route_cmd << " " << std::string(_wired_via);
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
-
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-
-        system(route_cmd.str().c_str());
-    }
+    if (_wired_via.is_empty() == false)
+        fib::unwire(_wired_via, _netns, _wired_index, address());
+
+    replica::unwire(*this);
     
-    _wired = false;
+    flag(WIRED, false);
     _wired_via.reset();
 }
 
 void session::handle_advert(const address& saddr, const std::string& ifname, bool use_via)
 {
-    if (_autowire == true && _status == WAITING) {
+    // Karn's algorithm: only measure probes that were not retransmitted,
+    // since otherwise we can't tell which solicit was answered.
+    if (_probe_time && !hot().fails) {
+        for (std::list<ptr<iface> >::iterator it = _ifaces.begin();
+                it != _ifaces.end(); it++) {
+            if ((*it)->name() == ifname) {
+                (*it)->rtt_sample((int)(now_ms() - _probe_time));
+                break;
+            }
+        }
+    }
+
+    _probe_time = 0;
+
+    for (std::list<ptr<iface> >::iterator it = _ifaces.begin();
+            it != _ifaces.end(); it++) {
+        if ((*it)->name() == ifname) {
+            // Answers on other interfaces don't take the session over;
+            // see moved().
+            if (!_found_index)
+                _found_index = (*it)->index();
+
+            if (_found_index == (*it)->index())
+                _found_time = now_ms();
+            break;
+        }
+    }
+
+    _pr->probe_answered(_taddr);
+
+    if (flag(AUTOWIRE) == true && hot().status == WAITING) {
         handle_auto_wire(saddr, ifname, use_via);
     }
     
@@ -299,26 +537,45 @@ void session::handle_advert()
     logger::debug()
         << "session::handle_advert() taddr=" << _taddr << ", ttl=" << _pr->ttl();
     
-    if (_status != VALID) {
-        _status = VALID;
+    if (hot().status != VALID) {
+        hot().status = VALID;
         
         logger::debug() << "session is active [taddr=" << _taddr << "]";
     }
+
+    // Let the kernel answer further solicits for this target.
+    offload(true);
     
-    _ttl    = _pr->ttl();
-    _fails  = 0;
+    hot().ttl   = _pr->ttl();
+    hot().fails = 0;
     
     if (!_pending.empty()) {
-        for (std::list<ptr<address> >::iterator ad = _pending.begin();
-                ad != _pending.end(); ad++) {
-            ptr<address> addr = (*ad);
-            logger::debug() << " - forward to " << addr;
+        int threshold = _pr->multicast_threshold();
+
+        // With many nodes waiting, a single unsolicited advert to
+        // all-nodes is cheaper than one unicast advert per node.
+        if (threshold > 0 && _pending.size() > threshold) {
+            logger::debug() << " - forward to " << all_nodes
+                            << " (" << _pending.size() << " pending)";
 
-            send_advert(addr);
+            send_advert(all_nodes);
+        } else {
+            static const struct ether_addr none = { { 0 } };
+
+            for (int i = 0; i < _pending.size(); i++) {
+                address addr(_pending[i]);
+                logger::debug() << " - forward to " << addr;
+
+                const struct ether_addr* lla = &_pending_lla[i];
+                send_advert(addr, memcmp(lla, &none, sizeof(none)) ? lla : NULL);
+            }
         }
 
         _pending.clear();
+        _pending_lla.clear();
     }
+
+    replica::update(*this);
 }
 
 const address& session::taddr() const
@@ -328,42 +585,83 @@ const address& session::taddr() const
 
 bool session::autowire() const
 {
-    return _autowire;
+    return flag(AUTOWIRE);
 }
 
 bool session::keepalive() const
 {
-    return _keepalive;
+    return flag(KEEPALIVE);
 }
 
 int session::retries() const
 {
-    return _retries;
+    return hot().retries;
 }
 
 int session::fails() const
 {
-    return _fails;
+    return hot().fails;
 }
 
 bool session::wired() const
 {
-    return _wired;
+    return flag(WIRED);
 }
 
 bool session::touched() const
 {
-    return _touched;
+    return flag(TOUCHED);
+}
+
+bool session::offloaded() const
+{
+    return _offload_index > 0;
+}
+
+void session::offload(bool val)
+{
+    if (val && !_offload_index && _pr->offload()) {
+        _offload_index = _pr->ifa()->index();
+        rtnl::neigh_proxy(true, _netns, _offload_index, _taddr);
+    } else if (!val && _offload_index) {
+        rtnl::neigh_proxy(false, _netns, _offload_index, _taddr);
+        _offload_index = 0;
+    }
 }
 
 int session::status() const
 {
-    return _status;
+    return hot().status;
 }
 
 void session::status(int val)
 {
-    _status = val;
+    hot().status = val;
+
+    if ((val != VALID) && (val != RENEWING))
+        offload(false);
+}
+
+bool session::moved(const std::string& ifname) const
+{
+    // A new session hasn't been found anywhere yet.
+    if (!_found_index || (hot().status == WAITING))
+        return false;
+
+    // A target may answer on more than one interface, such as a host
+    // bridged to two of them. Renewals probe all of them at least a ttl
+    // after the last advert, so one that hasn't answered for that long
+    // has missed one.
+    if ((now_ms() - _found_time) < _pr->ttl())
+        return false;
+
+    for (std::list<ptr<iface> >::const_iterator it = _ifaces.begin();
+            it != _ifaces.end(); it++) {
+        if ((*it)->name() == ifname)
+            return (*it)->index() != _found_index;
+    }
+
+    return false;
 }
 
 NDPPD_NS_END
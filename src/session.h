@@ -16,8 +16,12 @@
 #pragma once
 
 #include <vector>
+#include <list>
 #include <string>
 
+#include <stdint.h>
+#include <net/ethernet.h>
+
 #include "ndppd.h"
 
 NDPPD_NS_BEGIN
@@ -26,40 +30,111 @@ class proxy;
 class iface;
 
 class session {
+    friend class handover;
+    friend class replica;
+    friend class proxy;
+
 private:
+    // The state looked at by the timers and lookups, kept in one dense
+    // array so that scanning all sessions touches one record each. The
+    // rest of the session is only reached when something happens to it.
+    struct record {
+        struct in6_addr taddr;
+
+        // Owner, as sessions of different proxies may share a target.
+        proxy* pr;
+
+        session* se;
+
+        // The remaining time in miliseconds the session will stay in
+        // its current state.
+        int ttl;
+
+        uint8_t status, fails, retries, flags;
+    };
+
+    enum {
+        TOUCHED   = 1,
+        KEEPALIVE = 2,
+        AUTOWIRE  = 4,
+        WIRED     = 8
+    };
+
+    static std::vector<record> _records;
+
+    // Open-addressed hash table of record indexes by target address,
+    // with -1 marking an empty slot.
+    static std::vector<int> _slots;
+
+    // Returns the slot of the record for 'taddr' and 'pr', or -1.
+    static int find_slot(const struct in6_addr& taddr, const proxy* pr);
+
+    // Returns the slot that holds record 'idx'.
+    static int slot_of(int idx);
+
+    static void index_insert(int idx);
+
+    static void index_erase(int idx);
+
+    static void index_rehash(size_t count);
+
+    // Removes record 'idx', moving the last record into its place.
+    static void remove_record(int idx);
+
+    // Index of this session's record.
+    int _index;
+
+    record& hot();
+
+    const record& hot() const;
+
+    bool flag(int f) const;
+
+    void flag(int f, bool val);
+
     weak_ptr<session> _ptr;
 
     weak_ptr<proxy> _pr;
 
-    address _saddr, _daddr, _taddr;
-    
-    bool _autowire;
-    
-    bool _keepalive;
-    
-    bool _wired;
+    // The proxy's list entry of this session.
+    std::list<ptr<session> >::iterator _pr_it;
+
+    // Also kept in the record; this copy is what taddr() returns.
+    address _taddr;
     
     address _wired_via;
-    
-    bool _touched;
+
+    // Network namespace of the proxy, which the interface indexes below
+    // belong to. Kept here, since the proxy may be gone by the time the
+    // routes and entries are removed.
+    std::string _netns;
+
+    // Index of the interface the route was installed on.
+    int _wired_index;
+
+    // Index of the interface a kernel proxy neighbour entry has been
+    // installed on for this session, or 0.
+    int _offload_index;
+
+    // Index of the interface the target was first found on, or 0, and
+    // when it last answered there, in milliseconds.
+    int _found_index;
+
+    long long _found_time;
 
     // An array of interfaces this session is monitoring for
     // ND_NEIGHBOR_ADVERT on.
     std::list<ptr<iface> > _ifaces;
     
-    std::list<ptr<address> > _pending;
+    // Nodes waiting for an advert once the target has been found, and
+    // their link-layer addresses by the same index; all zero if unknown.
+    address_set _pending;
 
-    // The remaining time in miliseconds the object will stay in the
-    // interface's session array or cache.
-    int _ttl;
-    
-    int _fails;
-    
-    int _retries;
-
-    int _status;
+    std::vector<struct ether_addr> _pending_lla;
 
-    static std::list<weak_ptr<session> > _sessions;
+    // When the first solicit of the current probe was sent (monotonic,
+    // in milliseconds), or 0 if no probe is outstanding.
+    long long _probe_time;
 
 public:
     enum
@@ -72,20 +147,25 @@ public:
 
     static void update_all(int elapsed_time);
 
+    // Makes room for 'count' sessions up front, so that the session table
+    // doesn't have to grow while packets are handled.
+    static void reserve(int count);
+
     // Destructor.
     ~session();
 
     static ptr<session> create(const ptr<proxy>& pr, const address& taddr, bool autowire, bool keepalive, int retries);
 
+    // Returns the session of the specified proxy for 'taddr', if any.
+    static ptr<session> find(const proxy* pr, const address& taddr);
+
     void add_iface(const ptr<iface>& ifa);
     
-    void add_pending(const address& addr);
+    // Adds a node waiting for an advert, and its link-layer address if
+    // it's known.
+    void add_pending(const address& addr, const struct ether_addr* lla);
 
     const address& taddr() const;
-
-    const address& daddr() const;
-
-    const address& saddr() const;
     
     bool autowire() const;
     
@@ -99,9 +179,24 @@ public:
     
     bool touched() const;
 
+    bool offloaded() const;
+
+    // Installs or removes the kernel proxy neighbour entry of this
+    // session. It's only installed if the proxy offloads.
+    void offload(bool val);
+
+    // Returns how long to wait for an advert after the solicit that was
+    // just sent, taking previous failures into account.
+    int probe_timeout() const;
+
     int status() const;
 
     void status(int val);
+
+    // Returns true if the target was found on another interface than
+    // 'ifname' before, and hasn't answered there for a whole ttl, so
+    // that what has been set up for it is stale.
+    bool moved(const std::string& ifname) const;
     
     void handle_advert();
 
@@ -109,11 +204,11 @@ public:
     
     void handle_auto_wire(const address& saddr, const std::string& ifname, bool use_via);
     
-    void handle_auto_unwire(const std::string& ifname);
+    void handle_auto_unwire();
     
     void touch();
 
-    void send_advert(const address& daddr);
+    void send_advert(const address& daddr, const struct ether_addr* dlla = NULL);
 
     void send_solicit();
 
@@ -0,0 +1,170 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+
+#include "ndppd.h"
+#include "txring.h"
+
+NDPPD_NS_BEGIN
+
+int txring::_frames = 0;
+
+txring::txring() :
+    _fd(-1), _ring(NULL), _nr(0), _head(0), _queued(0)
+{
+}
+
+txring::~txring()
+{
+    if (_ring)
+        munmap(_ring, (size_t)_nr * FRAME_SIZE);
+
+    if (_fd >= 0)
+        close(_fd);
+}
+
+void txring::frames(int n)
+{
+    // Whole blocks only.
+    int per_block = BLOCK_SIZE / FRAME_SIZE;
+    _frames = (n > 0) ? (n + per_block - 1) / per_block * per_block : 0;
+}
+
+int txring::frames()
+{
+    return _frames;
+}
+
+bool txring::open(int index, const std::string& name)
+{
+    if (!_frames || (_fd >= 0))
+        return true;
+
+    // Protocol 0, so that nothing is received on it.
+    int fd = socket(PF_PACKET, SOCK_RAW, 0);
+
+    if (fd < 0) {
+        logger::error() << "Unable to create transmit socket for interface '" << name << "': " << logger::err();
+        return false;
+    }
+
+    // Malformed frames are skipped, rather than holding up the ring.
+    int version = TPACKET_V2, loss = 1;
+
+    struct tpacket_req req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = BLOCK_SIZE;
+    req.tp_frame_size = FRAME_SIZE;
+    req.tp_frame_nr   = _frames;
+    req.tp_block_nr   = _frames / (BLOCK_SIZE / FRAME_SIZE);
+
+    if ((setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) ||
+        (setsockopt(fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) < 0) ||
+        (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)) {
+        logger::error() << "Failed to set up transmit ring for interface '" << name << "': " << logger::err();
+        ::close(fd);
+        return false;
+    }
+
+    void* ring = mmap(NULL, (size_t)_frames * FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (ring == MAP_FAILED) {
+        logger::error() << "Failed to map transmit ring for interface '" << name << "': " << logger::err();
+        ::close(fd);
+        return false;
+    }
+
+    struct sockaddr_ll lladdr;
+    memset(&lladdr, 0, sizeof(lladdr));
+    lladdr.sll_family  = AF_PACKET;
+    lladdr.sll_ifindex = index;
+
+    if (bind(fd, (struct sockaddr* )&lladdr, sizeof(lladdr)) < 0) {
+        logger::error() << "Failed to bind transmit ring to interface '" << name << "': " << logger::err();
+        munmap(ring, (size_t)_frames * FRAME_SIZE);
+        ::close(fd);
+        return false;
+    }
+
+    _fd   = fd;
+    _ring = (uint8_t* )ring;
+    _nr   = _frames;
+    _head = 0;
+
+    return true;
+}
+
+bool txring::is_open() const
+{
+    return _fd >= 0;
+}
+
+uint8_t* txring::alloc()
+{
+    if (_fd < 0)
+        return NULL;
+
+    struct tpacket2_hdr* hdr = (struct tpacket2_hdr* )(_ring + (size_t)_head * FRAME_SIZE);
+
+    // Ring's full; send what's queued, in case that frees the slot.
+    if ((hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) && _queued) {
+        flush();
+    }
+
+    __sync_synchronize();
+
+    if (hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+        return NULL;
+
+    return (uint8_t* )hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+}
+
+void txring::commit(size_t len)
+{
+    struct tpacket2_hdr* hdr = (struct tpacket2_hdr* )(_ring + (size_t)_head * FRAME_SIZE);
+
+    hdr->tp_len = len;
+
+    // The frame must be in place before the kernel can see the status.
+    __sync_synchronize();
+
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+    _head = (_head + 1) % _nr;
+    _queued++;
+}
+
+bool txring::flush()
+{
+    if (!_queued)
+        return true;
+
+    if (send(_fd, NULL, 0, MSG_DONTWAIT) < 0) {
+        logger::error() << "txring::flush() failed: " << logger::err();
+        return false;
+    }
+
+    _queued = 0;
+    return true;
+}
+
+NDPPD_NS_END
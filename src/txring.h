@@ -0,0 +1,86 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// A PACKET_TX_RING on an interface. Frames are written straight into
+// memory shared with the kernel, and all that have been queued are sent
+// with a single system call once per main loop iteration, rather than
+// one call per packet.
+class txring {
+public:
+    enum {
+        // Largest frame that fits in a slot.
+        FRAME_MAX = 192
+    };
+
+    txring();
+
+    ~txring();
+
+    // Sets the number of frames in the ring of each interface. 0, the
+    // default, disables the rings. Must be set before any interfaces are
+    // opened.
+    static void frames(int n);
+
+    static int frames();
+
+    // Sets up the ring on the interface 'index', in the current network
+    // namespace.
+    bool open(int index, const std::string& name);
+
+    bool is_open() const;
+
+    // Returns a slot to write a frame of up to FRAME_MAX bytes into, or NULL if
+    // the ring is full. The frame is queued by commit().
+    uint8_t* alloc();
+
+    void commit(size_t len);
+
+    // Sends what has been queued. On failure, it's tried again on the
+    // next call.
+    bool flush();
+
+private:
+    enum {
+        FRAME_SIZE = 256,
+        BLOCK_SIZE = 4096
+    };
+
+    static int _frames;
+
+    int _fd;
+
+    uint8_t* _ring;
+
+    // Number of frames, the next one to use, and how many are queued.
+    int _nr, _head, _queued;
+
+    // Not copyable.
+    txring(const txring&);
+
+    txring& operator=(const txring&);
+};
+
+NDPPD_NS_END